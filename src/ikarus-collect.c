@@ -27,8 +27,13 @@
 #include <sys/time.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
 #define forward_ptr ((ikptr)-1)
+#define busy_ptr ((ikptr)-2)
+#define oldest_gen (generation_count - 1)
 #define minimum_heap_size (pagesize * 1024 * 4)
 #define maximum_heap_size (pagesize * 1024 * 8)
 #define minimum_stack_size (pagesize * 128)
@@ -68,6 +73,9 @@ typedef struct{
 #define meta_pair 4
 #define meta_symbol 5
 #define meta_count 6
+#if meta_count != gc_copied_count
+#error "gc_copied_count must match meta_count"
+#endif
 
 static int extension_amount[meta_count] = {
   1 * pagesize,
@@ -87,6 +95,21 @@ static unsigned int meta_mt[meta_count] = {
   symbols_mt
 };
 
+/* which of pcb->old_holes each meta takes its holes from */
+#define hole_pairs   0   /* holes of a single pair_size */
+#define hole_ptrs    1
+#define hole_symbols 2
+#define hole_data    3
+
+static int meta_hole_kind[meta_count] = {
+  hole_ptrs,
+  -1,
+  hole_data,
+  -1,
+  hole_pairs,
+  hole_symbols
+};
+
 typedef struct gc_t{
   meta_t meta [meta_count];
   qupages_t* queues [meta_count];
@@ -99,8 +122,113 @@ typedef struct gc_t{
   ikptr tconc_base;
   ikpages* tconc_queue;
   ik_ptr_page* forward_list;
+  ik_ptr_page* ephemerons;      /* copied, with keys not known live */
+  struct gc_par_t* par;
+  struct ikmark* mark;
+  struct ikcensus* census;      /* only in a full copying collection */
+  long int copied[meta_count];  /* bytes, for the gc event */
+  long int code_count;          /* code objects relocated */
 } gc_t;
 
+/* Parallel collection:
+ * When pcb->collect_threads is more than one, collections of generation
+ * parallel_collect_gen and up are traced by that many threads.  Each
+ * thread owns a gc_t with its own meta buffers, queues, and tconc pages.
+ * A thread that runs out of work goes idle; the busy ones then hand
+ * their pending queue entries over to the shared pool in par->work.
+ *
+ * An object is claimed by swapping its first word with busy_ptr before
+ * it is copied.  The forwarding address is stored before the
+ * forward_ptr, so a thread that sees busy_ptr only has to wait for the
+ * copy to finish.  Mapping new pages (and the segment vector updates
+ * that come with it) is serialized by par->lock.  Everything other
+ * than collect_loop (dirty pages, guardians, weak pairs, ...) is still
+ * done by the collecting thread alone.
+ */
+
+#define parallel_collect_gen 2
+#define max_collect_threads 64
+#define min_shared_scan (32 * wordsize)
+
+typedef struct gc_par_t{
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;   /* work was shared, or tracing is done */
+  pthread_cond_t start_cv;  /* a new round of tracing started */
+  pthread_cond_t done_cv;   /* a worker finished its round */
+  qupages_t* work[meta_count];
+  int nthreads;             /* including the collecting thread */
+  volatile int idle;
+  int done;
+  int round;
+  int finished;
+  int quit;
+  gc_t* workers;            /* nthreads-1 of them */
+  pthread_t* threads;
+} gc_par_t;
+
+static inline void
+gc_lock(gc_t* gc){
+  if(gc->par){
+    pthread_mutex_lock(&gc->par->lock);
+  }
+}
+
+static inline void
+gc_unlock(gc_t* gc){
+  if(gc->par){
+    pthread_mutex_unlock(&gc->par->lock);
+  }
+}
+
+static inline ikptr
+gc_mmap_typed(long int size, unsigned int type, gc_t* gc){
+  gc_lock(gc);
+  ikptr mem = ik_mmap_typed(size, type, gc->pcb);
+  gc->segment_vector = gc->pcb->segment_vector;
+  gc_unlock(gc);
+  return mem;
+}
+
+/* the segment vector entry of page idx.  The copy of a worker goes
+ * stale when another one extends the tables for a page it maps, so it
+ * is read again under the lock then. */
+static inline unsigned int
+gc_segment(gc_t* gc, long int idx){
+  if(gc->par &&
+     (__atomic_load_n(&gc->pcb->segment_vector, __ATOMIC_ACQUIRE) !=
+      gc->segment_vector)){
+    gc_lock(gc);
+    gc->segment_vector = gc->pcb->segment_vector;
+    gc_unlock(gc);
+  }
+  return gc->segment_vector[idx];
+}
+
+static inline ikptr
+gc_first_word(ikptr x, int tag){
+  return __atomic_load_n((ikptr*)(long)(x-tag), __ATOMIC_ACQUIRE);
+}
+
+static inline void
+gc_forward(ikptr x, int tag, ikptr y){
+  ref(x, wordsize-tag) = y;
+  __atomic_store_n((ikptr*)(long)(x-tag), forward_ptr, __ATOMIC_RELEASE);
+}
+
+/* returns the first word of x once no other thread is copying it */
+static ikptr
+gc_wait_busy(ikptr x, int tag){
+  int spins = 0;
+  ikptr fst;
+  while((fst = gc_first_word(x, tag)) == busy_ptr){
+    if(++spins > 64){
+      sched_yield();
+      spins = 0;
+    }
+  }
+  return fst;
+}
+
 static void handle_guardians(gc_t* gc);
 static void gc_finalize_guardians(gc_t* gc);
 
@@ -113,6 +241,9 @@ next_gen_tag[generation_count] = {
   (0 << meta_dirty_shift) | 4 | new_gen_tag
 };
 
+static ikptr
+take_hole(long int size, gc_t* gc, int meta_id, ikptr* hole_end);
+
 static ikptr
 meta_alloc_extending(long int size, gc_t* gc, int meta_id){
   long int mapsize = align_to_next_page(size);
@@ -135,11 +266,19 @@ meta_alloc_extending(long int size, gc_t* gc, int meta_id){
       x += wordsize;
     }
   }
-  ikptr mem = ik_mmap_typed(
+  ikptr hole_end;
+  ikptr hole = take_hole(size, gc, meta_id, &hole_end);
+  if(hole){
+    meta->ap = hole + size;
+    meta->aq = hole;
+    meta->ep = hole_end;
+    meta->base = hole;
+    return hole;
+  }
+  ikptr mem = gc_mmap_typed(
       mapsize, 
       meta_mt[meta_id] | gc->collect_gen_tag,
-      gc->pcb);
-  gc->segment_vector = gc->pcb->segment_vector;
+      gc);
   meta->ap = mem + size;
   meta->aq = mem;
   meta->ep = mem + mapsize;
@@ -153,6 +292,7 @@ meta_alloc_extending(long int size, gc_t* gc, int meta_id){
 static inline ikptr
 meta_alloc(long int size, gc_t* gc, int meta_id){
   assert(size == align(size));
+  gc->copied[meta_id] += size;
   meta_t* meta = &gc->meta[meta_id];
   ikptr ap = meta->ap;
   ikptr ep = meta->ep;
@@ -174,11 +314,11 @@ gc_alloc_new_ptr(int size, gc_t* gc){
 static inline ikptr 
 gc_alloc_new_large_ptr(int size, gc_t* gc){
   int memreq = align_to_next_page(size);
+  gc->copied[meta_ptrs] += size;
   ikptr mem = 
-      ik_mmap_typed(memreq, 
+      gc_mmap_typed(memreq, 
         pointers_mt | large_object_tag | gc->collect_gen_tag,
-        gc->pcb);
-  gc->segment_vector = gc->pcb->segment_vector;
+        gc);
   qupages_t* p = ik_malloc(sizeof(qupages_t));
   p->p = mem;
   p->q = mem+size;
@@ -193,11 +333,19 @@ static inline void
 enqueue_large_ptr(ikptr mem, int size, gc_t* gc){
   long int i = page_index(mem);
   long int j = page_index(mem+size-1);
+  gc_lock(gc);
+  gc->segment_vector = gc->pcb->segment_vector;
+  if((gc->segment_vector[i] & gen_mask) > gc->collect_gen){
+    /* another thread got to it first */
+    gc_unlock(gc);
+    return;
+  }
   while(i<=j){
     gc->segment_vector[i] = 
       pointers_mt | large_object_tag | gc->collect_gen_tag;
     i++;
   }
+  gc_unlock(gc);
   qupages_t* p = ik_malloc(sizeof(qupages_t));
   p->p = mem;
   p->q = mem+size;
@@ -205,6 +353,32 @@ enqueue_large_ptr(ikptr mem, int size, gc_t* gc){
   gc->queues[meta_ptrs] = p;
 }
 
+/* large strings and bytevectors have their pages to themselves: they
+ * are copied there once and are promoted by retagging from then on */
+static inline ikptr
+gc_alloc_new_large_data(long int size, gc_t* gc){
+  gc->copied[meta_data] += size;
+  return gc_mmap_typed(align_to_next_page(size),
+           data_mt | large_object_tag | gc->collect_gen_tag,
+           gc);
+}
+
+static inline void
+retag_large_data(ikptr mem, long int size, gc_t* gc){
+  long int i = page_index(mem);
+  long int j = page_index(mem+size-1);
+  gc_lock(gc);
+  gc->segment_vector = gc->pcb->segment_vector;
+  if((gc->segment_vector[i] & gen_mask) <= gc->collect_gen){
+    while(i<=j){
+      gc->segment_vector[i] = 
+        data_mt | large_object_tag | gc->collect_gen_tag;
+      i++;
+    }
+  }
+  gc_unlock(gc);
+}
+
 
 static inline ikptr 
 gc_alloc_new_symbol_record(gc_t* gc){
@@ -229,11 +403,10 @@ gc_alloc_new_weak_pair(gc_t* gc){
   ikptr ep = meta->ep;
   ikptr nap = ap + pair_size;
   if(nap > ep){
-      ikptr mem = ik_mmap_typed(
+      ikptr mem = gc_mmap_typed(
                    pagesize, 
                    meta_mt[meta_weak] | gc->collect_gen_tag,
-                   gc->pcb);
-      gc->segment_vector = gc->pcb->segment_vector;
+                   gc);
       meta->ap = mem + pair_size;
       meta->aq = mem;
       meta->ep = mem + pagesize;
@@ -258,8 +431,11 @@ gc_alloc_new_code(long int size, gc_t* gc){
     return meta_alloc(size, gc, meta_code);
   } else {
     long int memreq = align_to_next_page(size);
+    gc->copied[meta_code] += size;
+    gc_lock(gc);
     ikptr mem = ik_mmap_code(memreq, gc->collect_gen, gc->pcb);
     gc->segment_vector = gc->pcb->segment_vector;
+    gc_unlock(gc);
     qupages_t* p = ik_malloc(sizeof(qupages_t));
     p->p = mem;
     p->q = mem+size;
@@ -271,8 +447,8 @@ gc_alloc_new_code(long int size, gc_t* gc){
 }
 
 static void 
-add_to_collect_count(ikpcb* pcb, int bytes){
-  int minor = bytes + pcb->allocation_count_minor;
+add_to_collect_count(ikpcb* pcb, long int bytes){
+  long int minor = bytes + pcb->allocation_count_minor;
   while(minor >= most_bytes_in_minor){
     minor -= most_bytes_in_minor;
     pcb->allocation_count_major++;
@@ -292,12 +468,14 @@ gc_tconc_push_extending(gc_t* gc, ikptr tcbucket){
     p->next = gc->tconc_queue;
     gc->tconc_queue = p;
   }
+  gc_lock(gc);
   ikptr ap = 
      ik_mmap_typed(pagesize, 
         meta_mt[meta_ptrs] | gc->collect_gen_tag,
         gc->pcb);
   add_to_collect_count(gc->pcb, pagesize);
   gc->segment_vector = gc->pcb->segment_vector;
+  gc_unlock(gc);
   bzero((char*)(long)ap, pagesize);
   ikptr nap = ap + 2*wordsize;
   gc->tconc_base = ap;
@@ -320,6 +498,24 @@ gc_tconc_push(gc_t* gc, ikptr tcbucket){
 }
 
 
+/* a weak hashtable keeps the key of a tcbucket in a weak pair, and
+ * the bucket needs a rehash when the key in there moves */
+static inline ikptr
+tcbucket_key(gc_t* gc, ikptr key){
+  if((tagof(key) != pair_tag) ||
+     ((gc_segment(gc, page_index(key)) & type_mask) != weak_pairs_type)){
+    return key;
+  }
+  ikptr a = gc_first_word(key, pair_tag);
+  if(a == busy_ptr){
+    a = gc_wait_busy(key, pair_tag);
+  }
+  if(a == forward_ptr){
+    a = ref(ref(key, off_cdr), off_car);
+  }
+  return a;
+}
+
 #ifndef NDEBUG
 static ikptr add_object_proc(gc_t* gc, ikptr x, char* caller);
 #define add_object(gc,x,caller) add_object_proc(gc,x,caller)
@@ -331,8 +527,18 @@ static ikptr add_object_proc(gc_t* gc, ikptr x);
 static void collect_stack(gc_t*, ikptr top, ikptr base);
 static void collect_locatives(gc_t*, callback_locative*);
 static void collect_loop(gc_t*);
+static void gc_par_start(gc_t*, int nthreads);
+static void gc_par_stop(gc_t*);
 static void fix_weak_pointers(gc_t*);
+static void fix_ephemerons(gc_t*);
+static void keep_table_symbols(gc_t*, ikptr st);
+static void drop_table_symbols(gc_t*, ikptr st, long int* count);
 static void gc_add_tconcs(gc_t*);
+static void reset_weak_nursery(ikpcb*);
+static void gc_mark_old(gc_t*, ikptr x);
+static int marking_collect_gen(ikpcb*, int gen, int* remark);
+static void mark_slice(gc_t*);
+static void mark_finish(gc_t*);
 
 /* ik_collect is called from scheme under the following conditions:
  * 1. An attempt is made to allocate a small object and the ap is above
@@ -355,26 +561,155 @@ ikpcb* ik_collect_vararg(int req, ikpcb* pcb){
   return ik_collect(req, pcb);
 }
 
-static int collection_id_to_gen(int id){
-  if((id & 255) == 255) { return 4; }
-  if((id & 63) == 63) { return 3; }
-  if((id & 15) == 15) { return 2; }
-  if((id & 3) == 3) { return 1; }
-  return 0;
+static int collection_id_to_gen(int id, int radix){
+  /* generation g is collected every radix^g collections */
+  unsigned long int n = ((unsigned int)id) + 1;
+  int gen = 0;
+  while((gen < oldest_gen) && ((n % radix) == 0)){
+    n /= radix;
+    gen++;
+  }
+  return gen;
+}
+
+/* Adaptive policy:
+ * A generation is collected once it holds more pages than its
+ * allowance.  Generation 1 is allowed a 1/radix of the nursery, and
+ * every older generation radix times as much as the one before.  The
+ * oldest generation counts only what it gained since its last
+ * collection, and is also allowed to grow by collect_growth percent.
+ * Each allowance is scaled by gen_scale, which doubles when most of a
+ * generation survives its collection (copying it again is a waste)
+ * and halves when most of it dies.
+ */
+
+#define max_gen_scale 16
+
+static int
+adaptive_collect_gen(ikpcb* pcb){
+  long int allowance = (pcb->heap_size >> pageshift) / pcb->collect_radix;
+  int gen = 0;
+  int g;
+  for(g=1; g<generation_count; g++){
+    long int pages = pcb->gen_pages[g];
+    long int limit = allowance;
+    if(g == oldest_gen){
+      long int grown = (pcb->oldest_base_pages * pcb->collect_growth) / 100;
+      pages -= pcb->oldest_base_pages;
+      if(grown > limit){
+        limit = grown;
+      }
+    }
+    if(pages > limit * pcb->gen_scale[g]){
+      gen = g;
+    }
+    allowance *= pcb->collect_radix;
+  }
+  return gen;
+}
+
+static int
+policy_collect_gen(ikpcb* pcb){
+  if(pcb->full_collect_pending){
+    pcb->full_collect_pending = 0;
+    return oldest_gen;
+  }
+  if(pcb->collect_policy == collect_adaptive){
+    return adaptive_collect_gen(pcb);
+  }
+  return collection_id_to_gen(pcb->collection_id, pcb->collect_radix);
+}
+
+static void
+update_gen_stats(ikpcb* pcb, int gen, long int collected, long int survived){
+  int survival = 
+    (collected > 0) ? (int)((survived * 100) / collected) : 0;
+  if(survival > 100){
+    survival = 100;
+  }
+  pcb->gen_survival[gen] = survival;
+  if((survival >= 75) && (pcb->gen_scale[gen] < max_gen_scale)){
+    pcb->gen_scale[gen] *= 2;
+  } 
+  else if((survival < 25) && (pcb->gen_scale[gen] > 1)){
+    pcb->gen_scale[gen] /= 2;
+  }
+}
+
+
+/* Nursery sizing:
+ * After a collection, the nursery is reallocated at nursery_size, or
+ * at heap_growth percent of the older generations when that is more,
+ * so that a big heap is collected less often.  Under a max_heap, the
+ * nursery gets what the older generations leave.  A heap that goes
+ * over forces a full copying collection next, and if the heap is
+ * still over after that one, we give up.
+ */
+
+#define minimum_nursery_size (pagesize * 16)
+
+static long int
+old_heap_bytes(ikpcb* pcb){
+  long int pages = 0;
+  int g;
+  for(g=0; g<generation_count; g++){
+    pages += pcb->gen_pages[g];
+  }
+  return pages << pageshift;
 }
 
+static long int
+nursery_target(ikpcb* pcb){
+  long int old_bytes = old_heap_bytes(pcb);
+  long int size = pcb->nursery_size;
+  if(pcb->heap_growth){
+    long int grown = (old_bytes / 100) * pcb->heap_growth;
+    if(grown > size){
+      size = grown;
+    }
+  }
+  if(pcb->max_heap && (size > pcb->max_heap - old_bytes)){
+    size = pcb->max_heap - old_bytes;
+  }
+  if(size < minimum_nursery_size){
+    size = minimum_nursery_size;
+  }
+  return align_to_next_page(size);
+}
 
+static void
+check_max_heap(ikpcb* pcb, int full){
+  if(pcb->max_heap == 0){
+    return;
+  }
+  long int old_bytes = old_heap_bytes(pcb);
+  if(old_bytes + minimum_nursery_size <= pcb->max_heap){
+    return;
+  }
+  if(full){
+    fprintf(stderr, 
+        "ikarus: heap exhausted (%ld bytes live, maximum is %ld)\n",
+        old_bytes, pcb->max_heap);
+    exit(-1);
+  }
+  pcb->full_collect_pending = 1;
+  pcb->compact_pending = 1;
+}
 
 static void scan_dirty_pages(gc_t*);
+static void scan_remembered_set(gc_t*);
 
 static void deallocate_unused_pages(gc_t*);
 
-static void fix_new_pages(gc_t* gc);
+static long int fix_new_pages(gc_t* gc);
 
 extern void verify_integrity(ikpcb* pcb, char*);
 
+/* the allocation redline, unless lowered for a sample */
+#define heap_redline(pcb) ((pcb)->heap_base + (pcb)->heap_size - 2 * pagesize)
+
 ikptr ik_collect_check(unsigned long int req, ikpcb* pcb){
-  long int bytes = ((long int)pcb->allocation_redline) -
+  long int bytes = ((long int)heap_redline(pcb)) -
                    ((long int)pcb->allocation_pointer);
   if (bytes >= req) {
     return true_object;
@@ -384,164 +719,906 @@ ikptr ik_collect_check(unsigned long int req, ikpcb* pcb){
   }
 }
 
-ikpcb* 
-ik_collect(unsigned long int mem_req, ikpcb* pcb){
-#ifndef NDEBUG
-  verify_integrity(pcb, "entry");
-#endif
-
-  { /* ACCOUNTING */
-    long int bytes = ((long int)pcb->allocation_pointer) -
-                     ((long int)pcb->heap_base);
-    add_to_collect_count(pcb, bytes);
-  }
-
-  struct rusage t0, t1;
-  struct timeval rt0, rt1;
-  gettimeofday(&rt0, 0);
-  getrusage(RUSAGE_SELF, &t0);
+/* Telemetry:
+ * every collection leaves an ikgcevent with its pause, the time spent
+ * in each phase, the bytes copied into each meta type, and the
+ * resident set size after it, so that the events are also the time
+ * series of the memory used (the stats take theirs from there).  The last
+ * gc_event_count of them are kept in a ring for (collect-events), and
+ * each one is also appended as a line to pcb->gc_event_log if open.
+ */
 
-  pcb->collect_key = false_object;
-  gc_t gc;
-  bzero(&gc, sizeof(gc_t));
-  gc.pcb = pcb;
-  gc.segment_vector = pcb->segment_vector;
+#define gc_phase_dirty 0
+#define gc_phase_roots 1
+#define gc_phase_trace 2
+#define gc_phase_guardians 3
+#define gc_phase_mark 4
+#define gc_phase_weak 5
 
-  gc.collect_gen = collection_id_to_gen(pcb->collection_id);
-  gc.collect_gen_tag = next_gen_tag[gc.collect_gen];
-  pcb->collection_id++;
-#ifndef NDEBUG
-  fprintf(stderr, "ik_collect entry %ld free=%ld (collect gen=%d/id=%d)\n",
-      mem_req,
-       pcb->allocation_redline - pcb->allocation_pointer,
-      gc.collect_gen, pcb->collection_id-1);
-#endif
+static long int
+timeval_usecs(struct timeval* t){
+  return t->tv_sec * 1000000L + t->tv_usec;
+}
 
-  /* cache heap-pages to delete later */
-  ikpages* old_heap_pages = pcb->heap_pages;
-  pcb->heap_pages = 0;
+/* usecs since *t, which becomes now */
+static long int
+gc_lap(long int* t){
+  struct timeval now;
+  gettimeofday(&now, 0);
+  long int u = timeval_usecs(&now);
+  long int d = u - *t;
+  *t = u;
+  return d;
+}
 
-  /* the roots are:
-   *  0. dirty pages not collected in this run
-   *  1. the stack
-   *  2. the next continuation
-   *  3. the symbol-table
-   */
+static void
+record_gc_event(ikpcb* pcb, ikgcevent* ev){
+  if(pcb->gc_events == 0){
+    pcb->gc_events = ik_malloc(gc_event_count * sizeof(ikgcevent));
+  }
+  pcb->gc_events[pcb->gc_event_total % gc_event_count] = *ev;
+  pcb->gc_event_total++;
+  FILE* f = pcb->gc_event_log;
+  if(f){
+    int i;
+    fprintf(f, "%ld %ld %ld", ev->id, ev->collect_gen, ev->pause);
+    for(i=0; i<gc_phase_count; i++){
+      fprintf(f, " %ld", ev->phase[i]);
+    }
+    for(i=0; i<gc_copied_count; i++){
+      fprintf(f, " %ld", ev->copied[i]);
+    }
+    fprintf(f, " %ld\n", ev->rss);
+    fflush(f);
+  }
+}
 
-  scan_dirty_pages(&gc);
+/* Census:
+ * heap-census runs a full copying collection with pcb->census set.
+ * Every object that collection copies is counted once, before it is
+ * copied, by kind and, for records, by rtd.  If a graph file is open,
+ * each object is also written out with the objects it points to, and
+ * so are the roots; the addresses are the untagged ones from before
+ * the collection.  Without a census, the collection only tests
+ * gc->census for each object it copies.
+ */
 
-  collect_stack(&gc, pcb->frame_pointer, pcb->frame_base - wordsize);
-  collect_locatives(&gc, pcb->callbacks);
-  pcb->next_k = add_object(&gc, pcb->next_k, "next_k"); 
-  pcb->symbol_table = add_object(&gc, pcb->symbol_table, "symbol_table"); 
-  pcb->gensym_table = add_object(&gc, pcb->gensym_table, "gensym_table"); 
-  pcb->arg_list = add_object(&gc, pcb->arg_list, "args_list_foo");
-  pcb->base_rtd = add_object(&gc, pcb->base_rtd, "base_rtd");
-  if(pcb->root0) *(pcb->root0) = add_object(&gc, *(pcb->root0), "root0");
-  if(pcb->root1) *(pcb->root1) = add_object(&gc, *(pcb->root1), "root1");
+#define census_pair                 0
+#define census_weak_pair            1
+#define census_symbol               2
+#define census_procedure            3
+#define census_vector               4
+#define census_record               5
+#define census_code                 6
+#define census_continuation         7
+#define census_system_continuation  8
+#define census_tcbucket             9
+#define census_port                10
+#define census_string              11
+#define census_bytevector          12
+#define census_flonum              13
+#define census_bignum              14
+#define census_ratnum              15
+#define census_compnum             16
+#define census_cflonum             17
+#define census_pointer             18
+#define census_ephemeron           19
+#define census_kinds               20
 
-  /* now we trace all live objects */
-  collect_loop(&gc);
-  
-  /* next we trace all guardian/guarded objects,
-     the procedure does a collect_loop at the end */
-  handle_guardians(&gc);
-#ifndef NDEBUG
-  fprintf(stderr, "done\n");
-#endif
-  collect_loop(&gc);
+/* as in heap-census */
+static char* census_names[census_kinds] = {
+  "pair", "weak-pair", "symbol", "procedure", "vector", "record", "code",
+  "continuation", "system-continuation", "hashtable-bucket", "port",
+  "string", "bytevector", "flonum", "bignum", "ratnum", "compnum",
+  "cflonum", "pointer", "ephemeron"
+};
 
-  /* does not allocate, only bwp's dead pointers */
-  fix_weak_pointers(&gc); 
-  /* now deallocate all unused pages */
-  deallocate_unused_pages(&gc);
+typedef struct ikcensus{
+  long int count[census_kinds];
+  long int bytes[census_kinds];
+  ikptr* rtds;              /* rtd, count, bytes; open addressing */
+  long int rtd_slots;       /* a power of two */
+  long int rtd_count;
+  FILE* graph;
+  ikptr owner;              /* the continuation whose frames are traced */
+  int done;
+} ikcensus;
 
-  fix_new_pages(&gc);
-  gc_finalize_guardians(&gc);
+#define census_rtd_slots 256
 
-  pcb->allocation_pointer = pcb->heap_base;
-  /* does not allocate */
-  gc_add_tconcs(&gc);
-  /* does not allocate */
-#ifndef NDEBUG
-  fprintf(stderr, "done\n");
-#endif
-  pcb->weak_pairs_ap = 0;
-  pcb->weak_pairs_ep = 0;
+static long int
+census_rtd_index(ikcensus* c, ikptr rtd){
+  long int mask = c->rtd_slots - 1;
+  long int i = (rtd >> align_shift) & mask;
+  while(c->rtds[3*i] && (c->rtds[3*i] != rtd)){
+    i = (i + 1) & mask;
+  }
+  return i;
+}
 
-#if accounting
-    fprintf(stderr, 
-        "[%d cons|%d sym|%d cls|%d vec|%d rec|%d cck|%d str|%d htb]\n",
-        pair_count,
-        symbol_count,
-        closure_count,
-        vector_count,
-        record_count,
-        continuation_count,
-        string_count,
-        htable_count);
-    pair_count = 0;
-    symbol_count = 0;
-    closure_count = 0;
-    vector_count = 0;
-    record_count = 0;
-    continuation_count = 0;
-    string_count = 0;
-    htable_count = 0;
-#endif
-  //ik_dump_metatable(pcb);
-#ifndef NDEBUG
-  fprintf(stderr, "collect done\n");
-#endif
+static void
+census_count_rtd(ikcensus* c, ikptr rtd, long int bytes){
+  if(2 * c->rtd_count >= c->rtd_slots){
+    ikptr* old = c->rtds;
+    long int n = c->rtd_slots;
+    c->rtd_slots = n ? 2 * n : census_rtd_slots;
+    c->rtds = ik_malloc(3 * c->rtd_slots * sizeof(ikptr));
+    bzero(c->rtds, 3 * c->rtd_slots * sizeof(ikptr));
+    long int i;
+    for(i=0; i<n; i++){
+      if(old[3*i]){
+        long int j = census_rtd_index(c, old[3*i]);
+        memcpy(&c->rtds[3*j], &old[3*i], 3 * sizeof(ikptr));
+      }
+    }
+    if(old){
+      ik_free(old, 3 * n * sizeof(ikptr));
+    }
+  }
+  long int i = census_rtd_index(c, rtd);
+  if(c->rtds[3*i] == 0){
+    c->rtds[3*i] = rtd;
+    c->rtd_count++;
+  }
+  c->rtds[3*i+1]++;
+  c->rtds[3*i+2] += bytes;
+}
 
+static int
+census_is_ptr(ikptr x){
+  return (! is_fixnum(x)) && (tagof(x) != immediate_tag);
+}
 
-  /* delete all old heap pages */
-  if(old_heap_pages){
-    ikpages* p = old_heap_pages;
-    do{
-      ikpages* next = p->next;
-      ik_munmap_from_segment(p->base, p->size, pcb);
-      ik_free(p, sizeof(ikpages));
-      p=next;
-    } while(p);
-    old_heap_pages = 0;
+static void
+census_field(FILE* f, ikptr x){
+  if(census_is_ptr(x)){
+    fprintf(f, " 0x%lx", (long int)(x - tagof(x)));
   }
+}
 
-  unsigned long int free_space = 
-    ((unsigned long int)pcb->allocation_redline) - 
-    ((unsigned long int)pcb->allocation_pointer);
-  if((free_space <= mem_req) || (pcb->heap_size < IK_HEAPSIZE)){
-#ifndef NDEBUG
-    fprintf(stderr, "REQ=%ld, got %ld\n", mem_req, free_space);
-#endif
-    long int memsize = (mem_req > IK_HEAPSIZE) ? mem_req : IK_HEAPSIZE;
-    memsize = align_to_next_page(memsize);
-    ik_munmap_from_segment(
-        pcb->heap_base,
-        pcb->heap_size,
-        pcb);
-    ikptr ptr = ik_mmap_mixed(memsize+2*pagesize, pcb);
-    pcb->allocation_pointer = ptr;
-    pcb->allocation_redline = ptr+memsize;
-    pcb->heap_base = ptr;
-    pcb->heap_size = memsize+2*pagesize;
+/* the words of p from offset i up to offset j */
+static void
+census_fields(FILE* f, ikptr p, long int i, long int j){
+  for(; i<j; i+=wordsize){
+    census_field(f, ref(p, i));
   }
+}
 
-#ifndef NDEBUG
-  ikptr x = pcb->allocation_pointer;
-  while(x < pcb->allocation_redline){
-    ref(x, 0) = (ikptr)(0x1234FFFF);
-    x+=wordsize;
+/* counts x, and writes its node with the objects it points to.  pairs
+ * and code have their own. */
+static void
+census_object(gc_t* gc, ikptr x, ikptr fst){
+  ikcensus* c = gc->census;
+  FILE* f = c->graph;
+  int tag = tagof(x);
+  ikptr p = x - tag;
+  int kind;
+  long int bytes;
+  long int i = 0;           /* the pointer fields, as offsets from p */
+  long int j = 0;
+  if(tag == closure_tag){
+    long int size =
+      disp_closure_data + ref(fst, disp_code_freevars - disp_code_data);
+    kind = census_procedure;
+    bytes = align(size);
+    i = disp_closure_data;
+    j = size;
   }
-#endif
-#ifndef NDEBUG
-  verify_integrity(pcb, "exit");
-#endif
-
-  getrusage(RUSAGE_SELF, &t1);
-  gettimeofday(&rt1, 0);
-
-  pcb->collect_utime.tv_usec += t1.ru_utime.tv_usec - t0.ru_utime.tv_usec;
+  else if(tag == string_tag){
+    kind = census_string;
+    bytes = align(unfix(fst)*string_char_size + disp_string_data);
+  }
+  else if(tag == bytevector_tag){
+    kind = census_bytevector;
+    bytes = align(unfix(fst) + disp_bytevector_data + 1);
+  }
+  else if(is_fixnum(fst)){
+    kind = census_vector;
+    bytes = align(fst + disp_vector_data);
+    i = disp_vector_data;
+    j = fst + disp_vector_data;
+  }
+  else if(fst == symbol_record_tag){
+    kind = census_symbol;
+    bytes = symbol_record_size;
+    i = disp_symbol_record_string;
+    j = symbol_record_size;
+  }
+  else if(tagof(fst) == rtd_tag){
+    long int size = ref(fst, off_rtd_length);
+    kind = census_record;
+    bytes = align(disp_record_data + size);
+    i = 0;
+    j = disp_record_data + size;
+    census_count_rtd(c, fst, bytes);
+  }
+  else if(fst == continuation_tag){
+    kind = census_continuation;
+    bytes = continuation_size + align(ref(p, disp_continuation_size));
+    i = disp_continuation_next;
+    j = continuation_size;
+  }
+  else if(fst == system_continuation_tag){
+    kind = census_system_continuation;
+    bytes = system_continuation_size;
+    i = disp_system_continuation_next;
+    j = i + wordsize;
+  }
+  else if(tagof(fst) == pair_tag){
+    kind = census_tcbucket;
+    bytes = tcbucket_size;
+    j = tcbucket_size;
+  }
+  else if((((long int)fst) & port_mask) == port_tag){
+    kind = census_port;
+    bytes = port_size;
+    i = wordsize;
+    j = port_size;
+  }
+  else if(fst == flonum_tag){
+    kind = census_flonum;
+    bytes = flonum_size;
+  }
+  else if((fst & bignum_mask) == bignum_tag){
+    long int len = ((unsigned long int)fst) >> bignum_length_shift;
+    kind = census_bignum;
+    bytes = align(disp_bignum_data + len*wordsize);
+  }
+  else if(fst == ratnum_tag){
+    kind = census_ratnum;
+    bytes = ratnum_size;
+    i = disp_ratnum_num;
+    j = i + 2*wordsize;
+  }
+  else if(fst == compnum_tag){
+    kind = census_compnum;
+    bytes = compnum_size;
+    i = disp_compnum_real;
+    j = i + 2*wordsize;
+  }
+  else if(fst == cflonum_tag){
+    kind = census_cflonum;
+    bytes = cflonum_size;
+    i = disp_cflonum_real;
+    j = i + 2*wordsize;
+  }
+  else if(fst == pointer_tag){
+    kind = census_pointer;
+    bytes = pointer_size;
+  }
+  else if(fst == ephemeron_tag){
+    /* the key is not a reference */
+    kind = census_ephemeron;
+    bytes = ephemeron_size;
+    i = disp_ephemeron_value;
+    j = i + wordsize;
+  }
+  else {
+    /* add_object complains */
+    return;
+  }
+  c->count[kind]++;
+  c->bytes[kind] += bytes;
+  if(f){
+    fprintf(f, "node 0x%lx %s %ld", (long int)p, census_names[kind], bytes);
+    if(kind == census_procedure){
+      fprintf(f, " 0x%lx", (long int)(fst - disp_code_data));
+    }
+    census_fields(f, p, i, j);
+    fprintf(f, "\n");
+  }
+}
+
+static void
+census_pair_object(gc_t* gc, unsigned int t, ikptr x, ikptr fst, ikptr snd){
+  ikcensus* c = gc->census;
+  int kind = ((t & type_mask) == weak_pairs_type) ? census_weak_pair : census_pair;
+  c->count[kind]++;
+  c->bytes[kind] += pair_size;
+  if(c->graph){
+    FILE* f = c->graph;
+    fprintf(f, "node 0x%lx %s %ld", (long int)(x - pair_tag),
+            census_names[kind], (long int)pair_size);
+    if(kind == census_pair){
+      census_field(f, fst);
+    }
+    census_field(f, snd);
+    fprintf(f, "\n");
+  }
+}
+
+/* x is the untagged code object */
+static void
+census_code_object(gc_t* gc, ikptr x, long int size){
+  ikcensus* c = gc->census;
+  c->count[census_code]++;
+  c->bytes[census_code] += size;
+  if(c->graph){
+    FILE* f = c->graph;
+    fprintf(f, "node 0x%lx %s %ld", (long int)x, census_names[census_code], size);
+    census_field(f, ref(x, disp_code_reloc_vector));
+    census_field(f, ref(x, disp_code_annotation));
+    fprintf(f, "\n");
+  }
+}
+
+/* x is a root, or is in a frame of the continuation being copied */
+static void
+census_ref(gc_t* gc, ikptr x){
+  ikcensus* c = gc->census;
+  if(c->graph && census_is_ptr(x)){
+    if(c->owner){
+      fprintf(c->graph, "edge 0x%lx 0x%lx\n",
+              (long int)c->owner, (long int)(x - tagof(x)));
+    } else {
+      fprintf(c->graph, "root 0x%lx\n", (long int)(x - tagof(x)));
+    }
+  }
+}
+
+#define add_root(gc,x,caller) \
+  (((gc)->census ? census_ref(gc,x) : (void)0), add_object(gc,x,caller))
+
+/* before the old pages go: the rtds become the copies */
+static void
+census_finish(gc_t* gc){
+  ikcensus* c = gc->census;
+  long int i;
+  for(i=0; i<c->rtd_slots; i++){
+    ikptr rtd = c->rtds[3*i];
+    if(rtd && (gc_first_word(rtd, tagof(rtd)) == forward_ptr)){
+      c->rtds[3*i] = ref(rtd, wordsize-tagof(rtd));
+    }
+  }
+  c->done = 1;
+}
+
+/* Allocation sampling:
+ * with alloc_sample_bytes set in the main pcb, the allocation redline
+ * of a pcb is lowered to where that many more bytes are allocated, so
+ * the alloc-check that compiled code does anyway calls do-overflow
+ * there.  ik_overflow then finds the heap not full, pushes the return
+ * address that do-overflow returns to, as the code object and the
+ * offset into it, onto alloc_samples, once for each interval passed,
+ * and lowers the redline again.
+ */
+
+static int marking_between(ikpcb*);
+
+/* after the allocation pointer or the heap of pcb changed */
+static void
+lower_redline(ikpcb* pcb){
+  ikptr ap = pcb->allocation_pointer;
+  ikptr redline = heap_redline(pcb);
+  long int left = pcb->alloc_sample_left;
+  if(pcb->main_pcb->alloc_sample_bytes && (left < redline - ap)){
+    redline = ap + ((left > 0) ? left : 0);
+  }
+  long int slice = pcb->main_pcb->mark_slice_words * wordsize;
+  if(marking_between(pcb->main_pcb) && (slice < redline - ap)){
+    redline = ap + slice;
+  }
+  pcb->allocation_redline = redline;
+  pcb->alloc_sample_mark = ap;
+}
+
+/* the bytes allocated since the last call, as far as they can be told */
+static void
+count_allocation(ikpcb* pcb){
+  ikptr ap = pcb->allocation_pointer;
+  ikptr mark = pcb->alloc_sample_mark;
+  if((mark < pcb->heap_base) || (mark > ap)){
+    mark = pcb->heap_base;
+  }
+  pcb->alloc_sample_left -= ap - mark;
+  pcb->alloc_sample_mark = ap;
+}
+
+/* the code object of the frame below the top one, which is the frame
+ * of do-overflow, and the offset of its return address in *offset */
+static ikptr
+allocating_code(ikpcb* pcb, long int* offset){
+  ikptr top = pcb->frame_pointer;
+  ikptr end = pcb->frame_base - wordsize;
+  if(top >= end){
+    return false_object;
+  }
+  ikptr rp = ref(top, 0);
+  long int framesize = ref(rp, disp_frame_size);
+  if(framesize == 0){
+    framesize = ref(top, wordsize);
+  }
+  top += framesize;
+  if(top >= end){
+    return false_object;
+  }
+  rp = ref(top, 0);
+  long int code_offset = unfix(ref(rp, disp_frame_offset)) - disp_frame_offset;
+  *offset = code_offset;
+  return rp - code_offset - disp_code_data + vector_tag;
+}
+
+static void
+sample_allocation(ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  long int n = main->alloc_sample_bytes;
+  if(pcb->alloc_sample_left > 0){
+    return;
+  }
+  long int offset = 0;
+  ikptr code = allocating_code(pcb, &offset);
+  ik_heap_lock(pcb);
+  while(pcb->alloc_sample_left <= 0){
+    /* no collection until the samples are in */
+    ikptr s = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
+    ref(s, off_car) = code;
+    ref(s, off_cdr) = fix(offset);
+    ikptr p = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
+    ref(p, off_car) = s;
+    ref(p, off_cdr) = main->alloc_samples;
+    main->alloc_samples = p;
+    pcb->alloc_sample_left += n;
+  }
+  ik_heap_unlock(pcb);
+  /* the pairs are not counted */
+  pcb->alloc_sample_mark = pcb->allocation_pointer;
+}
+
+/* n is 0 to stop sampling; the samples taken so far are dropped */
+ikptr
+ikrt_set_alloc_sample_bytes(ikptr n, ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  main->alloc_sample_bytes = unfix(n);
+  main->alloc_samples = null_object;
+  pcb->alloc_sample_left = unfix(n);
+  lower_redline(pcb);
+  return void_object;
+}
+
+ikptr
+ikrt_alloc_samples(ikpcb* pcb){
+  return pcb->main_pcb->alloc_samples;
+}
+
+/* Threads:
+ * every forked thread allocates into a tlab of its own.  A thread that
+ * fills its tlab takes another one while the tlabs taken since the last
+ * collection fit in the nursery of the main pcb, and collects otherwise.
+ * A collection first stops the world (ik_stop_world), then collects
+ * the heap of the main pcb with the roots of every thread, and resets
+ * every tlab, as it resets the nursery.
+ */
+
+/* a fresh tlab of size bytes, the old one is collected with the rest */
+static void
+new_tlab(long int size, ikpcb* pcb){
+  if(pcb->allocation_pointer){
+    ikpages* p = ik_malloc(sizeof(ikpages));
+    p->base = pcb->heap_base;
+    p->size = pcb->heap_size;
+    p->next = pcb->heap_pages;
+    pcb->heap_pages = p;
+  }
+  ikptr ap = ik_mmap_mixed(size, pcb);
+  pcb->heap_base = ap;
+  pcb->heap_size = size;
+  pcb->allocation_pointer = ap;
+  lower_redline(pcb);
+}
+
+static long int
+tlab_request(unsigned long int mem_req, ikpcb* pcb){
+  long int size = pcb->tlab_size;
+  if(size < (long int)mem_req){
+    size = mem_req;
+  }
+  return align_to_next_page(size) + 2 * pagesize;
+}
+
+static void
+ensure_room(unsigned long int mem_req, ikpcb* pcb){
+  unsigned long int free_space = 
+    ((unsigned long int)heap_redline(pcb)) - 
+    ((unsigned long int)pcb->allocation_pointer);
+  if(free_space <= mem_req){
+    new_tlab(tlab_request(mem_req, pcb), pcb);
+  }
+}
+
+/* refills the tlab of a forked thread, or collects.  Returns true if
+ * it collected. */
+ikptr
+ik_make_room(unsigned long int mem_req, ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  if(th && (pcb != pcb->main_pcb)){
+    long int size = tlab_request(mem_req, pcb);
+    pthread_mutex_lock(&th->lock);
+    int ok = (! th->stopping) &&
+             (th->tlab_bytes + size <= pcb->main_pcb->heap_size);
+    if(ok){
+      th->tlab_bytes += size;
+    }
+    pthread_mutex_unlock(&th->lock);
+    if(ok){
+      new_tlab(size, pcb);
+      return false_object;
+    }
+  }
+  ik_collect(mem_req, pcb);
+  return true_object;
+}
+
+/* called by do-overflow, which may only have reached the next sample
+ * point, or the next mark slice */
+ikptr
+ik_overflow(unsigned long int mem_req, ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  if(main->alloc_sample_bytes){
+    count_allocation(pcb);
+    sample_allocation(pcb);
+  }
+  ik_mark_step(pcb);
+  /* the redline was lowered, maybe by a cycle that ended since */
+  if(pcb->allocation_pointer + mem_req <= heap_redline(pcb)){
+    lower_redline(pcb);
+    return false_object;
+  }
+  return ik_make_room(mem_req, pcb);
+}
+
+/* the nursery pages of the threads are collected with those of the
+ * main pcb: the current tlab of a running thread is kept for reuse,
+ * everything else goes on the list freed after the collection */
+static ikpages*
+take_thread_heaps(ikpcb* pcb, ikpages* old_heap_pages, long int* pages){
+  ikpcb* t;
+  for(t=pcb->threads->list; t; t=t->next_thread){
+    ikpages* p = t->heap_pages;
+    t->heap_pages = 0;
+    while(p){
+      ikpages* next = p->next;
+      *pages += p->size >> pageshift;
+      p->next = old_heap_pages;
+      old_heap_pages = p;
+      p = next;
+    }
+    if(t->heap_base){
+      *pages += (t->allocation_pointer - t->heap_base) >> pageshift;
+      if(t->thread_state != thread_running){
+        ikpages* p = ik_malloc(sizeof(ikpages));
+        p->base = t->heap_base;
+        p->size = t->heap_size;
+        p->next = old_heap_pages;
+        old_heap_pages = p;
+        t->heap_base = 0;
+        t->heap_size = 0;
+        t->allocation_pointer = 0;
+        t->allocation_redline = 0;
+      }
+    }
+  }
+  return old_heap_pages;
+}
+
+static void
+collect_thread_roots(gc_t* gc){
+  ikpcb* t;
+  for(t=gc->pcb->threads->list; t; t=t->next_thread){
+    if(t->thread_state == thread_running){
+      if(t->frame_pointer != t->frame_base){
+        /* it has frames, unless it did not start yet */
+        collect_stack(gc, t->frame_pointer, t->frame_base - wordsize);
+      }
+      collect_locatives(gc, t->callbacks);
+      t->next_k = add_root(gc, t->next_k, "thread next_k");
+      t->arg_list = add_root(gc, t->arg_list, "thread arg_list");
+      if(t->root0) *(t->root0) = add_root(gc, *(t->root0), "thread root0");
+      if(t->root1) *(t->root1) = add_root(gc, *(t->root1), "thread root1");
+      t->dynamic_state =
+        add_root(gc, t->dynamic_state, "thread dynamic_state");
+    }
+    if(t->thread_state != thread_joined){
+      t->thread_value = add_root(gc, t->thread_value, "thread value");
+    }
+  }
+}
+
+/* after the collection: the tlabs start over, and the joined threads
+ * are gone */
+static void
+reset_threads(ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  ikpcb* dead = 0;
+  ik_heap_lock(pcb);
+  pthread_mutex_lock(&th->lock);
+  ikpcb** tp = &th->list;
+  while(*tp){
+    ikpcb* t = *tp;
+    if(t->thread_state == thread_joined){
+      *tp = t->next_thread;
+      t->next_thread = dead;
+      dead = t;
+      continue;
+    }
+    t->allocation_pointer = t->heap_base;
+    lower_redline(t);
+    t->collect_key = false_object;
+    t->weak_pairs_ap = 0;
+    t->weak_pairs_ep = 0;
+    t->base_rtd = pcb->base_rtd;
+    t->dirty_vector = pcb->dirty_vector;
+    t->segment_vector = pcb->segment_vector;
+    tp = &t->next_thread;
+  }
+  th->tlab_bytes = 0;
+  pthread_mutex_unlock(&th->lock);
+  ik_heap_unlock(pcb);
+  while(dead){
+    ikpcb* next = dead->next_thread;
+    ik_delete_thread_pcb(dead);
+    dead = next;
+  }
+}
+
+ikpcb* 
+ik_collect(unsigned long int mem_req, ikpcb* self){
+  ikpcb* pcb = self->main_pcb;
+  if(! ik_stop_world(self)){
+    /* another thread collected while this one waited */
+    ensure_room(mem_req, self);
+    return self;
+  }
+  if(pcb->threads){
+    ik_merge_retired_tables(pcb);
+  }
+#ifndef NDEBUG
+  verify_integrity(pcb, "entry");
+#endif
+
+  { /* ACCOUNTING */
+    long int bytes = ((long int)pcb->allocation_pointer) -
+                     ((long int)pcb->heap_base);
+    if(pcb->threads){
+      ikpcb* t;
+      for(t=pcb->threads->list; t; t=t->next_thread){
+        bytes += t->allocation_pointer - t->heap_base;
+      }
+    }
+    add_to_collect_count(pcb, bytes + pcb->large_object_bytes);
+    pcb->large_object_bytes = 0;
+  }
+
+  struct rusage t0, t1;
+  struct timeval rt0, rt1;
+  gettimeofday(&rt0, 0);
+  getrusage(RUSAGE_SELF, &t0);
+
+  pcb->collect_key = false_object;
+  gc_t gc;
+  bzero(&gc, sizeof(gc_t));
+  gc.pcb = pcb;
+  gc.segment_vector = pcb->segment_vector;
+
+  int remark = 0;
+  gc.collect_gen = 
+    marking_collect_gen(pcb, 
+      policy_collect_gen(pcb),
+      &remark);
+  gc.collect_gen_tag = next_gen_tag[gc.collect_gen];
+  gc.mark = pcb->mark_state;
+  if(pcb->census && (gc.collect_gen == oldest_gen) && (gc.mark == 0)){
+    gc.census = pcb->census;
+  }
+  pcb->collection_id++;
+#ifndef NDEBUG
+  fprintf(stderr, "ik_collect entry %ld free=%ld (collect gen=%d/id=%d)\n",
+      mem_req,
+       pcb->allocation_redline - pcb->allocation_pointer,
+      gc.collect_gen, pcb->collection_id-1);
+#endif
+
+  /* cache heap-pages to delete later */
+  ikpages* old_heap_pages = pcb->heap_pages;
+  pcb->heap_pages = 0;
+
+  /* pages in the generations collected, for the survival rate */
+  long int collected_pages = 
+    (pcb->allocation_pointer - pcb->heap_base) >> pageshift;
+  {
+    ikpages* p;
+    for(p=old_heap_pages; p; p=p->next){
+      collected_pages += p->size >> pageshift;
+    }
+    int i;
+    for(i=0; i<=gc.collect_gen; i++){
+      collected_pages += pcb->gen_pages[i];
+    }
+  }
+  if(pcb->threads){
+    old_heap_pages = 
+      take_thread_heaps(pcb, old_heap_pages, &collected_pages);
+  }
+
+  /* the roots are:
+   *  0. dirty pages not collected in this run
+   *  1. the stack
+   *  2. the next continuation
+   *  3. the symbol tables, which keep their symbols weakly
+   */
+
+  ikgcevent ev;
+  bzero(&ev, sizeof(ikgcevent));
+  long int lap = timeval_usecs(&rt0);
+
+  scan_remembered_set(&gc);
+  scan_dirty_pages(&gc);
+  ev.phase[gc_phase_dirty] = gc_lap(&lap);
+
+  collect_stack(&gc, pcb->frame_pointer, pcb->frame_base - wordsize);
+  collect_locatives(&gc, pcb->callbacks);
+  pcb->next_k = add_root(&gc, pcb->next_k, "next_k"); 
+  pcb->symbol_table = add_root(&gc, pcb->symbol_table, "symbol_table"); 
+  pcb->gensym_table = add_root(&gc, pcb->gensym_table, "gensym_table"); 
+  pcb->arg_list = add_root(&gc, pcb->arg_list, "args_list_foo");
+  pcb->base_rtd = add_root(&gc, pcb->base_rtd, "base_rtd");
+  pcb->alloc_samples = add_root(&gc, pcb->alloc_samples, "alloc_samples");
+  pcb->boot_codes = add_root(&gc, pcb->boot_codes, "boot_codes");
+  pcb->dynamic_state = add_root(&gc, pcb->dynamic_state, "dynamic_state");
+  if(pcb->root0) *(pcb->root0) = add_root(&gc, *(pcb->root0), "root0");
+  if(pcb->root1) *(pcb->root1) = add_root(&gc, *(pcb->root1), "root1");
+  if(pcb->threads){
+    collect_thread_roots(&gc);
+  }
+
+  /* the marking state is not shared, so a cycle in progress keeps the
+   * tracing to this thread */
+  if((pcb->collect_threads > 1) && (gc.collect_gen >= parallel_collect_gen) &&
+     (gc.census == 0) && (gc.mark == 0)){
+    gc_par_start(&gc, pcb->collect_threads);
+  }
+  ev.phase[gc_phase_roots] = gc_lap(&lap);
+
+  /* now we trace all live objects */
+  collect_loop(&gc);
+  keep_table_symbols(&gc, pcb->symbol_table);
+  keep_table_symbols(&gc, pcb->gensym_table);
+  collect_loop(&gc);
+  ev.phase[gc_phase_trace] = gc_lap(&lap);
+  
+  /* next we trace all guardian/guarded objects,
+     the procedure does a collect_loop at the end */
+  handle_guardians(&gc);
+  ev.phase[gc_phase_guardians] = gc_lap(&lap);
+#ifndef NDEBUG
+  fprintf(stderr, "done\n");
+#endif
+  collect_loop(&gc);
+  if(gc.par){
+    gc_par_stop(&gc);
+  }
+  ev.phase[gc_phase_trace] += gc_lap(&lap);
+
+  if(gc.mark){
+    if(remark){
+      /* also bwp's the weak pairs to unmarked objects */
+      mark_finish(&gc);
+    } else {
+      mark_slice(&gc);
+    }
+  }
+  ev.phase[gc_phase_mark] = gc_lap(&lap);
+
+  /* does not allocate, only bwp's dead pointers */
+  fix_ephemerons(&gc);
+  fix_weak_pointers(&gc); 
+  drop_table_symbols(&gc, pcb->symbol_table, &pcb->symbol_count);
+  drop_table_symbols(&gc, pcb->gensym_table, &pcb->gensym_count);
+  ev.phase[gc_phase_weak] = gc_lap(&lap);
+  if(gc.census){
+    census_finish(&gc);
+  }
+  /* now deallocate all unused pages */
+  deallocate_unused_pages(&gc);
+
+  long int new_pages = fix_new_pages(&gc);
+  update_gen_stats(pcb, gc.collect_gen, collected_pages, new_pages);
+  if((gc.collect_gen == oldest_gen) || remark){
+    pcb->oldest_base_pages = pcb->gen_pages[oldest_gen];
+  }
+  check_max_heap(pcb, gc.collect_gen == oldest_gen);
+  gc_finalize_guardians(&gc);
+
+  pcb->allocation_pointer = pcb->heap_base;
+  /* does not allocate */
+  gc_add_tconcs(&gc);
+  /* does not allocate */
+#ifndef NDEBUG
+  fprintf(stderr, "done\n");
+#endif
+  reset_weak_nursery(pcb);
+
+#if accounting
+    fprintf(stderr, 
+        "[%d cons|%d sym|%d cls|%d vec|%d rec|%d cck|%d str|%d htb]\n",
+        pair_count,
+        symbol_count,
+        closure_count,
+        vector_count,
+        record_count,
+        continuation_count,
+        string_count,
+        htable_count);
+    pair_count = 0;
+    symbol_count = 0;
+    closure_count = 0;
+    vector_count = 0;
+    record_count = 0;
+    continuation_count = 0;
+    string_count = 0;
+    htable_count = 0;
+#endif
+  //ik_dump_metatable(pcb);
+#ifndef NDEBUG
+  fprintf(stderr, "collect done, %ld code objects\n", gc.code_count);
+#endif
+
+
+  /* delete all old heap pages */
+  if(old_heap_pages){
+    ikpages* p = old_heap_pages;
+    do{
+      ikpages* next = p->next;
+      ik_munmap_from_segment(p->base, p->size, pcb);
+      ik_free(p, sizeof(ikpages));
+      p=next;
+    } while(p);
+    old_heap_pages = 0;
+  }
+
+  if(pcb->threads){
+    reset_threads(pcb);
+  }
+  unsigned long int main_req = (self == pcb) ? mem_req : 0;
+  unsigned long int free_space = 
+    ((unsigned long int)heap_redline(pcb)) - 
+    ((unsigned long int)pcb->allocation_pointer);
+  long int nursery = nursery_target(pcb);
+  if((free_space <= main_req) || 
+     (pcb->heap_size < nursery) ||
+     (pcb->heap_size > 2 * (nursery + 2 * pagesize))){
+#ifndef NDEBUG
+    fprintf(stderr, "REQ=%ld, got %ld\n", main_req, free_space);
+#endif
+    long int memsize = (main_req > nursery) ? main_req : nursery;
+    memsize = align_to_next_page(memsize);
+    ik_munmap_from_segment(
+        pcb->heap_base,
+        pcb->heap_size,
+        pcb);
+    ikptr ptr = ik_mmap_mixed(memsize+2*pagesize, pcb);
+    pcb->allocation_pointer = ptr;
+    pcb->allocation_redline = ptr+memsize;
+    pcb->heap_base = ptr;
+    pcb->heap_size = memsize+2*pagesize;
+  }
+  lower_redline(pcb);
+  ik_release_cached_pages(pcb);
+
+#ifndef NDEBUG
+  ikptr x = pcb->allocation_pointer;
+  while(x < heap_redline(pcb)){
+    ref(x, 0) = (ikptr)(0x1234FFFF);
+    x+=wordsize;
+  }
+#endif
+#ifndef NDEBUG
+  verify_integrity(pcb, "exit");
+#endif
+
+  getrusage(RUSAGE_SELF, &t1);
+  gettimeofday(&rt1, 0);
+
+  pcb->collect_utime.tv_usec += t1.ru_utime.tv_usec - t0.ru_utime.tv_usec;
   pcb->collect_utime.tv_sec += t1.ru_utime.tv_sec - t0.ru_utime.tv_sec;
   if (pcb->collect_utime.tv_usec >= 1000000){
    pcb->collect_utime.tv_usec -= 1000000;
@@ -551,241 +1628,1024 @@ ik_collect(unsigned long int mem_req, ikpcb* pcb){
    pcb->collect_utime.tv_usec += 1000000;
    pcb->collect_utime.tv_sec -= 1;
   }
- 
-  pcb->collect_stime.tv_usec += t1.ru_stime.tv_usec - t0.ru_stime.tv_usec;
-  pcb->collect_stime.tv_sec += t1.ru_stime.tv_sec - t0.ru_stime.tv_sec;
-  if (pcb->collect_stime.tv_usec >= 1000000){
-   pcb->collect_stime.tv_usec -= 1000000;
-   pcb->collect_stime.tv_sec += 1;
+ 
+  pcb->collect_stime.tv_usec += t1.ru_stime.tv_usec - t0.ru_stime.tv_usec;
+  pcb->collect_stime.tv_sec += t1.ru_stime.tv_sec - t0.ru_stime.tv_sec;
+  if (pcb->collect_stime.tv_usec >= 1000000){
+   pcb->collect_stime.tv_usec -= 1000000;
+   pcb->collect_stime.tv_sec += 1;
+  }
+  else if (pcb->collect_stime.tv_usec < 0){
+   pcb->collect_stime.tv_usec += 1000000;
+   pcb->collect_stime.tv_sec -= 1;
+  }
+ 
+  pcb->collect_rtime.tv_usec += rt1.tv_usec - rt0.tv_usec;
+  pcb->collect_rtime.tv_sec += rt1.tv_sec - rt0.tv_sec;
+  if (pcb->collect_rtime.tv_usec >= 1000000){
+   pcb->collect_rtime.tv_usec -= 1000000;
+   pcb->collect_rtime.tv_sec += 1;
+  }
+  else if (pcb->collect_rtime.tv_usec < 0){
+   pcb->collect_rtime.tv_usec += 1000000;
+   pcb->collect_rtime.tv_sec -= 1;
+  }
+
+  ev.id = pcb->collection_id - 1;
+  ev.collect_gen = gc.collect_gen;
+  ev.pause = timeval_usecs(&rt1) - timeval_usecs(&rt0);
+  memcpy(ev.copied, gc.copied, sizeof(ev.copied));
+  ev.rss = ik_resident_bytes();
+  record_gc_event(pcb, &ev);
+  if(self != pcb){
+    ensure_room(mem_req, self);
+  }
+  ik_restart_world(self);
+  return self;
+}
+
+static inline int
+is_live(ikptr x, gc_t* gc){
+  if(is_fixnum(x)){ 
+    return 1;
+  } 
+  int tag = tagof(x);
+  if(tag == immediate_tag){
+    return 1;
+  }
+  if(ref(x, -tag) == forward_ptr){
+    return 1;
+  }
+  unsigned int t = gc_segment(gc, page_index(x));
+  int gen = t & gen_mask;
+  if(gen > gc->collect_gen){
+    return 1;
+  }
+  return 0;
+}
+
+static inline int 
+next_gen(int i){
+  return ((i == (generation_count-1)) ? i : (i+1));
+}
+
+ 
+static ik_ptr_page*
+move_tconc(ikptr tc, ik_ptr_page* ls){
+  if((ls == NULL) || (ls->count == ik_ptr_page_size)){
+    ik_ptr_page* page = (ik_ptr_page*)ik_mmap(pagesize);
+    page->count = 0;
+    page->next = ls;
+    ls = page;
+  }
+  ls->ptr[ls->count++] = tc;
+  return ls;
+}
+
+/* Guardians:
+ * pcb->protected_list[g] holds the (tc . obj) pairs of generation g
+ * that were registered with a guardian.  Such a pair is never older
+ * than its tconc or its object, so its list needs a look only when g
+ * is collected.  The lists are filtered in place, and the entries of
+ * the objects that died are added to their tconcs at the end of the
+ * collection, a tconc at a time.
+ */
+
+static inline ikptr
+guardian_field(ikptr p, long int off){
+  if(ref(p, off_car) == forward_ptr){
+    p = ref(p, off_cdr);
+  }
+  return ref(p, off);
+}
+
+/* keeps the entries of ls whose car (off_car) or cdr (off_cdr) is live,
+ * packed on as few of its pages as they fit, and moves the others onto
+ * *rest.  Returns what is left of ls. */
+static ik_ptr_page*
+filter_guardian_entries(gc_t* gc, ik_ptr_page* ls, long int off,
+                        ik_ptr_page** rest){
+  ik_ptr_page* w = ls;
+  long int n = 0;
+  ik_ptr_page* r;
+  for(r=ls; r; r=r->next){
+    long int i;
+    for(i=0; i<r->count; i++){
+      ikptr p = r->ptr[i];
+      if(is_live(guardian_field(p, off), gc)){
+        /* never ahead of r */
+        if(n == (long int)ik_ptr_page_size){
+          w->count = n;
+          w = w->next;
+          n = 0;
+        }
+        w->ptr[n++] = p;
+      } else {
+        *rest = move_tconc(p, *rest);
+      }
+    }
+  }
+  if(n == 0){
+    w = 0;
+  } else {
+    w->count = n;
+  }
+  ik_ptr_page* ws = w ? w->next : ls;
+  while(ws){
+    ik_ptr_page* next = ws->next;
+    ik_munmap((ikptr)ws, pagesize);
+    ws = next;
+  }
+  if(w == 0){
+    return 0;
+  }
+  w->next = 0;
+  return ls;
+}
+
+/* collects the entries of ls in place, and puts ls in front of tail */
+static ik_ptr_page*
+collect_guardian_entries(gc_t* gc, ik_ptr_page* ls, ik_ptr_page* tail){
+  if(ls == 0){
+    return tail;
+  }
+  ik_ptr_page* last = ls;
+  while(1){
+    long int i;
+    for(i=0; i<last->count; i++){
+      last->ptr[i] = add_object(gc, last->ptr[i], "guardian");
+    }
+    if(last->next == 0){
+      break;
+    }
+    last = last->next;
+  }
+  last->next = tail;
+  return ls;
+}
+
+static void
+free_ptr_pages(ik_ptr_page* ls){
+  while(ls){
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
+  }
+}
+
+static void
+handle_guardians(gc_t* gc){
+  ikpcb* pcb = gc->pcb;
+  ik_ptr_page* hold_list = 0;
+  ik_ptr_page* pend_list = 0;
+  int gen;
+  /* the entries of live objects stay in hold_list */
+  for(gen=0; gen<=gc->collect_gen; gen++){
+    ik_ptr_page* ls = pcb->protected_list[gen];
+    pcb->protected_list[gen] = 0;
+    ls = filter_guardian_entries(gc, ls, off_cdr, &pend_list);
+    if(ls){
+      ik_ptr_page* last = ls;
+      while(last->next){
+        last = last->next;
+      }
+      last->next = hold_list;
+      hold_list = ls;
+    }
+  }
+  /* the dead objects of live tconcs are made live, and their entries
+     go to gc->forward_list, until no more tconcs come alive */
+  gc->forward_list = 0;
+  while(pend_list){
+    ik_ptr_page* dead = 0;
+    ik_ptr_page* final_list =
+      filter_guardian_entries(gc, pend_list, off_car, &dead);
+    pend_list = dead;
+    if(final_list == 0){
+      break;
+    }
+    gc->forward_list =
+      collect_guardian_entries(gc, final_list, gc->forward_list);
+    collect_loop(gc);
+  }
+  /* dead objects of dead tconcs */
+  free_ptr_pages(pend_list);
+  /* the entries of live objects of live tconcs go to the protected
+     list of the next generation */
+  ik_ptr_page* dead = 0;
+  hold_list = filter_guardian_entries(gc, hold_list, off_car, &dead);
+  free_ptr_pages(dead);
+  int target = next_gen(gc->collect_gen);
+  pcb->protected_list[target] =
+    collect_guardian_entries(gc, hold_list, pcb->protected_list[target]);
+  collect_loop(gc);
+}
+
+static void
+gc_finalize_guardians(gc_t* gc){
+  /* the entries of one tconc are next to each other, mostly.  They are
+     linked up and put at its end at once. */
+  ik_ptr_page* ls = gc->forward_list;
+  unsigned int* dirty_vec = (unsigned int*)(long)gc->pcb->dirty_vector;
+  ikptr tc = 0;
+  ikptr last_pair = 0;
+  long int dirty_idx = -1;
+  while(ls){
+    int i;
+    for(i=0; i<ls->count; i++){
+      ikptr p = ls->ptr[i];
+      ikptr ptc = ref(p, off_car);
+      ikptr obj = ref(p, off_cdr);
+      if(ptc != tc){
+        if(tc){
+          ref(tc, off_cdr) = last_pair;
+          dirty_vec[page_index(tc)] = -1;
+        }
+        tc = ptc;
+        last_pair = ref(tc, off_cdr);
+      }
+      ref(last_pair, off_car) = obj;
+      ref(last_pair, off_cdr) = p;
+      if((long int)page_index(last_pair) != dirty_idx){
+        dirty_idx = page_index(last_pair);
+        dirty_vec[dirty_idx] = -1;
+      }
+      ref(p, off_car) = false_object;
+      ref(p, off_cdr) = false_object;
+      last_pair = p;
+    }
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
+  }
+  if(tc){
+    ref(tc, off_cdr) = last_pair;
+    dirty_vec[page_index(tc)] = -1;
+  }
+}
+
+/* Marking the oldest generation:
+ * When pcb->incremental_collect or pcb->mark_sweep_collect is set, the
+ * scheduled collections of the oldest generation no longer copy it.
+ * Its pages are marked in place instead and then swept.  With only
+ * mark_sweep_collect, the collection that starts a cycle also does
+ * all of its marking and the sweep.  Incrementally, a cycle:
+ *
+ * 1. starts at a collection that would have collected the oldest
+ *    generation.  The oldest generation pages present at that point
+ *    become the candidates and the collection is done one generation
+ *    younger (as are all the oldest collections until the cycle ends).
+ * 2. while the cycle is active, every collection marks the candidates
+ *    it runs into (from the roots, the dirty cards, and the objects
+ *    it copies) and pushes them on the grey stack.
+ * 3. grey objects are scanned in slices of about
+ *    pcb->mark_slice_words words: at the end of every such collection,
+ *    every time the mutator allocated that many words (by lowering the
+ *    allocation redline, see ik_overflow), and at the engine events
+ *    of $do-event.  Between collections a slice stops the world first
+ *    (ik_mark_step).
+ * 4. once the grey stack is empty, the next collection is the remark:
+ *    a collection of generation oldest_gen-1 after which the grey
+ *    stack is drained, guardians and weak pairs are handled, and the
+ *    candidate pages are swept.
+ *
+ * The dirty vector is the snapshot barrier: a candidate stored into an
+ * old object is marked when that card is scanned by the next
+ * collection, and anything stored into a younger object is traced by
+ * the remark.  Code pages are marked as a whole since their dead
+ * objects cannot be cleared.  Sweeping unmaps the candidate pages that
+ * have nothing marked and clears the dead words of the pointer pages
+ * that do, so that card scans never see a stale pointer.  The free
+ * ranges of the kept pages become holes that later collections copy
+ * into (see take_hole).  When more than pcb->compact_threshold percent
+ * of the kept pages is free, the next oldest collection copies instead.
+ */
+
+#define mark_units_per_page (pagesize >> align_shift)
+#define mark_bytes_per_page (mark_units_per_page >> 3)
+
+#define mark_candidate 1
+#define mark_code_done 2   /* every code object on the page is marked */
+#define mark_no_holes  4   /* rest of a large code object */
+
+typedef struct ikmark{
+  ikptr base;                 /* address of the first page covered */
+  long int page_count;
+  unsigned char* pages;       /* per page: 0, mark_candidate, ... */
+  unsigned char* bits;        /* one bit for every align_size bytes */
+  ik_ptr_page* grey;          /* marked objects not scanned yet */
+  int drained;
+} ikmark;
+
+static inline int
+mark_is_candidate(ikmark* m, ikptr x){
+  unsigned long int idx = ((unsigned long int)(x - m->base)) >> pageshift;
+  return (idx < (unsigned long int)m->page_count) && m->pages[idx];
+}
+
+/* sets the mark bit of the object at x, returns the old bit */
+static inline int
+mark_set(ikmark* m, ikptr x){
+  long int u = ((long int)(x - m->base)) >> align_shift;
+  unsigned char bit = 1 << (u & 7);
+  return __sync_fetch_and_or(&m->bits[u >> 3], bit) & bit;
+}
+
+static inline int
+mark_is_set(ikmark* m, ikptr x){
+  long int u = ((long int)(x - m->base)) >> align_shift;
+  return m->bits[u >> 3] & (1 << (u & 7));
+}
+
+/* an object is dead if it is an unmarked candidate */
+static inline int
+mark_is_live(ikmark* m, ikptr x){
+  if(is_fixnum(x)) return 1;
+  int tag = tagof(x);
+  if(tag == immediate_tag) return 1;
+  return (! mark_is_candidate(m, x-tag)) || mark_is_set(m, x-tag);
+}
+
+static inline void
+mark_object(ikmark* m, ikptr x){
+  if(is_fixnum(x)) return;
+  int tag = tagof(x);
+  if(tag == immediate_tag) return;
+  if(mark_is_candidate(m, x-tag) && (! mark_set(m, x-tag))){
+    m->grey = move_tconc(x, m->grey);
+  }
+}
+
+/* called by the collector for every reference to the oldest generation
+ * while a cycle is active. */
+static void
+gc_mark_old(gc_t* gc, ikptr x){
+  ikmark* m = gc->mark;
+  ikptr start = x - tagof(x);
+  if(mark_is_candidate(m, start) && (! mark_set(m, start))){
+    gc_lock(gc);
+    m->grey = move_tconc(x, m->grey);
+    gc_unlock(gc);
+  }
+}
+
+/* marks the memory of an object after its start as live */
+static void
+mark_range(ikmark* m, ikptr x, long int size){
+  long int u = ((long int)(x - m->base)) >> align_shift;
+  long int v = u + (size >> align_shift);
+  for(; u < v; u++){
+    m->bits[u >> 3] |= (1 << (u & 7));
+  }
+}
+
+static void
+mark_stack(ikmark* m, ikptr top, ikptr end){
+  /* same frame walk as collect_stack, without the updates */
+  while(top < end){
+    ikptr rp = ref(top, 0);
+    long int rp_offset = unfix(ref(rp, disp_frame_offset));
+    ikptr code_entry = rp - (rp_offset - disp_frame_offset);
+    mark_object(m, code_entry - disp_code_data + vector_tag);
+    long int framesize = ref(rp, disp_frame_size);
+    if(framesize == 0){
+      framesize = ref(top, wordsize);
+      ikptr base = top + framesize - wordsize;
+      while(base > top){
+        mark_object(m, ref(base, 0));
+        base -= wordsize;
+      }
+    } else {
+      long int frame_cells = framesize >> fx_shift;
+      long int bytes_in_mask = (frame_cells+7) >> 3;
+      unsigned char* mask = 
+        (unsigned char*)(long)(rp+disp_frame_size-bytes_in_mask);
+      ikptr* fp = (ikptr*)(long)(top + framesize);
+      long int i;
+      for(i=0; i<bytes_in_mask; i++, fp-=8){
+        int j;
+        for(j=0; j<8; j++){
+          if(mask[i] & (1 << j)){
+            mark_object(m, fp[-j]);
+          }
+        }
+      }
+    }
+    top += framesize;
+  }
+}
+
+static void
+mark_code_page(ikmark* m, ikptr x){
+  unsigned long int idx = ((unsigned long int)(x - m->base)) >> pageshift;
+  if(m->pages[idx] & mark_code_done){
+    return;
+  }
+  m->pages[idx] |= mark_code_done;
+  ikptr p = m->base + (idx << pageshift);
+  ikptr q = p + pagesize;
+  while((p < q) && (ref(p, 0) == code_tag)){
+    mark_object(m, p + vector_tag);
+    p += align(disp_code_data + unfix(ref(p, disp_code_code_size)));
+  }
+}
+
+/* returns the bytes of the object */
+static long int
+mark_scan(ikpcb* pcb, ikmark* m, ikptr x){
+  int tag = tagof(x);
+  ikptr start = x - tag;
+  ikptr fst = ref(start, 0);
+  long int size;
+  long int i;
+  if(tag == pair_tag){
+    size = pair_size;
+    unsigned int t = pcb->segment_vector[page_index(start)];
+    if((t & type_mask) != weak_pairs_type){
+      mark_object(m, fst);
+    }
+    mark_object(m, ref(x, off_cdr));
+  }
+  else if(tag == closure_tag){
+    size = align(disp_closure_data +
+                 ref(fst, disp_code_freevars - disp_code_data));
+    mark_object(m, fst - disp_code_data + vector_tag);
+    for(i=disp_closure_data; i<size; i+=wordsize){
+      mark_object(m, ref(start, i));
+    }
+  }
+  else if(tag == string_tag){
+    size = align(unfix(fst)*string_char_size + disp_string_data);
+  }
+  else if(tag == bytevector_tag){
+    size = align(unfix(fst) + disp_bytevector_data + 1);
+  }
+  else if(is_fixnum(fst)){
+    /* vector */
+    size = align(fst + disp_vector_data);
+    for(i=disp_vector_data; i<fst+disp_vector_data; i+=wordsize){
+      mark_object(m, ref(start, i));
+    }
+  }
+  else if(fst == symbol_record_tag){
+    size = symbol_record_size;
+    mark_object(m, ref(x, off_symbol_record_string));
+    mark_object(m, ref(x, off_symbol_record_ustring));
+    mark_object(m, ref(x, off_symbol_record_value));
+    mark_object(m, ref(x, off_symbol_record_proc));
+    mark_object(m, ref(x, off_symbol_record_plist));
+  }
+  else if(tagof(fst) == rtd_tag){
+    long int len = ref(fst, off_rtd_length);
+    /* see the record case of add_object */
+    size = (len & ((1<<align_shift)-1)) ? (len + wordsize) : (len + 2*wordsize);
+    mark_object(m, fst);
+    for(i=0; i<len; i+=wordsize){
+      mark_object(m, ref(start, disp_record_data+i));
+    }
+  }
+  else if(fst == code_tag){
+    size = align(disp_code_data + unfix(ref(start, disp_code_code_size)));
+    /* the relocation vector holds everything the code refers to */
+    mark_object(m, ref(start, disp_code_reloc_vector));
+    mark_object(m, ref(start, disp_code_annotation));
+    mark_code_page(m, start);
+    /* large code continues on data pages that must not get holes */
+    for(i=pagesize; i<size; i+=pagesize){
+      if(mark_is_candidate(m, start+i)){
+        m->pages[(start + i - m->base) >> pageshift] |= mark_no_holes;
+      }
+    }
+  }
+  else if(fst == continuation_tag){
+    size = continuation_size;
+    ikptr top = ref(x, off_continuation_top);
+    long int stack_size = ref(x, off_continuation_size);
+    mark_object(m, ref(x, off_continuation_next));
+    mark_stack(m, top, top + stack_size);
+    if(mark_is_candidate(m, top)){
+      mark_range(m, top, align(stack_size));
+    }
+  }
+  else if(fst == system_continuation_tag){
+    size = system_continuation_size;
+    mark_object(m, ref(x, disp_system_continuation_next - vector_tag));
+  }
+  else if(tagof(fst) == pair_tag){
+    /* tcbucket */
+    size = tcbucket_size;
+    mark_object(m, fst);
+    mark_object(m, ref(x, off_tcbucket_key));
+    mark_object(m, ref(x, off_tcbucket_val));
+    mark_object(m, ref(x, off_tcbucket_next));
+  }
+  else if((((long int)fst) & port_mask) == port_tag){
+    size = port_size;
+    for(i=wordsize; i<port_size; i+=wordsize){
+      mark_object(m, ref(start, i));
+    }
+  }
+  else if(fst == flonum_tag){
+    size = flonum_size;
+  }
+  else if((fst & bignum_mask) == bignum_tag){
+    long int len = ((unsigned long int)fst) >> bignum_length_shift;
+    size = align(disp_bignum_data + len*wordsize);
+  }
+  else if(fst == ratnum_tag){
+    size = ratnum_size;
+    mark_object(m, ref(start, disp_ratnum_num));
+    mark_object(m, ref(start, disp_ratnum_den));
+  }
+  else if(fst == compnum_tag){
+    size = compnum_size;
+    mark_object(m, ref(start, disp_compnum_real));
+    mark_object(m, ref(start, disp_compnum_imag));
+  }
+  else if(fst == cflonum_tag){
+    size = cflonum_size;
+    mark_object(m, ref(start, disp_cflonum_real));
+    mark_object(m, ref(start, disp_cflonum_imag));
+  }
+  else if(fst == pointer_tag){
+    size = pointer_size;
+  }
+  else if(fst == ephemeron_tag){
+    /* the marker has no fixpoint, old ephemerons are strong */
+    size = ephemeron_size;
+    mark_object(m, ref(start, disp_ephemeron_key));
+    mark_object(m, ref(start, disp_ephemeron_value));
+  }
+  else {
+    fprintf(stderr, "BUG: cannot mark 0x%016lx with fst=0x%016lx\n",
+        (long int)x, (long int)fst);
+    exit(-1);
+  }
+  mark_range(m, start, size);
+  return size;
+}
+
+/* scans grey objects until about words words are scanned (all of them
+ * when negative).  returns 1 if the grey stack is empty. */
+static int
+mark_drain(ikpcb* pcb, ikmark* m, long int words){
+  long int bytes = words * wordsize;
+  while(m->grey){
+    ik_ptr_page* grey = m->grey;
+    if(grey->count == 0){
+      m->grey = grey->next;
+      ik_munmap((ikptr)grey, pagesize);
+      continue;
+    }
+    if((words >= 0) && (bytes <= 0)){
+      return 0;
+    }
+    bytes -= mark_scan(pcb, m, grey->ptr[--grey->count]);
+  }
+  return 1;
+}
+
+static ikmark*
+mark_start(ikpcb* pcb){
+  ikmark* m = ik_malloc(sizeof(ikmark));
+  long int lo_idx = page_index(pcb->memory_base);
+  long int hi_idx = page_index(pcb->memory_end);
+  m->base = pcb->memory_base;
+  m->page_count = hi_idx - lo_idx;
+  m->pages = (unsigned char*)(long)
+    ik_mmap(align_to_next_page(m->page_count));
+  m->bits = (unsigned char*)(long)
+    ik_mmap(align_to_next_page(m->page_count * mark_bytes_per_page));
+  bzero((char*)(long)m->pages, m->page_count);
+  bzero((char*)(long)m->bits, m->page_count * mark_bytes_per_page);
+  m->grey = 0;
+  m->drained = 0;
+  unsigned int* segment_vec = pcb->segment_vector;
+  long int i;
+  for(i=0; i<m->page_count; i++){
+    unsigned int t = segment_vec[lo_idx+i];
+    if((t & gen_mask) == oldest_gen){
+      unsigned int type = t & type_mask;
+      if((type == pointers_type) || (type == symbols_type) ||
+         (type == weak_pairs_type) || (type == code_type) ||
+         (type == dat_type)){
+        m->pages[i] = mark_candidate;
+      }
+    }
   }
-  else if (pcb->collect_stime.tv_usec < 0){
-   pcb->collect_stime.tv_usec += 1000000;
-   pcb->collect_stime.tv_sec -= 1;
+  return m;
+}
+
+static void
+free_mark_state(ikpcb* pcb){
+  ikmark* m = pcb->mark_state;
+  if(m == 0){
+    return;
   }
- 
-  pcb->collect_rtime.tv_usec += rt1.tv_usec - rt0.tv_usec;
-  pcb->collect_rtime.tv_sec += rt1.tv_sec - rt0.tv_sec;
-  if (pcb->collect_rtime.tv_usec >= 1000000){
-   pcb->collect_rtime.tv_usec -= 1000000;
-   pcb->collect_rtime.tv_sec += 1;
+  while(m->grey){
+    ik_ptr_page* next = m->grey->next;
+    ik_munmap((ikptr)m->grey, pagesize);
+    m->grey = next;
   }
-  else if (pcb->collect_rtime.tv_usec < 0){
-   pcb->collect_rtime.tv_usec += 1000000;
-   pcb->collect_rtime.tv_sec -= 1;
+  ik_munmap((ikptr)(long)m->pages, align_to_next_page(m->page_count));
+  ik_munmap((ikptr)(long)m->bits, 
+      align_to_next_page(m->page_count * mark_bytes_per_page));
+  ik_free(m, sizeof(ikmark));
+  pcb->mark_state = 0;
+}
+
+static void
+free_old_holes(ikpcb* pcb){
+  int i;
+  for(i=0; i<old_hole_kinds; i++){
+    while(pcb->old_holes[i]){
+      ik_ptr_page* next = pcb->old_holes[i]->next;
+      ik_munmap((ikptr)pcb->old_holes[i], pagesize);
+      pcb->old_holes[i] = next;
+    }
   }
-  return pcb;
 }
 
-static inline int
-is_live(ikptr x, gc_t* gc){
-  if(is_fixnum(x)){ 
-    return 1;
-  } 
-  int tag = tagof(x);
-  if(tag == immediate_tag){
-    return 1;
+void
+ik_free_collect_state(ikpcb* pcb){
+  free_mark_state(pcb);
+  free_old_holes(pcb);
+  while(pcb->ssb){
+    ik_ptr_page* next = pcb->ssb->next;
+    ik_munmap((ikptr)pcb->ssb, pagesize);
+    pcb->ssb = next;
   }
-  if(ref(x, -tag) == forward_ptr){
-    return 1;
+  if(pcb->gc_events){
+    ik_free(pcb->gc_events, gc_event_count * sizeof(ikgcevent));
+    pcb->gc_events = 0;
   }
-  unsigned int t = gc->segment_vector[page_index(x)];
-  int gen = t & gen_mask;
-  if(gen > gc->collect_gen){
-    return 1;
+  if(pcb->gc_event_log){
+    fclose(pcb->gc_event_log);
+    pcb->gc_event_log = 0;
+  }
+}
+
+static void
+push_hole(ikpcb* pcb, int kind, ikptr p, ikptr q){
+  ik_ptr_page* ls = pcb->old_holes[kind];
+  if((ls == NULL) || (ls->count + 2 > (long int)ik_ptr_page_size)){
+    ls = (ik_ptr_page*)ik_mmap(pagesize);
+    ls->count = 0;
+    ls->next = pcb->old_holes[kind];
+    pcb->old_holes[kind] = ls;
+  }
+  ls->ptr[ls->count++] = p;
+  ls->ptr[ls->count++] = q;
+}
+
+static ikptr
+pop_hole(ikpcb* pcb, int kind, ikptr* q){
+  while(pcb->old_holes[kind]){
+    ik_ptr_page* ls = pcb->old_holes[kind];
+    if(ls->count){
+      ls->count -= 2;
+      *q = ls->ptr[ls->count+1];
+      return ls->ptr[ls->count];
+    }
+    pcb->old_holes[kind] = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
   }
   return 0;
 }
 
-static inline int 
-next_gen(int i){
-  return ((i == (generation_count-1)) ? i : (i+1));
+/* Copying into the oldest generation first fills the holes that the
+ * last sweep left in it.  Not while marking: the copies would not be
+ * marked.  A hole too small for an object is handed to the pairs. */
+static ikptr
+take_hole(long int size, gc_t* gc, int meta_id, ikptr* hole_end){
+  int kind = meta_hole_kind[meta_id];
+  /* the cycle's, not gc->mark: a worker has none */
+  if((kind < 0) || gc->pcb->mark_state ||
+     (gc->collect_gen != oldest_gen - 1)){
+    return 0;
+  }
+  ikpcb* pcb = gc->pcb;
+  ikptr p = 0;
+  gc_lock(gc);
+  if(kind == hole_pairs){
+    p = pop_hole(pcb, hole_pairs, hole_end);
+    kind = hole_ptrs;
+  }
+  while((p == 0) && (p = pop_hole(pcb, kind, hole_end))){
+    if((*hole_end - p) < size){
+      if(kind == hole_ptrs){
+        push_hole(pcb, hole_pairs, p, *hole_end);
+      }
+      p = 0;
+    }
+  }
+  gc_unlock(gc);
+  return p;
 }
 
- 
-static ik_ptr_page*
-move_tconc(ikptr tc, ik_ptr_page* ls){
-  if((ls == NULL) || (ls->count == ik_ptr_page_size)){
-    ik_ptr_page* page = (ik_ptr_page*)ik_mmap(pagesize);
-    page->count = 0;
-    page->next = ls;
-    ls = page;
+/* decides what generation a collection of gen collects when the oldest
+ * generation is marked instead of copied, starting a cycle if needed. */
+static int
+marking_collect_gen(ikpcb* pcb, int gen, int* remark){
+  if(! (pcb->incremental_collect || pcb->mark_sweep_collect)){
+    /* turned off in the middle of a cycle */
+    free_mark_state(pcb);
+    if(gen == oldest_gen){
+      free_old_holes(pcb);
+    }
+    return gen;
   }
-  ls->ptr[ls->count++] = tc;
-  return ls;
+  if(pcb->mark_state){
+    if(pcb->mark_state->drained){
+      *remark = 1;
+      return oldest_gen - 1;
+    }
+    return (gen == oldest_gen) ? (oldest_gen - 1) : gen;
+  }
+  if(gen == oldest_gen){
+    if(pcb->compact_pending){
+      pcb->compact_pending = 0;
+      free_old_holes(pcb);
+      return gen;
+    }
+    pcb->mark_state = mark_start(pcb);
+    if(! pcb->incremental_collect){
+      /* all the marking is done by this collection */
+      *remark = 1;
+    }
+    return oldest_gen - 1;
+  }
+  return gen;
+}
+
+/* while an incremental cycle has grey objects, the mutator marks a
+ * slice for every slice it allocates */
+static int
+marking_between(ikpcb* main){
+  return main->mark_state && main->incremental_collect &&
+         (! main->mark_state->drained) && (main->mark_slice_words > 0);
 }
 
 static void
-handle_guardians(gc_t* gc){
+mark_slice(gc_t* gc){
   ikpcb* pcb = gc->pcb;
-  ik_ptr_page* pend_hold_list = 0;
-  ik_ptr_page* pend_final_list = 0;
-  int gen;
-  /* sort protected pairs into pend_hold and pend_final lists */
-  for(gen=0; gen<=gc->collect_gen; gen++){
-    ik_ptr_page* prot_list = pcb->protected_list[gen];
-    pcb->protected_list[gen] = 0;
-    while(prot_list){
-      int i;
-      for(i=0; i<prot_list->count; i++){
-        ikptr p = prot_list->ptr[i];
-        ikptr tc = ref(p, off_car);
-        ikptr obj = ref(p, off_cdr);
-        if(tc == forward_ptr){
-          ikptr np = ref(p, off_cdr);
-          tc = ref(np, off_car);
-          obj = ref(np, off_cdr);
-        }
-        if(is_live(obj, gc)){
-          pend_hold_list = move_tconc(p, pend_hold_list);
-        } else {
-          pend_final_list = move_tconc(p, pend_final_list);
-        }
+  ikmark* m = gc->mark;
+  m->drained = mark_drain(pcb, m, pcb->mark_slice_words);
+}
+
+/* a slice of the marking of an incremental cycle, outside of a
+ * collection */
+void
+ik_mark_step(ikpcb* self){
+  ikpcb* pcb = self->main_pcb;
+  if(! marking_between(pcb)){
+    return;
+  }
+  if(! ik_stop_world(self)){
+    /* another thread collected while this one waited */
+    return;
+  }
+  /* the collection of another thread may have ended the cycle */
+  if(marking_between(pcb)){
+    ikmark* m = pcb->mark_state;
+    m->drained = mark_drain(pcb, m, pcb->mark_slice_words);
+  }
+  ik_restart_world(self);
+}
+
+ikptr
+ikrt_mark_step(ikpcb* pcb){
+  ik_mark_step(pcb);
+  return void_object;
+}
+
+static void
+mark_guardians(gc_t* gc){
+  /* same as handle_guardians, for the protected objects of the oldest
+   * generation, with the marks telling what is live. */
+  ikpcb* pcb = gc->pcb;
+  ikmark* m = gc->mark;
+  ik_ptr_page* hold_list = 0;
+  ik_ptr_page* pend_list = 0;
+  ik_ptr_page* ls = pcb->protected_list[oldest_gen];
+  pcb->protected_list[oldest_gen] = 0;
+  while(ls){
+    int i;
+    for(i=0; i<ls->count; i++){
+      ikptr p = ls->ptr[i];
+      if(mark_is_live(m, ref(p, off_cdr))){
+        hold_list = move_tconc(p, hold_list);
+      } else {
+        pend_list = move_tconc(p, pend_list);
       }
-      ik_ptr_page* next = prot_list->next;
-      ik_munmap((ikptr)prot_list, pagesize);
-      prot_list = next;
     }
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
   }
-  /* move live tc pend_final_list pairs into final_list,
-     the rest remain in pend_final_list,
-     final_list objects are made live and collected in 
-     gc->forward_list */
-  gc->forward_list = 0;
   int done = 0;
-  while(!done){
-    ik_ptr_page* final_list = 0;
-    ik_ptr_page* ls = pend_final_list;
-    pend_final_list = 0;
+  while(! done){
+    done = 1;
+    ls = pend_list;
+    pend_list = 0;
     while(ls){
       int i;
       for(i=0; i<ls->count; i++){
         ikptr p = ls->ptr[i];
-        ikptr tc = ref(p, off_car);
-        if(tc == forward_ptr){
-          ikptr np = ref(p, off_cdr);
-          tc = ref(np, off_car);
-        }
-        if(is_live(tc, gc)){
-          final_list = move_tconc(p, final_list);
+        if(mark_is_live(m, ref(p, off_car))){
+          /* resurrect the object, p becomes the new last pair */
+          mark_object(m, p);
+          mark_object(m, ref(p, off_cdr));
+          gc->forward_list = move_tconc(p, gc->forward_list);
+          done = 0;
         } else {
-          pend_final_list = move_tconc(p, pend_final_list);
+          pend_list = move_tconc(p, pend_list);
         }
       }
       ik_ptr_page* next = ls->next;
       ik_munmap((ikptr)ls, pagesize);
       ls = next;
     }
-    if(final_list == NULL){
-      done = 1;
-    } else {
-      ls = final_list;
-      while(ls){
-        int i;
-        for(i=0; i<ls->count; i++){
-          ikptr p = ls->ptr[i];
-          gc->forward_list = 
-            move_tconc(add_object(gc, p, "guardian"),
-                gc->forward_list);
-        }
-        ik_ptr_page* next = ls->next;
-        ik_munmap((ikptr)ls, pagesize);
-        ls = next;
-      }
-      collect_loop(gc);
-    }
+    mark_drain(pcb, m, -1);
   }
-  /* pend_final_list now contains things that are dead and
-     their tconcs are also dead, deallocate */
-  while(pend_final_list){
-    ik_ptr_page* next = pend_final_list->next;
-    ik_munmap((ikptr)pend_final_list, pagesize);
-    pend_final_list = next;
+  while(pend_list){
+    ik_ptr_page* next = pend_list->next;
+    ik_munmap((ikptr)pend_list, pagesize);
+    pend_list = next;
   }
-  /* pend_hold_list pairs with live tconcs are moved to 
-     the protected list of next generation. */
-  ik_ptr_page* target = pcb->protected_list[next_gen(gc->collect_gen)];
-  while(pend_hold_list){
+  ik_ptr_page* target = 0;
+  while(hold_list){
     int i;
-    for(i=0; i<pend_hold_list->count; i++){
-      ikptr p = pend_hold_list->ptr[i];
-      ikptr tc = ref(p, off_car);
-      if(tc == forward_ptr){
-        ikptr np = ref(p, off_cdr);
-        tc = ref(np, off_car);
+    for(i=0; i<hold_list->count; i++){
+      ikptr p = hold_list->ptr[i];
+      if(mark_is_live(m, ref(p, off_car))){
+        mark_object(m, p);
+        target = move_tconc(p, target);
       }
-      if(is_live(tc, gc)){
-        target = move_tconc(add_object(gc, p, "guardian"), target);
+    }
+    ik_ptr_page* next = hold_list->next;
+    ik_munmap((ikptr)hold_list, pagesize);
+    hold_list = next;
+  }
+  mark_drain(pcb, m, -1);
+  pcb->protected_list[oldest_gen] = target;
+}
+
+static void
+mark_weak_pairs(gc_t* gc){
+  ikpcb* pcb = gc->pcb;
+  ikmark* m = gc->mark;
+  unsigned int* segment_vec = pcb->segment_vector;
+  long int lo_idx = page_index(pcb->memory_base);
+  long int hi_idx = page_index(pcb->memory_end);
+  long int i;
+  for(i=lo_idx; i<hi_idx; i++){
+    if((segment_vec[i] & type_mask) == weak_pairs_type){
+      ikptr p = (ikptr)(i << pageshift);
+      ikptr q = p + pagesize;
+      for(; p < q; p += pair_size){
+        if(! mark_is_live(m, ref(p, 0))){
+          ref(p, 0) = bwp_object;
+        }
       }
     }
-    ik_ptr_page* next = pend_hold_list->next;
-    ik_munmap((ikptr)pend_hold_list, pagesize);
-    pend_hold_list = next;
   }
-  collect_loop(gc);
-  pcb->protected_list[next_gen(gc->collect_gen)] = target;
 }
 
 static void
-gc_finalize_guardians(gc_t* gc){
-  ik_ptr_page* ls = gc->forward_list;
-  int tconc_count = 0;
-  unsigned int* dirty_vec = (unsigned int*)(long)gc->pcb->dirty_vector;
-  while(ls){
-    int i;
-    for(i=0; i<ls->count; i++){
-      tconc_count++;
-      ikptr p = ls->ptr[i];
-      ikptr tc = ref(p, off_car);
-      ikptr obj = ref(p, off_cdr);
-      ikptr last_pair = ref(tc, off_cdr);
-      ref(last_pair, off_car) = obj;
-      ref(last_pair, off_cdr) = p;
-      ref(p, off_car) = false_object;
-      ref(p, off_cdr) = false_object;
-      ref(tc, off_cdr) = p;
-      dirty_vec[page_index(tc)] = -1;
-      dirty_vec[page_index(last_pair)] = -1;
+mark_sweep(gc_t* gc){
+  ikpcb* pcb = gc->pcb;
+  ikmark* m = gc->mark;
+  long int lo_idx = page_index(m->base);
+  long int kept = 0;
+  long int live = 0;
+  long int i;
+  free_old_holes(pcb);
+  for(i=0; i<m->page_count; i++){
+    if(m->pages[i] == 0){
+      continue;
+    }
+    unsigned char* bits = m->bits + i * mark_bytes_per_page;
+    long int n = 0;
+    int j;
+    for(j=0; j<mark_bytes_per_page; j++){
+      n += __builtin_popcount(bits[j]);
+    }
+    ikptr p = (ikptr)((lo_idx + i) << pageshift);
+    if(n == 0){
+      ik_munmap_from_segment(p, pagesize, pcb);
+      continue;
+    }
+    kept++;
+    live += n;
+    unsigned int t = pcb->segment_vector[lo_idx+i];
+    unsigned int type = t & type_mask;
+    if((type == pointers_type) || (type == symbols_type) ||
+       (type == weak_pairs_type)){
+      for(j=0; j<mark_units_per_page; j++){
+        if(! (bits[j >> 3] & (1 << (j & 7)))){
+          ref(p, j << align_shift) = 0;
+          ref(p, (j << align_shift) + wordsize) = 0;
+        }
+      }
+    }
+    int kind = 
+      (type == pointers_type) ? hole_ptrs :
+      (type == symbols_type) ? hole_symbols :
+      (type == dat_type) ? hole_data : -1;
+    if((kind >= 0) &&
+       ((t & large_object_mask) != large_object_tag) &&
+       (! (m->pages[i] & mark_no_holes))){
+      j = 0;
+      while(j < mark_units_per_page){
+        if(bits[j >> 3] & (1 << (j & 7))){
+          j++;
+        } else {
+          int k = j + 1;
+          while((k < mark_units_per_page) && 
+                (! (bits[k >> 3] & (1 << (k & 7))))){
+            k++;
+          }
+          push_hole(pcb,
+              ((kind == hole_ptrs) && (k == j + 1)) ? hole_pairs : kind,
+              p + (j << align_shift), 
+              p + (k << align_shift));
+          j = k;
+        }
+      }
     }
-    ik_ptr_page* next = ls->next;
-    ik_munmap((ikptr)ls, pagesize);
-    ls = next;
   }
+  pcb->compact_pending = 
+    (live * 100) < (kept * mark_units_per_page * (100 - pcb->compact_threshold));
 }
 
+static void
+mark_finish(gc_t* gc){
+  ikpcb* pcb = gc->pcb;
+  mark_drain(pcb, gc->mark, -1);
+  mark_guardians(gc);
+  mark_weak_pairs(gc);
+  mark_sweep(gc);
+  free_mark_state(pcb);
+}
 
-static int alloc_code_count = 0;
 
 
 static ikptr 
 add_code_entry(gc_t* gc, ikptr entry){
   ikptr x = entry - disp_code_data;
-  if(ref(x,0) == forward_ptr){
+  ikptr fst = gc_first_word(x, 0);
+  if(fst == busy_ptr){
+    fst = gc_wait_busy(x, 0);
+  }
+  if(fst == forward_ptr){
     return ref(x,wordsize) + off_code_data;
   }
   long int idx = page_index(x);
-  unsigned int t = gc->segment_vector[idx];
+  unsigned int t = gc_segment(gc, idx);
   int gen = t & gen_mask;
   if(gen > gc->collect_gen){
+    if(gc->mark && (gen == oldest_gen)){
+      gc_mark_old(gc, x + vector_tag);
+    }
     return entry;
   }
+  if(gc->par && !__sync_bool_compare_and_swap((ikptr*)(long)x, fst, busy_ptr)){
+    return add_code_entry(gc, entry);
+  }
   long int code_size = unfix(ref(x, disp_code_code_size));
   ikptr reloc_vec = ref(x, disp_code_reloc_vector);
   ikptr freevars = ref(x, disp_code_freevars);
   ikptr annotation = ref(x, disp_code_annotation);
   long int required_mem = align(disp_code_data + code_size);
+  if(gc->census){
+    census_code_object(gc, x, required_mem);
+  }
   if(required_mem >= pagesize){
     int new_tag = gc->collect_gen_tag;
     long int idx = page_index(x);
-    gc->segment_vector[idx] = new_tag | code_mt;
-    long int i;
-    for(i=pagesize, idx++; i<required_mem; i+=pagesize, idx++){
-      gc->segment_vector[idx] = new_tag | data_mt;
+    gc_lock(gc);
+    gc->segment_vector = gc->pcb->segment_vector;
+    int retagged = (gc->segment_vector[idx] & gen_mask) > gc->collect_gen;
+    if(! retagged){
+      gc->segment_vector[idx] = new_tag | code_mt;
+      long int i;
+      for(i=pagesize, idx++; i<required_mem; i+=pagesize, idx++){
+        gc->segment_vector[idx] = new_tag | data_mt;
+      }
+    }
+    gc_unlock(gc);
+    if(gc->par){
+      /* large code stays in place: release our claim */
+      __atomic_store_n((ikptr*)(long)x, fst, __ATOMIC_RELEASE);
+    }
+    if(! retagged){
+      qupages_t* p = ik_malloc(sizeof(qupages_t));
+      p->p = x;
+      p->q = x+required_mem;
+      p->next = gc->queues[meta_code];
+      gc->queues[meta_code] = p;
     }
-    qupages_t* p = ik_malloc(sizeof(qupages_t));
-    p->p = x;
-    p->q = x+required_mem;
-    p->next = gc->queues[meta_code];
-    gc->queues[meta_code] = p;
     return entry;
   } else {
     ikptr y = gc_alloc_new_code(required_mem, gc);
@@ -794,11 +2654,11 @@ add_code_entry(gc_t* gc, ikptr entry){
     ref(y, disp_code_reloc_vector) = reloc_vec;
     ref(y, disp_code_freevars) = freevars;
     ref(y, disp_code_annotation) = annotation;
+    ref(y, disp_code_unused) = ref(x, disp_code_unused);
     memcpy((char*)(long)(y+disp_code_data),
            (char*)(long)(x+disp_code_data),
            code_size);
-    ref(x, 0) = forward_ptr;
-    ref(x, wordsize) = y + vector_tag;
+    gc_forward(x, 0, y + vector_tag);
     return y+disp_code_data;
   }
 }
@@ -806,7 +2666,7 @@ add_code_entry(gc_t* gc, ikptr entry){
 static void 
 collect_locatives(gc_t* gc, callback_locative* loc) {
   while(loc) {
-    loc->data = add_object(gc, loc->data, "locative");
+    loc->data = add_root(gc, loc->data, "locative");
     loc = loc->next;
   }
 }
@@ -838,6 +2698,9 @@ static void collect_stack(gc_t* gc, ikptr top, ikptr end){
 
     long int code_offset = rp_offset - disp_frame_offset;
     ikptr code_entry = rp - code_offset;
+    if(gc->census){
+      census_ref(gc, code_entry - disp_code_data + vector_tag);
+    }
     ikptr new_code_entry = add_code_entry(gc, code_entry);
     ikptr new_rp = new_code_entry + code_offset;
     ref(top, 0) = new_rp;
@@ -892,7 +2755,7 @@ static void collect_stack(gc_t* gc, ikptr top, ikptr end){
       }
       ikptr base = top + framesize - wordsize;
       while(base > top){
-        ikptr new_obj = add_object(gc,ref(base,0), "frame");
+        ikptr new_obj = add_root(gc,ref(base,0), "frame");
         ref(base,0) = new_obj;
         base -= wordsize;
       }
@@ -908,14 +2771,14 @@ static void collect_stack(gc_t* gc, ikptr top, ikptr end){
 #if DEBUG_STACK
         fprintf(stderr, "m[%ld]=0x%x\n", i, m);
 #endif
-        if(m & 0x01) { fp[-0] = add_object(gc, fp[-0], "frame0"); }
-        if(m & 0x02) { fp[-1] = add_object(gc, fp[-1], "frame1"); }
-        if(m & 0x04) { fp[-2] = add_object(gc, fp[-2], "frame2"); }
-        if(m & 0x08) { fp[-3] = add_object(gc, fp[-3], "frame3"); }
-        if(m & 0x10) { fp[-4] = add_object(gc, fp[-4], "frame4"); }
-        if(m & 0x20) { fp[-5] = add_object(gc, fp[-5], "frame5"); }
-        if(m & 0x40) { fp[-6] = add_object(gc, fp[-6], "frame6"); }
-        if(m & 0x80) { fp[-7] = add_object(gc, fp[-7], "frame7"); }
+        if(m & 0x01) { fp[-0] = add_root(gc, fp[-0], "frame0"); }
+        if(m & 0x02) { fp[-1] = add_root(gc, fp[-1], "frame1"); }
+        if(m & 0x04) { fp[-2] = add_root(gc, fp[-2], "frame2"); }
+        if(m & 0x08) { fp[-3] = add_root(gc, fp[-3], "frame3"); }
+        if(m & 0x10) { fp[-4] = add_root(gc, fp[-4], "frame4"); }
+        if(m & 0x20) { fp[-5] = add_root(gc, fp[-5], "frame5"); }
+        if(m & 0x40) { fp[-6] = add_root(gc, fp[-6], "frame6"); }
+        if(m & 0x80) { fp[-7] = add_root(gc, fp[-7], "frame7"); }
       }
     }
     top += framesize;
@@ -936,7 +2799,24 @@ add_list(gc_t* gc, unsigned int t, ikptr x, ikptr* loc){
   int collect_gen = gc->collect_gen;
   while(1){
     ikptr fst = ref(x, off_car);
+    if(gc->par){
+      fst = gc_first_word(x, pair_tag);
+      if(fst == busy_ptr){
+        fst = gc_wait_busy(x, pair_tag);
+      }
+      if(fst == forward_ptr){
+        *loc = ref(x, off_cdr);
+        return;
+      }
+      if(! __sync_bool_compare_and_swap((ikptr*)(long)(x-pair_tag),
+                                        fst, busy_ptr)){
+        continue;
+      }
+    }
     ikptr snd = ref(x, off_cdr);
+    if(gc->census){
+      census_pair_object(gc, t, x, fst, snd);
+    }
     ikptr y;
     if((t & type_mask) != weak_pairs_type){
       y = gc_alloc_new_pair(gc) + pair_tag;
@@ -944,19 +2824,21 @@ add_list(gc_t* gc, unsigned int t, ikptr x, ikptr* loc){
       y = gc_alloc_new_weak_pair(gc) + pair_tag;
     }
     *loc = y;
-    ref(x,off_car) = forward_ptr;
-    ref(x,off_cdr) = y;
     ref(y,off_car) = fst;
+    gc_forward(x, pair_tag, y);
     int stag = tagof(snd);
     if(stag == pair_tag){
-      if(ref(snd, -pair_tag) == forward_ptr){
+      if(gc_first_word(snd, pair_tag) == forward_ptr){
         ref(y, off_cdr) = ref(snd, wordsize-pair_tag);
         return;
       } 
       else {
-        t = gc->segment_vector[page_index(snd)];
+        t = gc_segment(gc, page_index(snd));
         int gen = t & gen_mask;
         if(gen > collect_gen){
+          if(gc->mark && (gen == oldest_gen)){
+            gc_mark_old(gc, snd);
+          }
           ref(y, off_cdr) = snd;
           return;
         } else {
@@ -972,7 +2854,7 @@ add_list(gc_t* gc, unsigned int t, ikptr x, ikptr* loc){
       ref(y,off_cdr) = snd;
       return;
     }
-    else if (ref(snd, -stag) == forward_ptr){
+    else if (gc_first_word(snd, stag) == forward_ptr){
       ref(y, off_cdr) = ref(snd, wordsize-stag);
       return;
     }
@@ -999,16 +2881,34 @@ add_object_proc(gc_t* gc, ikptr x) {
   if(tag == immediate_tag){
     return x;
   }
-  ikptr fst = ref(x, -tag);
+  ikptr fst = gc_first_word(x, tag);
+  if(fst == busy_ptr){
+    fst = gc_wait_busy(x, tag);
+  }
   if(fst == forward_ptr){
     /* already moved */
     return ref(x, wordsize-tag);
   }
-  unsigned int t = gc->segment_vector[page_index(x)];
+  unsigned int t = gc_segment(gc, page_index(x));
   int gen = t & gen_mask;
   if(gen > gc->collect_gen){
+    if(gc->mark && (gen == oldest_gen)){
+      gc_mark_old(gc, x);
+    }
     return x;
   }
+  if(gc->par &&
+     (tag != pair_tag) &&
+     (fst != code_tag) &&
+     ((t & large_object_mask) != large_object_tag)){
+    /* pairs, code, and large objects do their own claiming */
+    if(! __sync_bool_compare_and_swap((ikptr*)(long)(x-tag), fst, busy_ptr)){
+      return add_object(gc, x, caller);
+    }
+  }
+  if(gc->census && (tag != pair_tag) && (fst != code_tag)){
+    census_object(gc, x, fst);
+  }
   if(tag == pair_tag){
     ikptr y;
     add_list(gc, t, x, &y);
@@ -1026,8 +2926,7 @@ add_object_proc(gc_t* gc, ikptr x) {
     ref(y, off_symbol_code)         = ref(x, off_symbol_code);
     ref(y, off_symbol_errcode)      = ref(x, off_symbol_errcode);
     ref(y, off_symbol_unused)       = 0;
-    ref(x, -symbol_tag) = forward_ptr;
-    ref(x, wordsize-symbol_tag) = y;
+    gc_forward(x, symbol_tag, y);
 #if accounting
       symbol_count++;
 #endif
@@ -1047,9 +2946,8 @@ add_object_proc(gc_t* gc, ikptr x) {
     memcpy((char*)(long)(y-closure_tag), 
            (char*)(long)(x-closure_tag),
            size);
-    ref(y,-closure_tag) = add_code_entry(gc, ref(y,-closure_tag));
-    ref(x,-closure_tag) = forward_ptr;
-    ref(x,wordsize-closure_tag) = y;
+    ref(y,-closure_tag) = add_code_entry(gc, fst);
+    gc_forward(x, closure_tag, y);
 #if accounting
     closure_count++;
 #endif
@@ -1074,8 +2972,7 @@ add_object_proc(gc_t* gc, ikptr x) {
           memcpy((char*)(long)(y+off_vector_data),
                  (char*)(long)(x+off_vector_data),
                  size);
-          ref(x,-vector_tag) = forward_ptr;
-          ref(x,wordsize-vector_tag) = y;
+          gc_forward(x, vector_tag, y);
           return y;
         }
       } else {
@@ -1085,8 +2982,7 @@ add_object_proc(gc_t* gc, ikptr x) {
         memcpy((char*)(long)(y+off_vector_data), 
                (char*)(long)(x+off_vector_data),
                size);
-        ref(x,-vector_tag) = forward_ptr;
-        ref(x,wordsize-vector_tag) = y;
+        gc_forward(x, vector_tag, y);
         return y;
       }
 #if accounting
@@ -1101,8 +2997,7 @@ add_object_proc(gc_t* gc, ikptr x) {
       ref(y, off_symbol_record_value)   = ref(x, off_symbol_record_value);
       ref(y, off_symbol_record_proc)    = ref(x, off_symbol_record_proc);
       ref(y, off_symbol_record_plist)   = ref(x, off_symbol_record_plist);
-      ref(x, -record_tag) = forward_ptr; 
-      ref(x, wordsize-record_tag) = y;
+      gc_forward(x, record_tag, y);
       return y;
     }
     else if(tagof(fst) == rtd_tag){
@@ -1124,8 +3019,7 @@ add_object_proc(gc_t* gc, ikptr x) {
             ref(p, i+wordsize) = ref(q, i+wordsize);
           }
         }
-        ref(x,-vector_tag) = forward_ptr;
-        ref(x,wordsize-vector_tag) = y;
+        gc_forward(x, vector_tag, y);
         return y;
       } else {
         /* size = n * object_alignment =>
@@ -1142,8 +3036,7 @@ add_object_proc(gc_t* gc, ikptr x) {
           }
         }
         ref(y, size+disp_record_data-vector_tag) = 0;
-        ref(x,-vector_tag) = forward_ptr;
-        ref(x,wordsize-vector_tag) = y;
+        gc_forward(x, vector_tag, y);
         return y;
       }
     }
@@ -1162,13 +3055,20 @@ add_object_proc(gc_t* gc, ikptr x) {
 #endif
       ikptr next = ref(x, off_continuation_next);
       ikptr y = gc_alloc_new_ptr(continuation_size, gc) + vector_tag;
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       ikptr new_top = gc_alloc_new_data(align(size), gc);
       memcpy((char*)(long)new_top, 
              (char*)(long)top,
              size);
-      collect_stack(gc, new_top, new_top + size);
+      if(gc->census){
+        /* the frames are edges of x, not roots */
+        ikptr owner = gc->census->owner;
+        gc->census->owner = x - vector_tag;
+        collect_stack(gc, new_top, new_top + size);
+        gc->census->owner = owner;
+      } else {
+        collect_stack(gc, new_top, new_top + size);
+      }
       ref(y, -vector_tag) = continuation_tag;
       ref(y, off_continuation_top) = new_top;
       ref(y, off_continuation_size) = (ikptr) size;
@@ -1182,8 +3082,7 @@ add_object_proc(gc_t* gc, ikptr x) {
       ikptr y = gc_alloc_new_data(system_continuation_size, gc) + vector_tag;
       ikptr top = ref(x, disp_system_continuation_top - vector_tag);
       ikptr next = ref(x, disp_system_continuation_next - vector_tag);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       ref(y, -vector_tag) = fst;
       ref(y, disp_system_continuation_top - vector_tag) = top;
       ref(y, disp_system_continuation_next - vector_tag) =
@@ -1198,6 +3097,7 @@ add_object_proc(gc_t* gc, ikptr x) {
       ref(y,off_tcbucket_key) = key;
       ref(y,off_tcbucket_val) = ref(x, off_tcbucket_val);
       ref(y,off_tcbucket_next) = ref(x, off_tcbucket_next);
+      key = tcbucket_key(gc, key);
       if((! is_fixnum(key)) && (tagof(key) != immediate_tag)){
         int gen = gc->segment_vector[page_index(key)] & gen_mask;
         if(gen <= gc->collect_gen){
@@ -1205,8 +3105,7 @@ add_object_proc(gc_t* gc, ikptr x) {
           gc_tconc_push(gc, y);
         }
       }
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       return y;
     }
     else if((((long int)fst) & port_mask) == port_tag){
@@ -1216,16 +3115,14 @@ add_object_proc(gc_t* gc, ikptr x) {
       for(i=wordsize; i<port_size; i+=wordsize){
         ref(y, i-vector_tag) = ref(x, i-vector_tag);
       }
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       return y;
     }
     else if(fst == flonum_tag){
       ikptr new = gc_alloc_new_data(flonum_size, gc) + vector_tag;
       ref(new, -vector_tag) = flonum_tag;
       flonum_data(new) = flonum_data(x);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = new;
+      gc_forward(x, vector_tag, new);
       return new;
     }
     else if((fst & bignum_mask) == bignum_tag){
@@ -1235,16 +3132,15 @@ add_object_proc(gc_t* gc, ikptr x) {
       memcpy((char*)(long)(new-vector_tag),
              (char*)(long)(x-vector_tag),
              memreq);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = new;
+      ref(new, -vector_tag) = fst;
+      gc_forward(x, vector_tag, new);
       return new;
     }
     else if(fst == ratnum_tag){
       ikptr y = gc_alloc_new_data(ratnum_size, gc) + vector_tag;
       ikptr num = ref(x, disp_ratnum_num-vector_tag);
       ikptr den = ref(x, disp_ratnum_den-vector_tag);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       ref(y, -vector_tag) = fst;
       ref(y, disp_ratnum_num-vector_tag) = add_object(gc, num, "num");
       ref(y, disp_ratnum_den-vector_tag) = add_object(gc, den, "den");
@@ -1254,8 +3150,7 @@ add_object_proc(gc_t* gc, ikptr x) {
       ikptr y = gc_alloc_new_data(compnum_size, gc) + vector_tag;
       ikptr rl = ref(x, disp_compnum_real-vector_tag);
       ikptr im = ref(x, disp_compnum_imag-vector_tag);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       ref(y, -vector_tag) = fst;
       ref(y, disp_compnum_real-vector_tag) = add_object(gc, rl, "real");
       ref(y, disp_compnum_imag-vector_tag) = add_object(gc, im, "imag");
@@ -1265,8 +3160,7 @@ add_object_proc(gc_t* gc, ikptr x) {
       ikptr y = gc_alloc_new_data(cflonum_size, gc) + vector_tag;
       ikptr rl = ref(x, disp_cflonum_real-vector_tag);
       ikptr im = ref(x, disp_cflonum_imag-vector_tag);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
       ref(y, -vector_tag) = fst;
       ref(y, disp_cflonum_real-vector_tag) = add_object(gc, rl, "real");
       ref(y, disp_cflonum_imag-vector_tag) = add_object(gc, im, "imag");
@@ -1276,8 +3170,18 @@ add_object_proc(gc_t* gc, ikptr x) {
       ikptr y = gc_alloc_new_data(pointer_size, gc) + vector_tag;
       ref(y, -vector_tag) = pointer_tag;
       ref(y, wordsize-vector_tag) = ref(x, wordsize-vector_tag);
-      ref(x, -vector_tag) = forward_ptr;
-      ref(x, wordsize-vector_tag) = y;
+      gc_forward(x, vector_tag, y);
+      return y;
+    }
+    else if(fst == ephemeron_tag){
+      /* key and value are left for trace_ephemerons */
+      ikptr y = gc_alloc_new_data(ephemeron_size, gc) + vector_tag;
+      ref(y, -vector_tag) = ephemeron_tag;
+      ref(y, off_ephemeron_key) = ref(x, off_ephemeron_key);
+      ref(y, off_ephemeron_value) = ref(x, off_ephemeron_value);
+      ref(y, disp_ephemeron_unused-vector_tag) = 0;
+      gc_forward(x, vector_tag, y);
+      gc->ephemerons = move_tconc(y, gc->ephemerons);
       return y;
     }
     else {
@@ -1291,13 +3195,19 @@ add_object_proc(gc_t* gc, ikptr x) {
     if(is_fixnum(fst)){
       long int strlen = unfix(fst);
       long int memreq = align(strlen*string_char_size + disp_string_data);
-      ikptr new_str = gc_alloc_new_data(memreq, gc) + string_tag;
+      if((t & large_object_mask) == large_object_tag){
+        retag_large_data(x-string_tag, memreq, gc);
+        return x;
+      }
+      ikptr new_str = 
+        ((memreq >= gc->pcb->large_object_size) ?
+          gc_alloc_new_large_data(memreq, gc) :
+          gc_alloc_new_data(memreq, gc)) + string_tag;
       ref(new_str, off_string_length) = fst;
       memcpy((char*)(long)(new_str+off_string_data),
              (char*)(long)(x + off_string_data),
              strlen*string_char_size);
-      ref(x, -string_tag) = forward_ptr;
-      ref(x, wordsize-string_tag) = new_str;
+      gc_forward(x, string_tag, new_str);
 #if accounting
       string_count++;
 #endif
@@ -1312,13 +3222,19 @@ add_object_proc(gc_t* gc, ikptr x) {
   else if(tag == bytevector_tag){
     long int len = unfix(fst);
     long int memreq = align(len + disp_bytevector_data + 1);
-    ikptr new_bv = gc_alloc_new_data(memreq, gc) + bytevector_tag;
+    if((t & large_object_mask) == large_object_tag){
+      retag_large_data(x-bytevector_tag, memreq, gc);
+      return x;
+    }
+    ikptr new_bv = 
+      ((memreq >= gc->pcb->large_object_size) ?
+        gc_alloc_new_large_data(memreq, gc) :
+        gc_alloc_new_data(memreq, gc)) + bytevector_tag;
     ref(new_bv, off_bytevector_length) = fst;
     memcpy((char*)(long)(new_bv+off_bytevector_data),
            (char*)(long)(x + off_bytevector_data),
            len + 1);
-    ref(x, -bytevector_tag) = forward_ptr;
-    ref(x, wordsize-bytevector_tag) = new_bv;
+    gc_forward(x, bytevector_tag, new_bv);
     return new_bv;
   }
   fprintf(stderr, "unhandled tag: %d\n", tag);
@@ -1379,224 +3295,435 @@ relocate_new_code(ikptr x, gc_t* gc){
       *((int*)(code+code_off)) = (int)relative_distance;
       p += (3*wordsize);
     }
-    else if(tag == 1){
-      /* do nothing */
-      p += (2 * wordsize);
+    else if(tag == 1){
+      /* do nothing */
+      p += (2 * wordsize);
+    }
+    else {
+      fprintf(stderr, "invalid rtag %ld in 0x%016lx\n", tag, r);
+      exit(-1);
+    }
+  }
+}
+
+
+
+static void
+scan_pending(gc_t* gc, int meta_id, ikptr p, ikptr q){
+  if(meta_id == meta_pair){
+    while(p < q){
+      ref(p,0) = add_object(gc, ref(p,0), "loop");
+      p += (2*wordsize);
+    }
+  }
+  else if(meta_id == meta_code){
+    while(p < q){
+      relocate_new_code(p, gc);
+      gc->code_count++;
+      p += align(disp_code_data + unfix(ref(p, disp_code_code_size))); 
+    }
+  }
+  else {
+    while(p < q){
+      ref(p,0) = add_object(gc, ref(p,0), "pending");
+      p += wordsize;
+    }
+  }
+}
+
+static void gc_share_work(gc_t* gc, int meta_id, qupages_t* qu);
+
+static int
+scan_pending_queue(gc_t* gc, int meta_id){
+  qupages_t* qu = gc->queues[meta_id];
+  if(qu == 0){
+    return 0;
+  }
+  gc->queues[meta_id] = 0;
+  do{
+    if(gc->par && gc->par->idle && qu->next){
+      gc_share_work(gc, meta_id, qu->next);
+      qu->next = 0;
+    }
+    scan_pending(gc, meta_id, qu->p, qu->q);
+    qupages_t* next = qu->next;
+    ik_free(qu, sizeof(qupages_t));
+    qu = next;
+  } while(qu);
+  return 1;
+}
+
+/* see if there are any remaining in the main segment of meta_id */
+static int
+scan_pending_meta(gc_t* gc, int meta_id){
+  meta_t* meta = &gc->meta[meta_id];
+  int found = 0;
+  while(1){
+    if(gc->par && gc->par->idle){
+      gc_share_work(gc, meta_id, 0);
+    }
+    ikptr p = meta->aq;
+    ikptr q = meta->ap;
+    if(p >= q){
+      return found;
+    }
+    found = 1;
+    meta->aq = q;
+    scan_pending(gc, meta_id, p, q);
+  }
+}
+
+static void 
+collect_loop_local(gc_t* gc){
+  int done;
+  do{
+    done = 1;
+    if(scan_pending_queue(gc, meta_pair))   { done = 0; }
+    if(scan_pending_queue(gc, meta_ptrs))   { done = 0; }
+    if(scan_pending_queue(gc, meta_symbol)) { done = 0; }
+    if(scan_pending_queue(gc, meta_code))   { done = 0; }
+    if(scan_pending_meta(gc, meta_pair))    { done = 0; }
+    if(scan_pending_meta(gc, meta_symbol))  { done = 0; }
+    if(scan_pending_meta(gc, meta_ptrs))    { done = 0; }
+    if(scan_pending_meta(gc, meta_code))    { done = 0; }
+    /* phew */
+  } while (! done);
+}
+
+static void
+zero_remaining_pointers(gc_t* gc){
+  static int metas[] = {meta_pair, meta_symbol, meta_ptrs, meta_weak, meta_code};
+  int i;
+  for(i=0; i<(int)(sizeof(metas)/sizeof(int)); i++){
+    meta_t* meta = &gc->meta[metas[i]];
+    ikptr p = meta->ap;
+    ikptr q = meta->ep;
+    while(p < q){
+      ref(p, 0) = 0;
+      p += wordsize;
+    }
+  }
+}
+
+static void
+push_work(qupages_t** list, qupages_t* qu){
+  qupages_t* last = qu;
+  while(last->next){
+    last = last->next;
+  }
+  last->next = *list;
+  *list = qu;
+}
+
+/* hands everything pending in gc (and qu) over to idle threads */
+static void
+gc_share_work(gc_t* gc, int meta_id, qupages_t* qu){
+  gc_par_t* par = gc->par;
+  int i;
+  for(i=0; i<meta_count; i++){
+    meta_t* meta = &gc->meta[i];
+    if((i != meta_data) && (i != meta_weak) && 
+       (meta->ap - meta->aq >= min_shared_scan)){
+      qupages_t* p = ik_malloc(sizeof(qupages_t));
+      p->p = meta->aq;
+      p->q = meta->ap;
+      p->next = gc->queues[i];
+      gc->queues[i] = p;
+      meta->aq = meta->ap;
+    }
+  }
+  int any = (qu != 0);
+  for(i=0; i<meta_count; i++){
+    if(gc->queues[i]){
+      any = 1;
     }
-    else {
-      fprintf(stderr, "invalid rtag %ld in 0x%016lx\n", tag, r);
-      exit(-1);
+  }
+  if(! any){
+    return;
+  }
+  pthread_mutex_lock(&par->lock);
+  if(qu){
+    push_work(&par->work[meta_id], qu);
+  }
+  for(i=0; i<meta_count; i++){
+    if(gc->queues[i]){
+      push_work(&par->work[i], gc->queues[i]);
+      gc->queues[i] = 0;
     }
   }
+  pthread_cond_broadcast(&par->work_cv);
+  pthread_mutex_unlock(&par->lock);
 }
 
+/* called with par->lock held */
+static int
+gc_take_work(gc_t* gc){
+  gc_par_t* par = gc->par;
+  int i;
+  for(i=0; i<meta_count; i++){
+    qupages_t* qu = par->work[i];
+    if(qu){
+      par->work[i] = qu->next;
+      qu->next = gc->queues[i];
+      gc->queues[i] = qu;
+      return 1;
+    }
+  }
+  return 0;
+}
 
-
-static void 
-collect_loop(gc_t* gc){
-  int done;
-  do{
-    done = 1;
-    { /* scan the pending pairs pages */
-      qupages_t* qu = gc->queues[meta_pair];
-      if(qu){
-        done = 0;
-        gc->queues[meta_pair] = 0;
-        do{
-          ikptr p = qu->p;
-          ikptr q = qu->q;
-          while(p < q){
-            ref(p,0) = add_object(gc, ref(p,0), "loop");
-            p += (2*wordsize);
-          }
-          qupages_t* next = qu->next;
-          ik_free(qu, sizeof(qupages_t));
-          qu = next;
-        } while(qu);
+/* every thread runs this until no thread has work left */
+static void
+gc_par_trace(gc_t* gc){
+  gc_par_t* par = gc->par;
+  while(1){
+    collect_loop_local(gc);
+    pthread_mutex_lock(&par->lock);
+    par->idle++;
+    while(1){
+      if(par->done){
+        pthread_mutex_unlock(&par->lock);
+        return;
+      }
+      if(gc_take_work(gc)){
+        par->idle--;
+        break;
       }
+      if(par->idle == par->nthreads){
+        par->done = 1;
+        pthread_cond_broadcast(&par->work_cv);
+        pthread_mutex_unlock(&par->lock);
+        return;
+      }
+      pthread_cond_wait(&par->work_cv, &par->lock);
     }
+    pthread_mutex_unlock(&par->lock);
+  }
+}
 
-    { /* scan the pending pointer pages */
-      qupages_t* qu = gc->queues[meta_ptrs];
-      if(qu){
-        done = 0;
-        gc->queues[meta_ptrs] = 0;
-        do{
-          ikptr p = qu->p;
-          ikptr q = qu->q;
-          while(p < q){
-            ref(p,0) = add_object(gc, ref(p,0), "pending");
-            p += wordsize;
-          }
-          qupages_t* next = qu->next;
-          ik_free(qu, sizeof(qupages_t));
-          qu = next;
-        } while(qu);
-      }
+static void*
+gc_worker(void* arg){
+  gc_t* gc = (gc_t*) arg;
+  gc_par_t* par = gc->par;
+  int round = 0;
+  pthread_mutex_lock(&par->lock);
+  while(1){
+    while((par->round == round) && (! par->quit)){
+      pthread_cond_wait(&par->start_cv, &par->lock);
+    }
+    if(par->quit){
+      break;
     }
+    round = par->round;
+    gc->segment_vector = gc->pcb->segment_vector;
+    pthread_mutex_unlock(&par->lock);
+    gc_par_trace(gc);
+    zero_remaining_pointers(gc);
+    pthread_mutex_lock(&par->lock);
+    par->finished++;
+    pthread_cond_signal(&par->done_cv);
+  }
+  pthread_mutex_unlock(&par->lock);
+  return 0;
+}
 
-    { /* scan the pending symbol pages */
-      qupages_t* qu = gc->queues[meta_symbol];
-      if(qu){
-        done = 0;
-        gc->queues[meta_symbol] = 0;
-        do{
-          ikptr p = qu->p;
-          ikptr q = qu->q;
-          while(p < q){
-            ref(p,0) = add_object(gc, ref(p,0), "symbols");
-            p += wordsize;
-          }
-          qupages_t* next = qu->next;
-          ik_free(qu, sizeof(qupages_t));
-          qu = next;
-        } while(qu);
-      }
+static void
+gc_par_start(gc_t* gc, int nthreads){
+  if(nthreads > max_collect_threads){
+    nthreads = max_collect_threads;
+  }
+  gc_par_t* par = ik_malloc(sizeof(gc_par_t));
+  bzero(par, sizeof(gc_par_t));
+  pthread_mutex_init(&par->lock, 0);
+  pthread_cond_init(&par->work_cv, 0);
+  pthread_cond_init(&par->start_cv, 0);
+  pthread_cond_init(&par->done_cv, 0);
+  par->workers = ik_malloc((nthreads-1) * sizeof(gc_t));
+  bzero(par->workers, (nthreads-1) * sizeof(gc_t));
+  par->threads = ik_malloc((nthreads-1) * sizeof(pthread_t));
+  par->nthreads = 1;
+  gc->par = par;
+  gc->pcb->retain_tables = 1;
+  /* signals are for the collecting thread only */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int i;
+  for(i=0; i<nthreads-1; i++){
+    gc_t* w = &par->workers[i];
+    w->pcb = gc->pcb;
+    w->segment_vector = gc->segment_vector;
+    w->collect_gen = gc->collect_gen;
+    w->collect_gen_tag = gc->collect_gen_tag;
+    w->par = par;
+    if(pthread_create(&par->threads[i], 0, gc_worker, w) != 0){
+      break;
     }
+    par->nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+}
 
-    { /* scan the pending code objects */
-      qupages_t* codes = gc->queues[meta_code];
-      if(codes){
-        gc->queues[meta_code] = 0;
-        done = 0;
-        do{
-          ikptr p = codes->p;
-          ikptr q = codes->q;
-          while(p < q){
-            relocate_new_code(p, gc);
-            alloc_code_count--;
-            p += align(disp_code_data + unfix(ref(p, disp_code_code_size))); 
-          }
-          qupages_t* next = codes->next;
-          ik_free(codes, sizeof(qupages_t));
-          codes = next;
-        } while(codes);
-      }
+static void
+gc_par_stop(gc_t* gc){
+  gc_par_t* par = gc->par;
+  pthread_mutex_lock(&par->lock);
+  par->quit = 1;
+  pthread_cond_broadcast(&par->start_cv);
+  pthread_mutex_unlock(&par->lock);
+  int i;
+  for(i=0; i<par->nthreads-1; i++){
+    pthread_join(par->threads[i], 0);
+    /* the workers' tconc pages are added by gc_add_tconcs */
+    gc_t* w = &par->workers[i];
+    int j;
+    for(j=0; j<meta_count; j++){
+      gc->copied[j] += w->copied[j];
     }
-    {/* see if there are any remaining in the main ptr segment */
-      {
-        meta_t* meta = &gc->meta[meta_pair];
-        ikptr p = meta->aq;
-        ikptr q = meta->ap;
-        if(p < q){
-          done = 0;
-          do{
-            meta->aq = q;
-            while(p < q){
-              ref(p,0) = add_object(gc, ref(p,0), "rem");
-              p += (2*wordsize);
-            }
-            p = meta->aq;
-            q = meta->ap;
-          } while (p < q);
-        }
-      }
-      {
-        meta_t* meta = &gc->meta[meta_symbol];
-        ikptr p = meta->aq;
-        ikptr q = meta->ap;
-        if(p < q){
-          done = 0;
-          do{
-            meta->aq = q;
-            while(p < q){
-              ref(p,0) = add_object(gc, ref(p,0), "sym");
-              p += wordsize;
-            }
-            p = meta->aq;
-            q = meta->ap;
-          } while (p < q);
-        }
-      }
-      {
-        meta_t* meta = &gc->meta[meta_ptrs];
-        ikptr p = meta->aq;
-        ikptr q = meta->ap;
-        if(p < q){
-          done = 0;
-          do{
-            meta->aq = q;
-            while(p < q){
-              ref(p,0) = add_object(gc, ref(p,0), "rem2");
-              p += wordsize;
-            }
-            p = meta->aq;
-            q = meta->ap;
-          } while (p < q);
-        }
-      }
-      {
-        meta_t* meta = &gc->meta[meta_code];
-        ikptr p = meta->aq;
-        ikptr q = meta->ap;
-        if(p < q){
-          done = 0;
-          do{
-            meta->aq = q;
-            do{
-              alloc_code_count--;
-              relocate_new_code(p, gc);
-              p += align(disp_code_data + unfix(ref(p, disp_code_code_size)));
-            } while (p < q);
-            p = meta->aq;
-            q = meta->ap;
-          } while (p < q);
-        }
-      }
+    gc->code_count += w->code_count;
+    if(w->tconc_base){
+      ikpages* p = ik_malloc(sizeof(ikpages));
+      p->base = w->tconc_base;
+      p->size = w->tconc_ap - w->tconc_base;
+      p->next = gc->tconc_queue;
+      gc->tconc_queue = p;
     }
-    /* phew */
-  } while (! done);
-  {
-    /* zero out remaining pointers */
-    /* FIXME: did you hear of code reuse? */
-    {
-      meta_t* meta = &gc->meta[meta_pair];
-      ikptr p = meta->ap;
-      ikptr q = meta->ep;
-      while(p < q){
-        ref(p, 0) = 0;
-        p += wordsize;
-      }
+    while(w->tconc_queue){
+      ikpages* next = w->tconc_queue->next;
+      w->tconc_queue->next = gc->tconc_queue;
+      gc->tconc_queue = w->tconc_queue;
+      w->tconc_queue = next;
     }
-    {
-      meta_t* meta = &gc->meta[meta_symbol];
-      ikptr p = meta->ap;
-      ikptr q = meta->ep;
-      while(p < q){
-        ref(p, 0) = 0;
-        p += wordsize;
-      }
+  }
+  int n = par->nthreads - 1;
+  ik_free(par->workers, n * sizeof(gc_t));
+  ik_free(par->threads, n * sizeof(pthread_t));
+  pthread_mutex_destroy(&par->lock);
+  pthread_cond_destroy(&par->work_cv);
+  pthread_cond_destroy(&par->start_cv);
+  pthread_cond_destroy(&par->done_cv);
+  ik_free(par, sizeof(gc_par_t));
+  gc->par = 0;
+  gc->pcb->retain_tables = 0;
+  ik_free_retired_tables(gc->pcb);
+  gc->segment_vector = gc->pcb->segment_vector;
+}
+
+/* the key of an ephemeron is live once it was copied, or when it is
+ * not in a collected generation.  Returns its new address, or 0. */
+static ikptr
+ephemeron_live_key(gc_t* gc, ikptr key){
+  if(is_fixnum(key)){
+    return key;
+  }
+  int tag = tagof(key);
+  if(tag == immediate_tag){
+    return key;
+  }
+  if(ref(key, -tag) == forward_ptr){
+    return ref(key, wordsize-tag);
+  }
+  int gen = gc_segment(gc, page_index(key)) & gen_mask;
+  if(gen > gc->collect_gen){
+    /* the marker sees the key only if the ephemeron is old, too */
+    if(gc->mark && (gen == oldest_gen)){
+      gc_mark_old(gc, key);
     }
-    {
-      meta_t* meta = &gc->meta[meta_ptrs];
-      ikptr p = meta->ap;
-      ikptr q = meta->ep;
-      while(p < q){
-        ref(p, 0) = 0;
-        p += wordsize;
+    return key;
+  }
+  return 0;
+}
+
+/* traces the values of the pending ephemerons whose keys are live by
+ * now.  Returns 1 if there were any, and so more to trace. */
+static int
+trace_ephemerons(gc_t* gc){
+  ik_ptr_page* ls = gc->ephemerons;
+  gc->ephemerons = 0;
+  int progress = 0;
+  while(ls){
+    int i;
+    for(i=0; i<ls->count; i++){
+      ikptr e = ls->ptr[i];
+      ikptr key = ephemeron_live_key(gc, ref(e, off_ephemeron_key));
+      if(key){
+        ref(e, off_ephemeron_key) = key;
+        ref(e, off_ephemeron_value) =
+          add_object(gc, ref(e, off_ephemeron_value), "ephemeron");
+        progress = 1;
+      } else {
+        gc->ephemerons = move_tconc(e, gc->ephemerons);
       }
     }
-    {
-      meta_t* meta = &gc->meta[meta_weak];
-      ikptr p = meta->ap;
-      ikptr q = meta->ep;
-      while(p < q){
-        ref(p, 0) = 0;
-        p += wordsize;
-      }
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
+  }
+  return progress;
+}
+
+/* the keys of the ephemerons still pending are dead */
+static void
+fix_ephemerons(gc_t* gc){
+  ik_ptr_page* ls = gc->ephemerons;
+  while(ls){
+    int i;
+    for(i=0; i<ls->count; i++){
+      ikptr e = ls->ptr[i];
+      ref(e, off_ephemeron_key) = bwp_object;
+      ref(e, off_ephemeron_value) = bwp_object;
     }
-    {
-      meta_t* meta = &gc->meta[meta_code];
-      ikptr p = meta->ap;
-      ikptr q = meta->ep;
-      while(p < q){
-        ref(p, 0) = 0;
-        p += wordsize;
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
+  }
+  gc->ephemerons = 0;
+}
+
+static void
+collect_loop_once(gc_t* gc){
+  gc_par_t* par = gc->par;
+  if(par){
+    pthread_mutex_lock(&par->lock);
+    par->idle = 0;
+    par->done = 0;
+    par->finished = 0;
+    par->round++;
+    pthread_cond_broadcast(&par->start_cv);
+    pthread_mutex_unlock(&par->lock);
+    gc_par_trace(gc);
+    pthread_mutex_lock(&par->lock);
+    while(par->finished < par->nthreads-1){
+      pthread_cond_wait(&par->done_cv, &par->lock);
+    }
+    pthread_mutex_unlock(&par->lock);
+    gc->segment_vector = gc->pcb->segment_vector;
+    int i;
+    for(i=0; i<par->nthreads-1; i++){
+      ik_ptr_page* ls = par->workers[i].ephemerons;
+      while(ls){
+        ik_ptr_page* next = ls->next;
+        ls->next = gc->ephemerons;
+        gc->ephemerons = ls;
+        ls = next;
       }
+      par->workers[i].ephemerons = 0;
     }
+  } else {
+    collect_loop_local(gc);
   }
 }
 
+/* traces to a fixpoint: the values of the ephemerons with live keys
+ * may make more keys live */
+static void 
+collect_loop(gc_t* gc){
+  do {
+    collect_loop_once(gc);
+  } while(trace_ephemerons(gc));
+  zero_remaining_pointers(gc);
+}
+
 static void
 fix_weak_pointers(gc_t* gc){
   unsigned int* segment_vec = gc->segment_vector;
@@ -1637,6 +3764,72 @@ fix_weak_pointers(gc_t* gc){
   }
 }
 
+/* Symbol tables:
+ * the buckets of the symbol and gensym tables (ikarus-symbol-table.c)
+ * hold their symbols in weak pairs.  A symbol with a value or a plist
+ * stays even when nothing else reaches it: keep_table_symbols traces
+ * those once the roots are traced.  The others go away, and
+ * drop_table_symbols takes their entries out once the weak pairs are
+ * fixed.
+ */
+
+static inline int
+symbol_is_dead(ikptr sym){
+  return (ref(sym, off_symbol_record_value) == unbound_object) &&
+         (ref(sym, off_symbol_record_plist) == null_object);
+}
+
+static void
+keep_table_symbols(gc_t* gc, ikptr st){
+  if((st == 0) || (st == false_object)){
+    return;
+  }
+  long int n = unfix(ref(st, off_vector_length));
+  long int i;
+  for(i=0; i<n; i++){
+    ikptr b = ref(st, off_vector_data + i*wordsize);
+    while(b){
+      ikptr sym = ref(b, off_car);
+      if(! is_live(sym, gc)){
+        if(! symbol_is_dead(sym)){
+          /* the weak pair gets the copy from fix_weak_pointers */
+          add_object(gc, sym, "symbol_table");
+        }
+      } else if(gc->mark && (! mark_is_live(gc->mark, sym))){
+        if(! symbol_is_dead(sym)){
+          gc_mark_old(gc, sym);
+        }
+      }
+      b = ref(ref(b, off_cdr), off_cdr);
+    }
+  }
+}
+
+static void
+drop_table_symbols(gc_t* gc, ikptr st, long int* count){
+  if((st == 0) || (st == false_object)){
+    return;
+  }
+  unsigned int* dirty_vec = (unsigned int*)(long)gc->pcb->dirty_vector;
+  long int n = unfix(ref(st, off_vector_length));
+  long int i;
+  for(i=0; i<n; i++){
+    ikptr loc = st + off_vector_data + i*wordsize;
+    ikptr b = ref(loc, 0);
+    while(b){
+      ikptr hb = ref(b, off_cdr);
+      if(ref(b, off_car) == bwp_object){
+        ref(loc, 0) = ref(hb, off_cdr);
+        dirty_vec[page_index(loc)] = -1;
+        *count -= 1;
+      } else {
+        loc = hb + off_cdr;
+      }
+      b = ref(loc, 0);
+    }
+  }
+}
+
 static unsigned int dirty_mask[generation_count] = {
   0x88888888,
   0xCCCCCCCC,
@@ -1743,6 +3936,63 @@ scan_dirty_code_page(gc_t* gc, long int page_idx){
 
 
 
+/* updates the slots in the remembered set (see ik_remember) that are
+ * in the generations not collected; those still pointing to younger
+ * objects afterwards have their cards dirtied as scan_dirty_pages
+ * would have done */
+static void
+scan_remembered_set(gc_t* gc){
+  ikpcb* pcb = gc->pcb;
+  ik_ptr_page* ls = pcb->ssb;
+  pcb->ssb = 0;
+  pcb->ssb_pages = 0;
+  while(ls){
+    int i;
+    for(i=0; i<ls->count; i++){
+      ikptr p = ls->ptr[i];
+      unsigned int t = gc->segment_vector[page_index(p)];
+      int type = t & type_mask;
+      if(((t & gen_mask) <= gc->collect_gen) ||
+         ((type != pointers_type) && (type != symbols_type))){
+        /* copied along with its object, if live */
+        continue;
+      }
+      ikptr x = ref(p, 0);
+      if(is_fixnum(x) || (tagof(x) == immediate_tag)){
+        continue;
+      }
+      ikptr y = add_object(gc, x, "remembered");
+      ref(p, 0) = y;
+      unsigned int* dirty_vec = (unsigned int*)(long)pcb->dirty_vector;
+      unsigned int d = 
+        (gc->segment_vector[page_index(y)] & meta_dirty_mask) 
+          >> meta_dirty_shift;
+      long int card = (p & (pagesize - 1)) / cardsize;
+      dirty_vec[page_index(p)] |=
+        (d << (card * meta_dirty_shift)) & cleanup_mask[t & gen_mask];
+    }
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
+  }
+}
+
+/* Most of the dirty vector is clean between minor collections, so it
+ * is tested a block of entries at a time.  The loop has a fixed count
+ * and no branches, which the compiler turns into vector loads and ors.
+ */
+#define dirty_block 64
+
+static inline int
+any_dirty(unsigned int* d, unsigned int mask){
+  unsigned int acc = 0;
+  int k;
+  for(k=0; k<dirty_block; k++){
+    acc |= d[k];
+  }
+  return (acc & mask) != 0;
+}
+
 static void
 scan_dirty_pages(gc_t* gc){
   ikpcb* pcb = gc->pcb;
@@ -1752,8 +4002,16 @@ scan_dirty_pages(gc_t* gc){
   unsigned int* segment_vec = (unsigned int*)(long)pcb->segment_vector;
   int collect_gen = gc->collect_gen;
   unsigned int mask = dirty_mask[collect_gen];
+  if(mask == 0){
+    return;
+  }
   long int i = lo_idx;
   while(i < hi_idx){
+    if(((i & (dirty_block - 1)) == 0) && (i + dirty_block <= hi_idx) &&
+       (! any_dirty(dirty_vec + i, mask))){
+      i += dirty_block;
+      continue;
+    }
     unsigned int d = dirty_vec[i];
     if(d & mask){
       unsigned int t = segment_vec[i];
@@ -1809,10 +4067,14 @@ deallocate_unused_pages(gc_t* gc){
       int gen = t & old_gen_mask;
       if(gen <= collect_gen){
         /* we're interested */
+        ikptr page = (ikptr)(i<<pageshift);
         if(t & new_gen_mask){
           /* do nothing yet */
+        } else if((page >= pcb->weak_pairs_base) &&
+                  (page < pcb->weak_pairs_end)){
+          /* the weak nursery stays, see reset_weak_nursery */
         } else {
-          ik_munmap_from_segment((ikptr)(i<<pageshift),pagesize,pcb);
+          ik_munmap_from_segment(page,pagesize,pcb);
         }
       }
     }
@@ -1821,7 +4083,23 @@ deallocate_unused_pages(gc_t* gc){
 }
 
 
+/* the weak pairs of the weak nursery are copied out or dead by now,
+ * so its pages are cleared and allocated from again */
 static void
+reset_weak_nursery(ikpcb* pcb){
+  ikptr base = pcb->weak_pairs_base;
+  if(base){
+    bzero((char*)(long)base, pcb->weak_pairs_ap - base);
+    pcb->weak_pairs_ap = base;
+    pcb->weak_pairs_ep = pcb->weak_pairs_end;
+  } else {
+    pcb->weak_pairs_ap = 0;
+    pcb->weak_pairs_ep = 0;
+  }
+}
+
+/* also counts the pages of every generation, returns the new ones */
+static long int
 fix_new_pages(gc_t* gc){
   ikpcb* pcb = gc->pcb;
   unsigned int* segment_vec = pcb->segment_vector;
@@ -1830,8 +4108,20 @@ fix_new_pages(gc_t* gc){
   ikptr lo_idx = page_index(memory_base);
   ikptr hi_idx = page_index(memory_end);
   ikptr i = lo_idx;
+  long int new_pages = 0;
+  int g;
+  for(g=0; g<generation_count; g++){
+    pcb->gen_pages[g] = 0;
+  }
   while(i < hi_idx){
-    segment_vec[i] &= ~new_gen_mask;
+    unsigned int t = segment_vec[i];
+    if(t & dealloc_mask){
+      pcb->gen_pages[t & old_gen_mask]++;
+      if(t & new_gen_mask){
+        new_pages++;
+      }
+    }
+    segment_vec[i] = t & ~new_gen_mask;
     /*
     unsigned int t = segment_vec[i];
     if(t & new_gen_mask){
@@ -1840,6 +4130,7 @@ fix_new_pages(gc_t* gc){
     */
     i++;
   }
+  return new_pages;
 } 
 
 static void
@@ -1862,11 +4153,11 @@ add_one_tconc(ikpcb* pcb, ikptr p){
 
 static void
 gc_add_tconcs(gc_t* gc){
-  if(gc->tconc_base == 0){
+  if((gc->tconc_base == 0) && (gc->tconc_queue == 0)){
     return;
   }
   ikpcb* pcb = gc->pcb;
-  {
+  if(gc->tconc_base){
     ikptr p = gc->tconc_base;
     ikptr q = gc->tconc_ap;
     while(p < q){
@@ -1888,4 +4179,244 @@ gc_add_tconcs(gc_t* gc){
   }
 }
 
+ikptr
+ikrt_set_collect_threads(ikptr n, ikpcb* pcb){
+  pcb->collect_threads = unfix(n);
+  return void_object;
+}
+
+
+ikptr
+ikrt_set_incremental_collect(ikptr flag, ikpcb* pcb){
+  pcb->incremental_collect = (flag != false_object);
+  return void_object;
+}
+
+ikptr
+ikrt_set_mark_sweep_collect(ikptr flag, ikpcb* pcb){
+  pcb->mark_sweep_collect = (flag != false_object);
+  return void_object;
+}
+
+ikptr
+ikrt_set_compact_threshold(ikptr percent, ikpcb* pcb){
+  pcb->compact_threshold = unfix(percent);
+  return void_object;
+}
+
+ikptr
+ikrt_set_mark_slice(ikptr words, ikpcb* pcb){
+  pcb->mark_slice_words = unfix(words);
+  return void_object;
+}
+
+ikptr
+ikrt_set_collect_policy(ikptr policy, ikpcb* pcb){
+  pcb->collect_policy = unfix(policy);
+  return void_object;
+}
+
+ikptr
+ikrt_set_collect_radix(ikptr radix, ikpcb* pcb){
+  pcb->collect_radix = unfix(radix);
+  return void_object;
+}
+
+ikptr
+ikrt_set_collect_growth(ikptr percent, ikpcb* pcb){
+  pcb->collect_growth = unfix(percent);
+  return void_object;
+}
+
+ikptr
+ikrt_set_nursery_size(ikptr bytes, ikpcb* pcb){
+  pcb->nursery_size = unfix(bytes);
+  return void_object;
+}
+
+ikptr
+ikrt_nursery_size(ikpcb* pcb){
+  return fix(pcb->nursery_size);
+}
+
+ikptr
+ikrt_set_heap_growth(ikptr percent, ikpcb* pcb){
+  pcb->heap_growth = unfix(percent);
+  return void_object;
+}
+
+ikptr
+ikrt_heap_growth(ikpcb* pcb){
+  return fix(pcb->heap_growth);
+}
+
+ikptr
+ikrt_set_max_heap(ikptr bytes, ikpcb* pcb){
+  pcb->max_heap = (bytes == false_object) ? 0 : unfix(bytes);
+  return void_object;
+}
+
+ikptr
+ikrt_max_heap(ikpcb* pcb){
+  return pcb->max_heap ? fix(pcb->max_heap) : false_object;
+}
+
+ikptr
+ikrt_set_retained_bytes(ikptr bytes, ikpcb* pcb){
+  pcb->retain_pages = unfix(bytes) >> pageshift;
+  return void_object;
+}
+
+ikptr
+ikrt_retained_bytes(ikpcb* pcb){
+  return fix(pcb->retain_pages << pageshift);
+}
+
+ikptr
+ikrt_gc_event_total(ikpcb* pcb){
+  return fix(pcb->gc_event_total);
+}
+
+/* fills the fields of the gc-event struct r with the nth event,
+ * returns #f if it is no longer in the ring */
+ikptr
+ikrt_gc_event(ikptr n, ikptr r, ikpcb* pcb){
+  long int i = unfix(n);
+  if((i < 0) || (i >= pcb->gc_event_total) ||
+     (i < pcb->gc_event_total - gc_event_count)){
+    return false_object;
+  }
+  ikgcevent* ev = &pcb->gc_events[i % gc_event_count];
+  long int j = 0;
+  ref(r, off_record_data + (j++) * wordsize) = fix(ev->id);
+  ref(r, off_record_data + (j++) * wordsize) = fix(ev->collect_gen);
+  ref(r, off_record_data + (j++) * wordsize) = fix(ev->pause);
+  int k;
+  for(k=0; k<gc_phase_count; k++){
+    ref(r, off_record_data + (j++) * wordsize) = fix(ev->phase[k]);
+  }
+  for(k=0; k<gc_copied_count; k++){
+    ref(r, off_record_data + (j++) * wordsize) = fix(ev->copied[k]);
+  }
+  ref(r, off_record_data + (j++) * wordsize) = fix(ev->rss);
+  return true_object;
+}
+
+/* path is a bytevector or #f to stop logging */
+ikptr
+ikrt_set_gc_event_log(ikptr path, ikpcb* pcb){
+  if(pcb->gc_event_log){
+    fclose(pcb->gc_event_log);
+    pcb->gc_event_log = 0;
+  }
+  if(path == false_object){
+    return true_object;
+  }
+  FILE* f = fopen((char*)(long)(path + off_bytevector_data), "a");
+  if(f == NULL){
+    return false_object;
+  }
+  pcb->gc_event_log = f;
+  return true_object;
+}
+
+ikptr
+ikrt_set_remembered_set(ikptr flag, ikpcb* pcb){
+  pcb->remembered_set = (flag != false_object);
+  return void_object;
+}
+
+ikptr
+ikrt_remembered_set(ikpcb* pcb){
+  return pcb->remembered_set ? true_object : false_object;
+}
+
+ikptr
+ikrt_set_large_object_size(ikptr bytes, ikpcb* pcb){
+  long int n = unfix(bytes);
+  pcb->large_object_size = (n < pagesize) ? pagesize : n;
+  return void_object;
+}
+
+ikptr
+ikrt_large_object_size(ikpcb* pcb){
+  return fix(pcb->large_object_size);
+}
+
+ikptr
+ikrt_set_huge_pages(ikptr flag, ikpcb* pcb){
+  pcb->huge_pages = (flag != false_object);
+  return void_object;
+}
+
+ikptr
+ikrt_huge_pages(ikpcb* pcb){
+  return pcb->huge_pages ? true_object : false_object;
+}
 
+/* path is a bytevector for the graph file, or #f for none.  returns
+ * #f if the file cannot be opened, else a pair of the counts vector
+ * (count and bytes of each kind) and the rtds vector (rtd, count and
+ * bytes of each) */
+ikptr
+ikrt_heap_census(ikptr path, ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  ikcensus* c = ik_malloc(sizeof(ikcensus));
+  bzero(c, sizeof(ikcensus));
+  if(path != false_object){
+    c->graph = fopen((char*)(long)(path + off_bytevector_data), "w");
+    if(c->graph == NULL){
+      ik_free(c, sizeof(ikcensus));
+      return false_object;
+    }
+    fprintf(c->graph,
+      "# ikarus heap census: node <addr> <kind> <bytes> <addr> ...,"
+      " root <addr>, edge <from> <to>\n");
+  }
+  /* a marking cycle leaves the oldest generation in place */
+  while(main->mark_state){
+    ik_collect(0, pcb);
+  }
+  while(! c->done){
+    main->full_collect_pending = 1;
+    if(main->incremental_collect || main->mark_sweep_collect){
+      main->compact_pending = 1;
+    }
+    main->census = c;
+    ik_collect(0, pcb);
+    main->census = 0;
+  }
+  if(c->graph){
+    fclose(c->graph);
+  }
+  long int n = census_kinds;
+  long int m = c->rtd_count;
+  ikptr counts = ik_unsafe_alloc(pcb, align(disp_vector_data + 2*n*wordsize))
+                 + vector_tag;
+  ref(counts, off_vector_length) = fix(2*n);
+  long int i;
+  for(i=0; i<n; i++){
+    ref(counts, off_vector_data + 2*i*wordsize) = fix(c->count[i]);
+    ref(counts, off_vector_data + (2*i+1)*wordsize) = fix(c->bytes[i]);
+  }
+  ikptr rtds = ik_unsafe_alloc(pcb, align(disp_vector_data + 3*m*wordsize))
+               + vector_tag;
+  ref(rtds, off_vector_length) = fix(3*m);
+  long int j = 0;
+  for(i=0; i<c->rtd_slots; i++){
+    if(c->rtds[3*i]){
+      ref(rtds, off_vector_data + j*wordsize) = c->rtds[3*i];
+      ref(rtds, off_vector_data + (j+1)*wordsize) = fix(c->rtds[3*i+1]);
+      ref(rtds, off_vector_data + (j+2)*wordsize) = fix(c->rtds[3*i+2]);
+      j += 3;
+    }
+  }
+  ikptr p = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
+  ref(p, off_car) = counts;
+  ref(p, off_cdr) = rtds;
+  if(c->rtds){
+    ik_free(c->rtds, 3 * c->rtd_slots * sizeof(ikptr));
+  }
+  ik_free(c, sizeof(ikcensus));
+  return p;
+}
@@ -22,6 +22,7 @@
 #include "ikarus-getaddrinfo.h"
 
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/resource.h>
 
 extern int total_allocated_pages;
@@ -74,6 +75,7 @@ extern int hash_table_count;
 
 #define pagesize 4096
 #define generation_count 5  /* generations 0 (nursery), 1, 2, 3, 4 */
+#define old_hole_kinds 4
 
 typedef unsigned long int ikptr;
 
@@ -107,6 +109,39 @@ typedef struct ik_ptr_page{
   ikptr ptr[ik_ptr_page_size];
 } ik_ptr_page;
 
+/* what is known about one collection, see ik_collect */
+#define gc_event_count 256
+#define gc_phase_count 6  /* dirty, roots, trace, guardians, mark, weak */
+#define gc_copied_count 6 /* one per meta type */
+
+typedef struct ikgcevent{
+  long int id;
+  long int collect_gen;
+  long int pause;                   /* usecs */
+  long int phase[gc_phase_count];   /* usecs */
+  long int copied[gc_copied_count]; /* bytes */
+  long int rss;                     /* bytes resident, after it */
+} ikgcevent;
+
+/* what the threads of one heap share, see ikarus-threads.c */
+typedef struct ikthreads{
+  pthread_mutex_t heap_lock;  /* recursive; pages, tables, symbols, guardians */
+  pthread_mutex_t lock;       /* the rest of this struct */
+  pthread_cond_t parked_cv;   /* running went down */
+  pthread_cond_t resume_cv;   /* stopping was cleared, or a thread finished */
+  struct ikpcb* list;         /* the forked threads, not the main one */
+  int running;                /* threads running scheme code, main included */
+  int stopping;               /* a collection is waiting for the others */
+  long int next_id;
+  long int tlab_bytes;        /* handed out to threads since the last gc */
+  struct ikretired* retired;  /* tables replaced since the last gc */
+} ikthreads;
+
+#define thread_new 0
+#define thread_running 1
+#define thread_done 2
+#define thread_joined 3
+
 typedef struct callback_locative{
   ikptr data;
   struct callback_locative* next;
@@ -136,6 +171,8 @@ typedef struct ikpcb{
   unsigned int* segment_vector; 
   ikptr weak_pairs_ap;
   ikptr weak_pairs_ep;
+  ikptr weak_pairs_base;    /* the weak nursery, reused after every gc */
+  ikptr weak_pairs_end;
   ikptr   heap_base; 
   unsigned long int   heap_size;
   ikpages* heap_pages;
@@ -143,15 +180,34 @@ typedef struct ikpcb{
   ikpage* uncached_pages; /* ikpages cached so that we don't malloc/free */
   ikptr cached_pages_base;
   int cached_pages_size;
+  ikpages* cached_runs;  /* multi-page mappings kept for reuse */
+  long int cached_run_pages;
+  ikpage* released_pages;/* cached, with the memory given back */
+  ikpages* released_runs;
+  long int released_run_pages;
+  long int retain_pages; /* cached pages kept resident after a collection */
+  int huge_pages;        /* map the heap in 2MB transparent huge pages */
+  ikptr huge_ap;         /* rest of the current huge page */
+  ikptr huge_ep;
+  ikptr reserve_base;    /* the reserved region, if any */
+  ikptr reserve_end;
+  ikptr reserve_ap;      /* the part never handed out starts here */
+  int reserve_down;      /* and lies below it */
+  ikpages* reserve_pages;/* released single pages */
+  ikpages* reserve_runs; /* released longer runs */
   ikptr   stack_base;
   unsigned long int   stack_size;
   ikptr   symbol_table;
   ikptr   gensym_table;
+  long int symbol_count;    /* symbols in symbol_table */
+  long int gensym_count;    /* and in gensym_table */
   ik_ptr_page* protected_list[generation_count];
   unsigned int* dirty_vector_base;
   unsigned int* segment_vector_base;
   ikptr memory_base;
   ikptr memory_end;
+  ikptr table_base;      /* what the segment and dirty vectors cover */
+  ikptr table_end;
   int collection_id;
   int allocation_count_minor;
   int allocation_count_major;
@@ -159,8 +215,60 @@ typedef struct ikpcb{
   struct timeval collect_stime;
   struct timeval collect_rtime; 
   int last_errno;
+  int collect_threads;      /* threads tracing major collections */
+  int retain_tables;        /* gc workers may still read old tables */
+  ikpages* retired_tables;  /* tables replaced while retain_tables */
+  int incremental_collect;  /* mark the oldest generation in slices */
+  long int mark_slice_words; /* grey words scanned in every slice */
+  struct ikmark* mark_state;/* the marking cycle in progress, if any */
+  int mark_sweep_collect;   /* mark the oldest generation, in one go */
+  int compact_threshold;    /* percent free that makes it copy instead */
+  int compact_pending;      /* next oldest collection copies */
+  ik_ptr_page* old_holes[old_hole_kinds]; /* free after the last sweep */
+  int collect_policy;       /* collect_by_count or collect_adaptive */
+  int collect_radix;
+  int collect_growth;       /* percent the oldest generation may grow */
+  long int gen_pages[generation_count];  /* after the last collection */
+  long int oldest_base_pages;            /* after the last full one */
+  int gen_scale[generation_count];
+  int gen_survival[generation_count];    /* percent, last collection */
+  long int nursery_size;    /* allocated after every collection */
+  int heap_growth;          /* nursery percent of the older generations */
+  long int max_heap;        /* bytes, 0 for no limit */
+  int full_collect_pending; /* the heap went over max_heap */
+  long int large_object_size;  /* bytes, data this big gets own pages */
+  long int large_object_bytes; /* allocated on own pages since last gc */
+  ikgcevent* gc_events;     /* ring of the last gc_event_count */
+  long int gc_event_total;  /* collections recorded so far */
+  FILE* gc_event_log;       /* each event is appended here, if open */
+  int remembered_set;       /* ik_remember records slots, not cards */
+  ik_ptr_page* ssb;         /* the slots recorded since the last gc */
+  long int ssb_pages;
+  struct ikpcb* main_pcb;   /* the pcb owning the heap, maybe this one */
+  ikthreads* threads;       /* once a thread was forked */
+  struct ikpcb* next_thread;
+  long int thread_id;
+  int thread_state;
+  int thread_joining;       /* a thread-join waits for this one */
+  ikptr thread_value;       /* the thunk, then what it returned */
+  pthread_t thread;
+  long int tlab_size;       /* bytes, what a thread takes at a time */
+  ikptr saved_engine_counter; /* while stopped for a collection */
+  int stop_requested;
+  struct ikplace* place;    /* the channel, in a place */
+  struct ikcensus* census;  /* counts what the next full collection copies */
+  long int alloc_sample_bytes; /* allocated between two samples, or 0 */
+  long int alloc_sample_left;  /* bytes to the next sample */
+  ikptr alloc_sample_mark;  /* where the allocation was last counted */
+  ikptr alloc_samples;      /* the code objects sampled, newest first */
+  ikptr boot_codes;         /* of a heap image, those not run yet */
+  int lazy_code;            /* fasl code is copied in on its first call */
+  ikptr dynamic_state;      /* (winders . cells) once threads are forked */
 } ikpcb;
 
+#define collect_by_count 0
+#define collect_adaptive 1
+
 typedef struct {
   ikptr tag;
   ikptr top;
@@ -172,6 +280,7 @@ typedef struct {
 
 
 ikpcb* ik_collect(unsigned long int, ikpcb*);
+long int ik_resident_bytes(void);
 void ikarus_usage_short(void);
 
 void* ik_malloc(int);
@@ -185,12 +294,45 @@ ikptr ik_mmap_code(unsigned long int size, int gen, ikpcb*);
 ikptr ik_mmap_mixed(unsigned long int size, ikpcb*);
 void ik_munmap(ikptr, unsigned long int);
 void ik_munmap_from_segment(ikptr, unsigned long int, ikpcb*);
+void ik_free_retired_tables(ikpcb*);
+void ik_free_collect_state(ikpcb*);
 ikpcb* ik_make_pcb();
 void ik_delete_pcb(ikpcb*);
+void ik_init_threads(ikpcb*);
+ikpcb* ik_make_thread_pcb(ikpcb*);
+void ik_delete_thread_pcb(ikpcb*);
+void ik_heap_lock(ikpcb*);
+void ik_heap_unlock(ikpcb*);
+void ik_enter_native(ikpcb*);
+void ik_leave_native(ikpcb*);
+void ik_thread_finish(ikpcb*);
+int ik_stop_world(ikpcb*);
+void ik_restart_world(ikpcb*);
+void ik_mark_step(ikpcb*);
+void ik_merge_retired_tables(ikpcb*);
+ikptr ik_overflow(unsigned long int, ikpcb*);
+ikptr ik_make_room(unsigned long int, ikpcb*);
+void ik_place_exit(ikpcb*, ikptr status) __attribute__((noreturn));
+extern int ik_live_places;
+extern __thread ikpcb* ik_current_pcb;
+void ik_reserve_heap(ikpcb*, unsigned long int size);
+void ik_place_heap(ikptr);
+char* ik_mapping_hint(unsigned long int size);
+void ik_adopt_pages(ikptr base, unsigned long int size, unsigned int* types,
+                    ikpcb*);
+void ik_release_cached_pages(ikpcb*);
 void ik_free_symbol_table(ikpcb* pcb);
 
 void ik_fasl_load(ikpcb* pcb, char* filename);
 void ik_relocate_code(ikptr);
+void ik_materialize_code(ikpcb*);
+ikptr ik_fasl_read_file(ikpcb* pcb, char* filename);
+
+int ik_heap_image_p(char* mem, long int size);
+int ik_premap_heap_image(char* filename);
+void ik_adopt_heap_image(ikpcb* pcb);
+void ik_load_heap_image(ikpcb* pcb, char* filename);
+void ik_write_boot_image(ikpcb* pcb, char* boot_file, char* image_file);
 
 ikptr ik_exec_code(ikpcb* pcb, ikptr code_ptr, ikptr argcount, ikptr cp);
 void ik_print(ikptr x);
@@ -206,6 +348,8 @@ ikptr ik_asm_reenter(ikpcb*, ikptr code_object, ikptr val);
 ikptr ik_underflow_handler(ikpcb*);
 ikptr ik_unsafe_alloc(ikpcb* pcb, int size);
 ikptr ik_safe_alloc(ikpcb* pcb, int size);
+void ik_remember(ikpcb* pcb, ikptr slot);
+ikptr ikrt_weak_cons(ikptr a, ikptr d, ikpcb* pcb);
 
 ikptr u_to_number(unsigned long, ikpcb*);
 ikptr ull_to_number(unsigned long long, ikpcb*);
@@ -216,7 +360,11 @@ ikptr make_pointer(long x, ikpcb* pcb);
 long long extract_num_longlong(ikptr x);
 
 #define IK_HEAP_EXT_SIZE  (32 * 4096)
+#define IK_TLAB_SIZE      (64 * 4096)  /* what a forked thread allocates into */
+#define IK_WEAK_NURSERY_SIZE (16 * 4096) /* where weak pairs are made */
 #define IK_HEAPSIZE       (1024 * ((wordsize==4)?1:2) * 4096) /* 4/8 MB */
+/* where boot images are written, and mapped when nothing else is there */
+#define IK_IMAGE_BASE ((ikptr)1 << ((wordsize==4)?29:44))
 
 #define wordsize ((int)(sizeof(ikptr)))
 #define wordshift ((wordsize == 4)?2:3)
@@ -427,4 +575,12 @@ long long extract_num_longlong(ikptr x);
 #define pointer_size          (2 * wordsize)
 #define off_pointer_data      (disp_pointer_data - vector_tag)
 
+#define ephemeron_tag         ((ikptr) 0x10F)
+#define disp_ephemeron_key    (1 * wordsize)
+#define disp_ephemeron_value  (2 * wordsize)
+#define disp_ephemeron_unused (3 * wordsize)
+#define ephemeron_size        (4 * wordsize)
+#define off_ephemeron_key     (disp_ephemeron_key - vector_tag)
+#define off_ephemeron_value   (disp_ephemeron_value - vector_tag)
+
 #endif
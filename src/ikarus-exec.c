@@ -56,8 +56,7 @@ ikptr ik_exec_code(ikpcb* pcb, ikptr code_ptr, ikptr argcount, ikptr cp){
       k->size = framesize;
       k->next = vector_tag + (ikptr)(long)nk;
       /* record side effect */
-      unsigned long int idx = ((unsigned long int)(&k->next)) >> pageshift;
-      ((unsigned int*)(long)(pcb->dirty_vector))[idx] = -1;
+      ik_remember(pcb, (ikptr)(long)&k->next);
     } else if (framesize > k->size) {
       fprintf(stderr, 
               "ikarus internal error: invalid framesize %ld, expected %ld or less\n",
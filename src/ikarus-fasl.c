@@ -16,7 +16,9 @@
  */
 
 
-
+#ifdef __linux__
+#define _GNU_SOURCE /* REG_RIP */
+#endif
 
 #include "ikarus-data.h"
 #include <stdio.h>
@@ -30,12 +32,43 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <dlfcn.h>
+#include <signal.h>
 
 
 #ifndef RTLD_DEFAULT
 #define RTLD_DEFAULT 0
 #endif
 
+/* Lazy code:
+ * with --lazy-code, ik_fasl_load leaves the body of each code object
+ * in the mapped file and puts only a stub on the heap: the header, an
+ * entry of int3, and words with the reloc vector of the body, its
+ * size, and the addresses of its foreign names, which are looked up as
+ * the file is read.  The reloc vector of the stub itself keeps those
+ * alive, and the address of the body in the file is in its unused
+ * word.  The first call into the stub traps, and on_trap copies the
+ * body into new code pages, relocates it, and turns the entry into a
+ * jump to it.  Closures and other code go on calling through the stub,
+ * except code that jumps past its entry, which is relocated to the
+ * body, copied in first if need be.  Code never called is never copied
+ * or relocated.  The file stays mapped.  ik_materialize_code copies in
+ * what is left before a thread is forked and before the heap is
+ * written to an image.
+ *
+ * Only on linux x86, elsewhere the option does nothing.
+ */
+#if defined(__linux__) && defined(__x86_64__)
+#define LAZY_CODE 1
+#define trap_pc(uc) ((ucontext_t*)(uc))->uc_mcontext.gregs[REG_RIP]
+#elif defined(__linux__) && defined(__i386__)
+#define LAZY_CODE 1
+#define trap_pc(uc) ((ucontext_t*)(uc))->uc_mcontext.gregs[REG_EIP]
+#endif
+
+#ifdef LAZY_CODE
+#include <ucontext.h>
+#endif
+
 
 typedef struct {
   char* membase;
@@ -45,11 +78,14 @@ typedef struct {
   ikptr code_ep;
   ikptr* marks;
   int marks_size;
+  int lazy;          /* code bodies stay in the file, see above */
 } fasl_port;
 
 static ikptr ik_fasl_read(ikpcb* pcb, fasl_port* p);
 
-void ik_fasl_load(ikpcb* pcb, char* fasl_file){ 
+/* maps the whole of fasl_file, *filesize gets its size */
+static char*
+map_fasl_file(char* fasl_file, int* filesize){
   int fd = open(fasl_file, O_RDONLY);
   if(fd == -1){
     fprintf(stderr, 
@@ -59,7 +95,6 @@ void ik_fasl_load(ikpcb* pcb, char* fasl_file){
     ikarus_usage_short();
     exit(-1);
   }
-  int filesize;
   {
     struct stat buf;
     int err = fstat(fd, &buf);
@@ -70,9 +105,9 @@ void ik_fasl_load(ikpcb* pcb, char* fasl_file){
               strerror(errno));
       exit(-1);
     }
-    filesize = buf.st_size;
+    *filesize = buf.st_size;
   }
-  int mapsize = ((filesize + pagesize - 1) / pagesize) * pagesize;
+  int mapsize = ((*filesize + pagesize - 1) / pagesize) * pagesize;
   char* mem = mmap(
       0,
       mapsize,
@@ -87,28 +122,255 @@ void ik_fasl_load(ikpcb* pcb, char* fasl_file){
             strerror(errno));
     exit(-1);
   }
+  close(fd);
+  return mem;
+}
+
+static void
+unmap_fasl_file(char* mem, int filesize){
+  int mapsize = ((filesize + pagesize - 1) / pagesize) * pagesize;
+  int err = munmap(mem, mapsize);
+  if(err != 0){
+    fprintf(stderr, "Failed to unmap fasl file: %s\n", strerror(errno));
+    exit(-1);
+  }
+}
+
+static ikptr
+fasl_read_next(ikpcb* pcb, fasl_port* p){
+  p->code_ap = 0;
+  p->code_ep = 0;
+  ikptr v = ik_fasl_read(pcb, p);
+  if(p->marks_size){
+    ik_munmap((ikptr)(long)p->marks, p->marks_size*sizeof(ikptr*));
+    p->marks = 0;
+    p->marks_size = 0;
+  }
+  return v;
+}
+
+/* the words of a stub, after its entry */
+#define stub_entry_size  8
+#define stub_relocs      (stub_entry_size)
+#define stub_after       (stub_entry_size + wordsize)
+#define stub_foreign     (stub_entry_size + 2*wordsize)
+#define stub_code_size   (stub_entry_size + 3*wordsize)
+#define stub_size        (stub_entry_size + 4*wordsize)
+/* in the unused word of a stub whose body is copied in */
+#define stub_done        ((ikptr)-1)
+
+#define lazy_stub_p(code) \
+  ((ref(code, disp_code_unused) != 0) && \
+   (ref(code, disp_code_unused) != stub_done))
+
+static void relocate_code(ikptr code, ikptr foreign, ikpcb* pcb);
+
+#ifdef LAZY_CODE
+/* the stub not copied in yet whose entry is x, or 0 */
+static ikptr
+lazy_code_at(ikpcb* pcb, ikptr x){
+  if((x < pcb->memory_base) || (x >= pcb->memory_end)){
+    return 0;
+  }
+  if((pcb->segment_vector[page_index(x)] & type_mask) != code_type){
+    return 0;
+  }
+  ikptr p = x & ~((ikptr)pagesize - 1);
+  ikptr q = p + pagesize;
+  while((p < q) && (ref(p, 0) == code_tag)){
+    if(x < p + disp_code_data){
+      return 0;
+    }
+    if(x == p + disp_code_data){
+      return lazy_stub_p(p) ? p : 0;
+    }
+    p += align(disp_code_data + unfix(ref(p, disp_code_code_size)));
+  }
+  return 0;
+}
+#endif
+
+static void
+dirty_range(ikptr p, long int size, ikpcb* pcb){
+  unsigned long int i = page_index(p);
+  unsigned long int j = page_index(p+size-1);
+  for(; i<=j; i++){
+    ((unsigned int*)(long)pcb->dirty_vector)[i] = -1;
+  }
+}
+
+/* code pages for the bodies copied in, started afresh after each
+ * collection, which may have released the last one */
+static ikptr body_ap = 0;
+static ikptr body_ep = 0;
+static int body_collection = -1;
+
+static ikptr
+alloc_body(long int size, ikpcb* pcb){
+  long int asize = align(size);
+  if(asize >= pagesize){
+    return ik_mmap_code(align_to_next_page(asize), 0, pcb);
+  }
+  if((body_collection != pcb->collection_id) ||
+     (body_ap + asize > body_ep)){
+    body_ap = ik_mmap_code(pagesize, 0, pcb);
+    /* the collector scans a code page up to the first non-code word */
+    bzero((char*)(long)body_ap, pagesize);
+    body_ep = body_ap + pagesize;
+    body_collection = pcb->collection_id;
+  }
+  ikptr code = body_ap;
+  body_ap += asize;
+  return code;
+}
+
+/* the code object with the body of the stub, copied in */
+static ikptr
+materialize(ikptr stub, ikpcb* pcb){
+  ikptr data = stub + disp_code_data;
+  ikptr relocs = ref(data, stub_relocs);
+  ikptr after = ref(data, stub_after);
+  ikptr foreign = ref(data, stub_foreign);
+  long int code_size = unfix(ref(data, stub_code_size));
+  ikptr code = alloc_body(disp_code_data + code_size, pcb);
+  ref(code, 0) = code_tag;
+  ref(code, disp_code_code_size) = fix(code_size);
+  ref(code, disp_code_reloc_vector) = relocs;
+  ref(code, disp_code_freevars) = ref(stub, disp_code_freevars);
+  ref(code, disp_code_annotation) = ref(stub, disp_code_annotation);
+  ref(code, disp_code_unused) = 0;
+  memcpy((char*)(long)(code+disp_code_data),
+         (char*)(long)ref(stub, disp_code_unused),
+         code_size);
+  /* the stub jumps to the body from now on, before the body is
+   * relocated, which may copy in code that jumps into this one */
+  ref(after, off_vector_data + 2*wordsize) = code + vector_tag;
+  ref(stub, disp_code_reloc_vector) = after;
+  ref(stub, disp_code_unused) = stub_done;
+  memset((char*)(long)(data+stub_relocs), 0, stub_size-stub_relocs);
+  *((unsigned char*)(long)data) = 0xE9;
+  *((int*)(long)(data+1)) = (int)((code+disp_code_data) - (data+5));
+  /* old objects pointing to the new body */
+  dirty_range(stub, disp_code_data+stub_size, pcb);
+  dirty_range(after, disp_vector_data + 3*wordsize, pcb);
+  relocate_code(code, foreign, pcb);
+  return code;
+}
+
+#ifdef LAZY_CODE
+/* the SIGTRAP action before ours */
+static struct sigaction next_trap;
+
+static void
+on_trap(int signo, siginfo_t* info, void* uc){
+  ikpcb* pcb = ik_current_pcb;
+  ikptr pc = (ikptr)trap_pc(uc) - 1;
+  ikptr code = 0;
+  if(pcb && (info->si_code == SI_KERNEL)){
+    pcb = pcb->main_pcb;
+    code = lazy_code_at(pcb, pc);
+  }
+  if(code){
+    materialize(code, pcb);
+    trap_pc(uc) = pc;
+  } else if(next_trap.sa_flags & SA_SIGINFO){
+    next_trap.sa_sigaction(signo, info, uc);
+  } else if(next_trap.sa_handler == SIG_DFL){
+    /* fatal: delivered again as we return */
+    sigaction(signo, &next_trap, 0);
+    raise(signo);
+  } else if(next_trap.sa_handler != SIG_IGN){
+    next_trap.sa_handler(signo);
+  }
+}
+
+static void
+register_trap_handler(){
+  static int registered = 0;
+  if(registered){
+    return;
+  }
+  struct sigaction sa;
+  sa.sa_sigaction = on_trap;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+  int err = sigaction(SIGTRAP, &sa, &next_trap);
+  if(err){
+    fprintf(stderr, "Sigaction Failed: %s\n", strerror(errno));
+    exit(-1);
+  }
+  registered = 1;
+}
+#endif
+
+/* copies in every code object left lazy, walking the code pages */
+void
+ik_materialize_code(ikpcb* pcb){
+  if(! pcb->lazy_code){
+    return;
+  }
+  ikptr x;
+  for(x=pcb->memory_base; x<pcb->memory_end; x+=pagesize){
+    if((pcb->segment_vector[page_index(x)] & type_mask) != code_type){
+      continue;
+    }
+    ikptr p = x;
+    ikptr q = x + pagesize;
+    while((p < q) && (ref(p, 0) == code_tag)){
+      if(lazy_stub_p(p)){
+        materialize(p, pcb);
+      }
+      p += align(disp_code_data + unfix(ref(p, disp_code_code_size)));
+    }
+  }
+  pcb->lazy_code = 0;
+}
+
+/* the code object x, or the one with its body if x is a stub, copied
+ * in, for code-ref and code-set! */
+ikptr
+ikrt_materialize_code(ikptr x, ikpcb* pcb){
+  ikptr code = x - vector_tag;
+  if(ref(code, disp_code_unused) == 0){
+    return x;
+  }
+  if(ref(code, disp_code_unused) == stub_done){
+    return ref(ref(code, disp_code_reloc_vector),
+               off_vector_data + 2*wordsize);
+  }
+  return materialize(code, pcb->main_pcb) + vector_tag;
+}
+
+void ik_fasl_load(ikpcb* pcb, char* fasl_file){ 
+  int filesize;
+  char* mem = map_fasl_file(fasl_file, &filesize);
+  if(ik_heap_image_p(mem, filesize)){
+    unmap_fasl_file(mem, filesize);
+    pcb->lazy_code = 0;
+    ik_load_heap_image(pcb, fasl_file);
+    return;
+  }
   fasl_port p;
   p.membase = mem;
   p.memp = mem;
   p.memq = mem + filesize;
   p.marks = 0;
   p.marks_size = 0;
+  p.lazy = 0;
+#ifdef LAZY_CODE
+  if(pcb->lazy_code){
+    register_trap_handler();
+    p.lazy = 1;
+  }
+#endif
+  pcb->lazy_code = p.lazy;
   while(p.memp < p.memq){
-    p.code_ap = 0;
-    p.code_ep = 0;
-    ikptr v = ik_fasl_read(pcb, &p);
-    if(p.marks_size){
-      ik_munmap((ikptr)(long)p.marks, p.marks_size*sizeof(ikptr*));
-      p.marks = 0;
-      p.marks_size = 0;
-    }
-    if(p.memp == p.memq){
-      int err = munmap(mem, mapsize);
-      if(err != 0){
-        fprintf(stderr, "Failed to unmap fasl file: %s\n", strerror(errno));
-        exit(-1);
-      }
-      close(fd);
+    ikptr v = fasl_read_next(pcb, &p);
+    if(p.lazy){
+      ikrt_materialize_code(v, pcb);
+    }
+    else if(p.memp == p.memq){
+      unmap_fasl_file(mem, filesize);
     }
     ikptr val = ik_exec_code(pcb, v, 0, 0);
     if(val != void_object){
@@ -121,6 +383,37 @@ void ik_fasl_load(ikpcb* pcb, char* fasl_file){
   }
 }
 
+/* the objects of fasl_file in order, read but not run; nothing
+ * collects meanwhile */
+ikptr
+ik_fasl_read_file(ikpcb* pcb, char* fasl_file){
+  int filesize;
+  char* mem = map_fasl_file(fasl_file, &filesize);
+  fasl_port p;
+  p.membase = mem;
+  p.memp = mem;
+  p.memq = mem + filesize;
+  p.marks = 0;
+  p.marks_size = 0;
+  p.lazy = 0;
+  ikptr ls = null_object;
+  ikptr last = 0;
+  while(p.memp < p.memq){
+    ikptr v = fasl_read_next(pcb, &p);
+    ikptr q = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
+    ref(q, off_car) = v;
+    ref(q, off_cdr) = null_object;
+    if(last){
+      ref(last, off_cdr) = q;
+    } else {
+      ls = q;
+    }
+    last = q;
+  }
+  unmap_fasl_file(mem, filesize);
+  return ls;
+}
+
 static ikptr 
 alloc_code(long int size, ikpcb* pcb, fasl_port* p){
   long int asize = align(size);
@@ -131,6 +424,8 @@ alloc_code(long int size, ikpcb* pcb, fasl_port* p){
     return ap;
   } else if (asize < pagesize){
     ikptr mem = ik_mmap_code(pagesize, 0, pcb);
+    /* the collector scans a code page up to the first non-code word */
+    bzero((char*)(long)(mem+asize), pagesize-asize);
     long int bytes_remaining = pagesize - asize;
     long int previous_bytes = 
       ((unsigned long int)p->code_ep) - ((unsigned long int)ap);
@@ -149,13 +444,54 @@ alloc_code(long int size, ikpcb* pcb, fasl_port* p){
 }
 
 
-void
-ik_relocate_code(ikptr code){
+/* the address of a foreign name, a bytevector */
+static ikptr
+foreign_address(ikptr str){
+  char* name;
+  if(tagof(str) == bytevector_tag){
+    name = (char*)(long) str + off_bytevector_data;
+  } else {
+    fprintf(stderr, "foreign name is not a bytevector\n");
+    exit(-1);
+  }
+  dlerror();
+  void* sym = dlsym(RTLD_DEFAULT, name);
+  char* err = dlerror();
+  if(err){
+    fprintf(stderr, "failed to find foreign name %s: %s\n", name, err);
+    exit(-1);
+  }
+  return (ikptr)sym;
+}
+
+/* where the displaced or relative reloc at p points: for lazy code
+ * (pcb not 0), past the entry of a stub is in its body */
+static ikptr
+reloc_target(ikptr p, ikpcb* pcb){
+  long int obj_off = unfix(ref(p, wordsize));
+  ikptr obj = ref(p, 2*wordsize);
+  if(pcb && (tagof(obj) == vector_tag) &&
+     (ref(obj, -vector_tag) == code_tag) &&
+     (ref(obj, disp_code_unused - vector_tag) != 0) &&
+     (obj_off != disp_code_data - vector_tag)){
+    obj = ikrt_materialize_code(obj, pcb);
+    ref(p, 2*wordsize) = obj;
+    dirty_range(p, 3*wordsize, pcb);
+  }
+  return obj + obj_off;
+}
+
+/* foreign is a bytevector of the addresses of the foreign names, in
+ * order, or false to look them up */
+static void
+relocate_code(ikptr code, ikptr foreign, ikpcb* pcb){
   ikptr vec = ref(code, disp_code_reloc_vector);
   ikptr size = ref(vec, off_vector_length);
   ikptr data = code + disp_code_data;
   ikptr p = vec + off_vector_data;
   ikptr q = p + size;
+  ikptr* addresses = (foreign == false_object) ? 0 :
+    (ikptr*)(long)(foreign + off_bytevector_data);
   while(p < q){
     long int r = unfix(ref(p, 0));
     if(r == 0){
@@ -171,16 +507,12 @@ ik_relocate_code(ikptr code){
     } 
     else if(tag == 2){
       /* displaced object */
-      long int obj_off = unfix(ref(p, wordsize));
-      ikptr obj = ref(p, 2*wordsize);
-      ref(data, code_off) = obj + obj_off;
+      ref(data, code_off) = reloc_target(p, pcb);
       p += (3*wordsize);
     }
     else if(tag == 3){
       /* jump label */
-      long int obj_off = unfix(ref(p, wordsize));
-      long int obj = ref(p, 2*wordsize);
-      long int displaced_object = obj + obj_off;
+      long int displaced_object = reloc_target(p, pcb);
       long int next_word = data + code_off + 4;
       long int relative_distance = displaced_object - next_word;
 #if 0
@@ -194,22 +526,11 @@ ik_relocate_code(ikptr code){
     }
     else if(tag == 1){
       /* foreign object */
-      ikptr str = ref(p, wordsize);
-      char* name;
-      if(tagof(str) == bytevector_tag){
-        name = (char*)(long) str + off_bytevector_data;
+      if(addresses){
+        ref(data,code_off) = *addresses++;
       } else {
-        fprintf(stderr, "foreign name is not a bytevector\n");
-        exit(-1);
+        ref(data,code_off) = foreign_address(ref(p, wordsize));
       }
-      dlerror();
-      void* sym = dlsym(RTLD_DEFAULT, name);
-      char* err = dlerror();
-      if(err){
-        fprintf(stderr, "failed to find foreign name %s: %s\n", name, err);
-        exit(-1);
-      }
-      ref(data,code_off) = (ikptr)sym;
       p += (2*wordsize);
     }
     else {
@@ -219,6 +540,39 @@ ik_relocate_code(ikptr code){
   }
 }
 
+void
+ik_relocate_code(ikptr code){
+  relocate_code(code, false_object, 0);
+}
+
+/* the addresses of the foreign names of the reloc vector vec, in a
+ * bytevector, or false if there are none */
+static ikptr
+foreign_addresses(ikptr vec, ikpcb* pcb){
+  ikptr p = vec + off_vector_data;
+  ikptr q = p + ref(vec, off_vector_length);
+  long int n = 0;
+  for(; p < q; p += ((unfix(ref(p, 0)) & 3) < 2) ? 2*wordsize : 3*wordsize){
+    if((unfix(ref(p, 0)) & 3) == 1){
+      n++;
+    }
+  }
+  if(n == 0){
+    return false_object;
+  }
+  ikptr bv = ik_unsafe_alloc(pcb, align(disp_bytevector_data+n*wordsize+1))
+             + bytevector_tag;
+  ref(bv, off_bytevector_length) = fix(n*wordsize);
+  ikptr* addresses = (ikptr*)(long)(bv + off_bytevector_data);
+  for(p = vec + off_vector_data; p < q;
+      p += ((unfix(ref(p, 0)) & 3) < 2) ? 2*wordsize : 3*wordsize){
+    if((unfix(ref(p, 0)) & 3) == 1){
+      *addresses++ = foreign_address(ref(p, wordsize));
+    }
+  }
+  ((char*)addresses)[0] = 0;
+  return bv;
+}
 
 static char fasl_read_byte(fasl_port* p){
   if(p->memp < p->memq){
@@ -240,6 +594,15 @@ static void fasl_read_buf(fasl_port* p, void* buf, int n){
     exit(-1);
   }
 }
+static void fasl_skip(fasl_port* p, long int n){
+  if((p->memp+n) <= p->memq){
+    p->memp += n;
+  } else {
+    fprintf(stderr, "fasl_skip: read beyond eof\n");
+    exit(-1);
+  }
+}
+
 typedef struct{
   int code_size;
   int reloc_size;
@@ -248,6 +611,50 @@ typedef struct{
 
 
 
+static ikptr do_read(ikpcb* pcb, fasl_port* p);
+
+/* a stub for the code whose body is next in the file, see above */
+static ikptr
+read_stub(ikpcb* pcb, fasl_port* p, long int code_size, ikptr freevars,
+          ikptr annotation, int put_mark_index){
+  ikptr stub = alloc_code(align(stub_size+disp_code_data), pcb, p);
+  ikptr data = stub + disp_code_data;
+  ref(stub, 0) = code_tag;
+  ref(stub, disp_code_code_size) = fix(stub_size);
+  ref(stub, disp_code_freevars) = freevars;
+  ref(stub, disp_code_annotation) = annotation;
+  ref(stub, disp_code_unused) = (ikptr)(long)p->memp;
+  fasl_skip(p, code_size);
+  memset((char*)(long)data, 0xCC, stub_entry_size);
+  if(put_mark_index){
+    p->marks[put_mark_index] = stub+vector_tag;
+  }
+  ikptr relocs = do_read(pcb, p);
+  ref(data, stub_relocs) = relocs;
+  ref(data, stub_foreign) = foreign_addresses(relocs, pcb);
+  ref(data, stub_code_size) = fix(code_size);
+  /* the reloc vector of the stub once the body is in: a jump to it */
+  ikptr after = ik_unsafe_alloc(pcb, align(disp_vector_data+3*wordsize))
+                + vector_tag;
+  ref(after, off_vector_length) = fix(3);
+  ref(after, off_vector_data) = fix((1 << 2) | 3);
+  ref(after, off_vector_data+wordsize) = fix(disp_code_data - vector_tag);
+  ref(after, off_vector_data+2*wordsize) = false_object;
+  ref(data, stub_after) = after;
+  /* and until then, the words of the stub */
+  ikptr vec = ik_unsafe_alloc(pcb, align(disp_vector_data+6*wordsize))
+              + vector_tag;
+  ref(vec, off_vector_length) = fix(6);
+  ref(vec, off_vector_data) = fix(stub_relocs << 2);
+  ref(vec, off_vector_data+wordsize) = relocs;
+  ref(vec, off_vector_data+2*wordsize) = fix(stub_after << 2);
+  ref(vec, off_vector_data+3*wordsize) = after;
+  ref(vec, off_vector_data+4*wordsize) = fix(stub_foreign << 2);
+  ref(vec, off_vector_data+5*wordsize) = ref(data, stub_foreign);
+  ref(stub, disp_code_reloc_vector) = vec;
+  return stub+vector_tag;
+}
+
 static ikptr do_read(ikpcb* pcb, fasl_port* p){
   char c = fasl_read_byte(p);
   int put_mark_index = 0;
@@ -286,11 +693,16 @@ static ikptr do_read(ikpcb* pcb, fasl_port* p){
     fasl_read_buf(p, &code_size, sizeof(long int));
     fasl_read_buf(p, &freevars, sizeof(ikptr));
     ikptr annotation = do_read(pcb, p);
+    if(p->lazy){
+      return read_stub(pcb, p, code_size, freevars, annotation,
+                       put_mark_index);
+    }
     ikptr code = alloc_code(align(code_size+disp_code_data), pcb, p);
     ref(code, 0) = code_tag;
     ref(code, disp_code_code_size) = fix(code_size);
     ref(code, disp_code_freevars) = freevars;
     ref(code, disp_code_annotation) = annotation;
+    ref(code, disp_code_unused) = 0;
     fasl_read_buf(p, (void*)(disp_code_data+(long)code), code_size);
     if(put_mark_index){
       p->marks[put_mark_index] = code+vector_tag;
@@ -433,7 +845,7 @@ static ikptr do_read(ikpcb* pcb, fasl_port* p){
       ref(rtd, off_rtd_printer) = false_object;
       ref(rtd, off_rtd_symbol) = symb;
       ref(symb, off_symbol_record_value) = rtd;
-      ((unsigned int*)(long)pcb->dirty_vector)[page_index(symb+off_symbol_record_value)] = -1;
+      ik_remember(pcb, symb+off_symbol_record_value);
     } else {
       rtd = gensym_val;
     }
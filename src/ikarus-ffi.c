@@ -399,7 +399,6 @@ ffi_status ffi_prep_closure_loc (
 
 */
 
-extern ikpcb* the_pcb;
 static void 
 generic_callback(ffi_cif *cif, void *ret, void **args, void *user_data){
   /* convert args according to cif to scheme values */
@@ -413,7 +412,7 @@ generic_callback(ffi_cif *cif, void *ret, void **args, void *user_data){
   ikptr rtype_conv = ref(data, off_vector_data + 3 * wordsize);
   int n = unfix(ref(argtypes_conv, off_vector_length));
 
-  ikpcb* pcb = the_pcb;
+  ikpcb* pcb = ik_current_pcb;
   ikptr code_entry = ref(proc, off_closure_code);
   ikptr code_ptr = code_entry - off_code_data;
 
@@ -0,0 +1,842 @@
+/*
+ *  Ikarus Scheme -- A compiler for R6RS Scheme.
+ *  Copyright (C) 2006,2007,2008  Abdulaziz Ghuloum
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "ikarus-data.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+
+extern ikptr ik_errno_to_code();
+extern ikptr ikrt_thread_count(ikpcb*);
+
+#ifndef RTLD_DEFAULT
+#define RTLD_DEFAULT 0
+#endif
+
+/* older kernels take it for a hint, which map_runs checks */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+/* Heap images:
+ * loading the fasl boot file rebuilds every object on the heap and
+ * relocates every code object before anything runs.  A boot image is
+ * the heap that reading the boot file leaves, written out page by page
+ * after a full collection (ikarus --write-boot-image), so that loading
+ * it is mapping the pages back where they were and giving the segment
+ * vector their types.  The pages join the oldest generation as they
+ * are, clean, and stay shared with the file (and with every other
+ * ikarus mapping it) until they are written to.
+ *
+ * ikarus_main maps the image before anything else is mapped, at the
+ * addresses it was written for (ik_premap_heap_image), and the heap
+ * goes after it.  Where that fails, and in places, the image is mapped
+ * elsewhere and relocated: the words marked in the pointer bitmap of
+ * its pages are moved by the distance, and the code objects are
+ * relocated as the fasl reader does.  Either way the foreign names
+ * the code calls are looked up again, since the executable and the
+ * libraries may be elsewhere in this run.
+ *
+ * save-heap-image writes the same kind of image from a running
+ * program, with the thunk to call in place of the boot code objects,
+ * and ikarus --resume maps it back.  Such an image has no bitmap: the
+ * stack frames of the continuations in it are on data pages, where
+ * the return addresses cannot be told from other words, so it is
+ * mapped where it was written or not at all.  ikarus_main places the
+ * heap at IK_IMAGE_BASE for that, where nothing else is mapped at
+ * startup, in a reserve that keeps it there, but only in runs given
+ * --reserve and in runs that write or map an image; other runs keep
+ * the heap wherever the kernel maps it and cannot save it.
+ *
+ * The file has the header, the runs of pages, the segment type of
+ * each page, the foreign table, the pointer bitmap, and from the
+ * first page boundary on, the pages.
+ */
+
+#define image_magic "IKIMAGE1"
+#define image_boot 1
+#define image_heap 2
+
+#define oldest_gen (generation_count - 1)
+
+/* a bit for each word of a page */
+#define bitmap_bytes (pagesize / wordsize / 8)
+
+typedef struct {
+  char magic[8];
+  long int word_size;
+  long int kind;
+  ikptr lo;                 /* where the pages were written from */
+  ikptr hi;
+  long int run_count;
+  long int page_count;
+  long int foreign_count;
+  long int bitmap_pages;    /* page_count, or 0 if it cannot move */
+  ikptr symbol_table;
+  ikptr gensym_table;
+  long int symbol_count;
+  long int gensym_count;
+  ikptr base_rtd;
+  ikptr entry;              /* the code objects or thunk to run */
+  long int data_offset;     /* of the pages */
+} image_header;
+
+typedef struct {
+  ikptr base;
+  long int pages;
+} image_run;
+
+/* a call of a foreign name from code */
+typedef struct {
+  ikptr loc;                /* the word in the code */
+  ikptr name;               /* a bytevector */
+} image_foreign;
+
+typedef struct {
+  image_header h;
+  image_run* runs;
+  unsigned int* types;
+  image_foreign* foreign;
+  unsigned char* bitmap;
+} image;
+
+int
+ik_heap_image_p(char* mem, long int size){
+  return (size >= (long int)sizeof(image_header)) &&
+         (memcmp(mem, image_magic, sizeof(((image_header*)0)->magic)) == 0);
+}
+
+static void
+collect_all(ikpcb* pcb){
+  /* a marking cycle leaves the oldest generation in place */
+  while(pcb->mark_state){
+    ik_collect(0, pcb);
+  }
+  pcb->full_collect_pending = 1;
+  if(pcb->incremental_collect || pcb->mark_sweep_collect){
+    pcb->compact_pending = 1;
+  }
+  ik_collect(0, pcb);
+}
+
+/* Writing:
+ * after a full collection everything live is in the oldest
+ * generation, and nothing else is: the image is those pages.
+ */
+
+static int
+image_page_p(unsigned int t){
+  return ((t & gen_mask) == oldest_gen) && ((t & dealloc_mask) != 0);
+}
+
+/* a tagged pointer, not a fixnum or an immediate */
+static int
+pointer_p(ikptr x){
+  return (! is_fixnum(x)) && (tagof(x) != immediate_tag);
+}
+
+static int
+in_image_p(ikptr x, image_header* h){
+  ikptr a = x & ~((ikptr)7);
+  return (a >= h->lo) && (a < h->hi);
+}
+
+/* Pointer bitmap:
+ * the words to move when the image is mapped elsewhere.  They are
+ * found by walking the objects from the roots in the header, with the
+ * layouts the collector uses, so that only the slots that hold
+ * pointers are marked, and a fixnum that looks like one is not.  The
+ * code entry of a closure is marked by its place in the closure.  The
+ * pointers in the bodies of code are not marked; ik_relocate_code
+ * puts them back from the reloc vectors.
+ */
+
+typedef struct {
+  image* im;
+  ikpcb* pcb;
+  long int* page_no;        /* of each page from lo to hi, or -1 */
+  unsigned char* seen;      /* a bit for each word from lo to hi */
+  ikptr* stack;             /* objects to walk */
+  long int top;
+  long int size;
+} image_walk;
+
+static void
+walk_push(image_walk* w, ikptr x){
+  if(w->top == w->size){
+    ikptr* s = ik_malloc(2 * w->size * sizeof(ikptr));
+    memcpy(s, w->stack, w->size * sizeof(ikptr));
+    ik_free(w->stack, w->size * sizeof(ikptr));
+    w->stack = s;
+    w->size *= 2;
+  }
+  w->stack[w->top++] = x;
+}
+
+static void
+mark_word(image_walk* w, ikptr p){
+  ikptr lo = w->im->h.lo;
+  long int n = w->page_no[(p - lo) >> pageshift];
+  unsigned char* bits = w->im->bitmap + n * bitmap_bytes;
+  long int i = (p & (pagesize - 1)) / wordsize;
+  bits[i >> 3] |= (1 << (i & 7));
+}
+
+/* x is a tagged pointer into the image */
+static void
+walk_value(image_walk* w, ikptr x){
+  long int i = (x - w->im->h.lo) / wordsize;
+  if(! (w->seen[i >> 3] & (1 << (i & 7)))){
+    w->seen[i >> 3] |= (1 << (i & 7));
+    walk_push(w, x);
+  }
+}
+
+/* the word at p holds a tagged pointer, or an immediate */
+static void
+walk_slot(image_walk* w, ikptr p){
+  ikptr x = ref(p, 0);
+  if(! pointer_p(x)){
+    return;
+  }
+  if(in_image_p(x, &w->im->h)){
+    mark_word(w, p);
+    walk_value(w, x);
+  }
+  else if((x >= w->pcb->memory_base) && (x < w->pcb->memory_end) &&
+          (w->pcb->segment_vector[page_index(x)] != hole_mt)){
+    fprintf(stderr,
+            "ikarus: heap image: 0x%016lx points out of the image\n",
+            (long int)p);
+    exit(-1);
+  }
+}
+
+/* the word at p is the code entry of a closure */
+static void
+walk_code_entry(image_walk* w, ikptr p){
+  mark_word(w, p);
+  walk_value(w, ref(p, 0) - disp_code_data + vector_tag);
+}
+
+static void
+walk_object(image_walk* w, ikptr x){
+  int tag = tagof(x);
+  ikptr start = x - tag;
+  ikptr fst = ref(start, 0);
+  long int i;
+  if(tag == pair_tag){
+    walk_slot(w, start);
+    walk_slot(w, start + disp_cdr);
+  }
+  else if(tag == closure_tag){
+    long int size = disp_closure_data +
+                    ref(fst, disp_code_freevars - disp_code_data);
+    walk_code_entry(w, start);
+    for(i=disp_closure_data; i<size; i+=wordsize){
+      walk_slot(w, start + i);
+    }
+  }
+  else if((tag == string_tag) || (tag == bytevector_tag)){
+    /* no pointers */
+  }
+  else if(is_fixnum(fst)){
+    /* vector */
+    for(i=disp_vector_data; i<fst+disp_vector_data; i+=wordsize){
+      walk_slot(w, start + i);
+    }
+  }
+  else if(fst == symbol_record_tag){
+    for(i=disp_symbol_record_string; i<symbol_record_size; i+=wordsize){
+      walk_slot(w, start + i);
+    }
+  }
+  else if(tagof(fst) == rtd_tag){
+    long int len = ref(fst, off_rtd_length);
+    walk_slot(w, start);
+    for(i=0; i<len; i+=wordsize){
+      walk_slot(w, start + disp_record_data + i);
+    }
+  }
+  else if(fst == code_tag){
+    walk_slot(w, start + disp_code_reloc_vector);
+    walk_slot(w, start + disp_code_annotation);
+  }
+  else if(tagof(fst) == pair_tag){
+    /* tcbucket */
+    walk_slot(w, start + disp_tcbucket_tconc);
+    walk_slot(w, start + disp_tcbucket_key);
+    walk_slot(w, start + disp_tcbucket_val);
+    walk_slot(w, start + disp_tcbucket_next);
+  }
+  else if((((long int)fst) & port_mask) == port_tag){
+    for(i=wordsize; i<port_size; i+=wordsize){
+      walk_slot(w, start + i);
+    }
+  }
+  else if(fst == ratnum_tag){
+    walk_slot(w, start + disp_ratnum_num);
+    walk_slot(w, start + disp_ratnum_den);
+  }
+  else if(fst == compnum_tag){
+    walk_slot(w, start + disp_compnum_real);
+    walk_slot(w, start + disp_compnum_imag);
+  }
+  else if(fst == cflonum_tag){
+    walk_slot(w, start + disp_cflonum_real);
+    walk_slot(w, start + disp_cflonum_imag);
+  }
+  else if(fst == ephemeron_tag){
+    walk_slot(w, start + disp_ephemeron_key);
+    walk_slot(w, start + disp_ephemeron_value);
+  }
+  else if((fst == flonum_tag) || (fst == pointer_tag) ||
+          ((fst & bignum_mask) == bignum_tag)){
+    /* no pointers */
+  }
+  else {
+    /* continuations: their frames cannot be walked here */
+    fprintf(stderr, "ikarus: heap image: cannot write 0x%016lx\n",
+            (long int)x);
+    exit(-1);
+  }
+}
+
+/* fills im->bitmap from the roots in the header */
+static void
+mark_image_pointers(image* im, ikpcb* pcb){
+  image_header* h = &im->h;
+  image_walk w;
+  long int pages = (h->hi - h->lo) >> pageshift;
+  long int seen_bytes = ((h->hi - h->lo) / wordsize + 7) / 8;
+  w.im = im;
+  w.pcb = pcb;
+  w.page_no = ik_malloc(pages * sizeof(long int));
+  w.seen = ik_malloc(seen_bytes);
+  bzero(w.seen, seen_bytes);
+  w.size = 1024;
+  w.stack = ik_malloc(w.size * sizeof(ikptr));
+  w.top = 0;
+  long int i, j, n = 0;
+  for(i=0; i<pages; i++){
+    w.page_no[i] = -1;
+  }
+  for(i=0; i<h->run_count; i++){
+    long int first = (im->runs[i].base - h->lo) >> pageshift;
+    for(j=0; j<im->runs[i].pages; j++){
+      w.page_no[first + j] = n++;
+    }
+  }
+  /* the roots are in the header, not on a page: walked, not marked */
+  ikptr roots[4];
+  roots[0] = h->symbol_table;
+  roots[1] = h->gensym_table;
+  roots[2] = h->base_rtd;
+  roots[3] = h->entry;
+  for(i=0; i<4; i++){
+    if(pointer_p(roots[i]) && in_image_p(roots[i], h)){
+      walk_value(&w, roots[i]);
+    }
+  }
+  while(w.top > 0){
+    walk_object(&w, w.stack[--w.top]);
+  }
+  ik_free(w.page_no, pages * sizeof(long int));
+  ik_free(w.seen, seen_bytes);
+  ik_free(w.stack, w.size * sizeof(ikptr));
+}
+
+/* the foreign calls of the code objects of a page, into f if it is
+ * not 0; returns their number */
+static long int
+page_foreign(ikptr page, image_foreign* f){
+  long int n = 0;
+  ikptr code = page;
+  while((code < page+pagesize) && (ref(code, 0) == code_tag)){
+    ikptr vec = ref(code, disp_code_reloc_vector);
+    ikptr p = vec + off_vector_data;
+    ikptr q = p + ref(vec, off_vector_length);
+    while(p < q){
+      long int r = unfix(ref(p, 0));
+      long int tag = r & 3;
+      if(tag == 1){
+        if(f){
+          f[n].loc = code + disp_code_data + (r >> 2);
+          f[n].name = ref(p, wordsize);
+        }
+        n++;
+      }
+      p += ((tag == 0) || (tag == 1)) ? (2*wordsize) : (3*wordsize);
+    }
+    code += align(disp_code_data + unfix(ref(code, disp_code_code_size)));
+  }
+  return n;
+}
+
+static int
+write_bytes(FILE* f, void* p, long int n){
+  return (n == 0) || (fwrite(p, n, 1, f) == 1);
+}
+
+/* returns false if f could not be written */
+static int
+write_image(ikpcb* pcb, FILE* f, long int kind, ikptr entry){
+  image im;
+  image_header* h = &im.h;
+  bzero(&im, sizeof(image));
+  memcpy(h->magic, image_magic, sizeof(h->magic));
+  h->word_size = wordsize;
+  h->kind = kind;
+  unsigned int* segment_vec = pcb->segment_vector;
+  long int first = page_index(pcb->memory_base);
+  long int last = page_index(pcb->memory_end);
+  long int i;
+  for(i=first; i<last; i++){
+    if(image_page_p(segment_vec[i])){
+      if((i == first) || ! image_page_p(segment_vec[i-1])){
+        h->run_count++;
+      }
+      if(h->lo == 0){
+        h->lo = i << pageshift;
+      }
+      h->hi = (i+1) << pageshift;
+      h->page_count++;
+    }
+  }
+  im.runs = ik_malloc(h->run_count * sizeof(image_run));
+  im.types = ik_malloc(h->page_count * sizeof(unsigned int));
+  h->bitmap_pages = (kind == image_boot) ? h->page_count : 0;
+  im.bitmap = ik_malloc(h->bitmap_pages * bitmap_bytes + 1);
+  bzero(im.bitmap, h->bitmap_pages * bitmap_bytes);
+  image_run* r = im.runs - 1;
+  long int n = 0;
+  for(i=first; i<last; i++){
+    unsigned int t = segment_vec[i];
+    if(image_page_p(t)){
+      ikptr page = i << pageshift;
+      if((i == first) || ! image_page_p(segment_vec[i-1])){
+        r++;
+        r->base = page;
+        r->pages = 0;
+      }
+      r->pages++;
+      im.types[n] = t & ~meta_dirty_mask;
+      if((t & type_mask) == code_type){
+        h->foreign_count += page_foreign(page, 0);
+      }
+      n++;
+    }
+  }
+  im.foreign = ik_malloc(h->foreign_count * sizeof(image_foreign) + 1);
+  n = 0;
+  for(i=0; i<h->run_count; i++){
+    ikptr page = im.runs[i].base;
+    ikptr end = page + im.runs[i].pages * pagesize;
+    for(; page<end; page+=pagesize){
+      if((segment_vec[page_index(page)] & type_mask) == code_type){
+        n += page_foreign(page, im.foreign + n);
+      }
+    }
+  }
+  h->symbol_table = pcb->symbol_table;
+  h->gensym_table = pcb->gensym_table;
+  h->symbol_count = pcb->symbol_count;
+  h->gensym_count = pcb->gensym_count;
+  h->base_rtd = pcb->base_rtd;
+  h->entry = entry;
+  if(h->bitmap_pages){
+    mark_image_pointers(&im, pcb);
+  }
+  long int meta_size =
+    sizeof(image_header) +
+    h->run_count * sizeof(image_run) +
+    h->page_count * sizeof(unsigned int) +
+    h->foreign_count * sizeof(image_foreign) +
+    h->bitmap_pages * bitmap_bytes;
+  h->data_offset = align_to_next_page(meta_size);
+  int ok =
+    write_bytes(f, h, sizeof(image_header)) &&
+    write_bytes(f, im.runs, h->run_count * sizeof(image_run)) &&
+    write_bytes(f, im.types, h->page_count * sizeof(unsigned int)) &&
+    write_bytes(f, im.foreign, h->foreign_count * sizeof(image_foreign)) &&
+    write_bytes(f, im.bitmap, h->bitmap_pages * bitmap_bytes);
+  if(ok){
+    char pad[pagesize];
+    bzero(pad, pagesize);
+    ok = write_bytes(f, pad, h->data_offset - meta_size);
+  }
+  for(i=0; ok && (i<h->run_count); i++){
+    ok = write_bytes(f, (char*)(long)im.runs[i].base,
+                     im.runs[i].pages * pagesize);
+  }
+  ik_free(im.runs, h->run_count * sizeof(image_run));
+  ik_free(im.types, h->page_count * sizeof(unsigned int));
+  ik_free(im.bitmap, h->bitmap_pages * bitmap_bytes + 1);
+  ik_free(im.foreign, h->foreign_count * sizeof(image_foreign) + 1);
+  return ok;
+}
+
+/* reads the boot file without running it and writes the heap that
+ * it makes to image_file */
+void
+ik_write_boot_image(ikpcb* pcb, char* boot_file, char* image_file){
+  ikptr codes = ik_fasl_read_file(pcb, boot_file);
+  /* not part of the image */
+  pcb->arg_list = null_object;
+  /* nothing ran, so the collector is to find no frames */
+  pcb->frame_pointer = pcb->frame_base - wordsize;
+  pcb->root0 = &codes;
+  collect_all(pcb);
+  pcb->root0 = 0;
+  FILE* f = fopen(image_file, "w");
+  if(f == NULL){
+    fprintf(stderr, "ikarus: cannot open \"%s\": %s\n",
+            image_file, strerror(errno));
+    exit(-1);
+  }
+  if(! write_image(pcb, f, image_boot, codes) || (fclose(f) != 0)){
+    fprintf(stderr, "ikarus: cannot write \"%s\": %s\n",
+            image_file, strerror(errno));
+    exit(-1);
+  }
+}
+
+/* path is a bytevector, entry a list of the thunk to call on resuming.
+ * returns #t, #f if other threads or places are running, () if the
+ * heap has no reserve to be mapped back in, or the errno code if the
+ * file cannot be written */
+ikptr
+ikrt_save_heap_image(ikptr path, ikptr entry, ikpcb* pcb){
+  if((pcb->main_pcb != pcb) || pcb->place || ik_live_places ||
+     (ikrt_thread_count(pcb) != fix(0))){
+    return false_object;
+  }
+  if(pcb->reserve_base == 0){
+    return null_object;
+  }
+  /* before the collection moves path */
+  FILE* f = fopen((char*)(long)(path + off_bytevector_data), "w");
+  if(f == NULL){
+    return ik_errno_to_code();
+  }
+  /* the image outlives the boot file it would point to */
+  ik_materialize_code(pcb);
+  pcb->root0 = &entry;
+  collect_all(pcb);
+  pcb->root0 = 0;
+  /* no allocation until the pages are out */
+  if(! write_image(pcb, f, image_heap, entry)){
+    ikptr code = ik_errno_to_code();
+    fclose(f);
+    return code;
+  }
+  if(fclose(f) != 0){
+    return ik_errno_to_code();
+  }
+  return true_object;
+}
+
+/* Loading:
+ */
+
+static void
+read_bytes(int fd, void* p, long int n, long int off, char* file){
+  if(pread(fd, p, n, off) != n){
+    fprintf(stderr, "ikarus: cannot read heap image \"%s\"\n", file);
+    exit(-1);
+  }
+}
+
+/* reads all but the bitmap and the pages, returns the descriptor */
+static int
+open_image(char* file, image* im){
+  int fd = open(file, O_RDONLY);
+  if(fd == -1){
+    fprintf(stderr, "ikarus: failed to open boot file \"%s\": %s\n",
+            file, strerror(errno));
+    exit(-1);
+  }
+  image_header* h = &im->h;
+  read_bytes(fd, h, sizeof(image_header), 0, file);
+  if((h->word_size != wordsize) ||
+     ((h->kind != image_boot) && (h->kind != image_heap))){
+    fprintf(stderr, "ikarus: \"%s\" is not a heap image for this ikarus\n",
+            file);
+    exit(-1);
+  }
+  long int off = sizeof(image_header);
+  im->runs = ik_malloc(h->run_count * sizeof(image_run));
+  read_bytes(fd, im->runs, h->run_count * sizeof(image_run), off, file);
+  off += h->run_count * sizeof(image_run);
+  im->types = ik_malloc(h->page_count * sizeof(unsigned int));
+  read_bytes(fd, im->types, h->page_count * sizeof(unsigned int), off, file);
+  off += h->page_count * sizeof(unsigned int);
+  im->foreign = ik_malloc(h->foreign_count * sizeof(image_foreign) + 1);
+  read_bytes(fd, im->foreign, h->foreign_count * sizeof(image_foreign),
+             off, file);
+  im->bitmap = 0;
+  return fd;
+}
+
+static void
+free_image(image* im){
+  image_header* h = &im->h;
+  ik_free(im->runs, h->run_count * sizeof(image_run));
+  ik_free(im->types, h->page_count * sizeof(unsigned int));
+  ik_free(im->foreign, h->foreign_count * sizeof(image_foreign) + 1);
+  if(im->bitmap){
+    ik_free(im->bitmap, h->bitmap_pages * bitmap_bytes);
+  }
+}
+
+static void
+unmap_runs(image* im, long int delta, long int count){
+  long int i;
+  for(i=0; i<count; i++){
+    munmap((char*)(long)(im->runs[i].base + delta),
+           im->runs[i].pages * pagesize);
+  }
+}
+
+/* maps the runs delta bytes off where they were written from, returns
+ * false if an address was taken */
+static int
+map_runs(int fd, image* im, long int delta, int flags){
+  long int off = im->h.data_offset;
+  long int i;
+  for(i=0; i<im->h.run_count; i++){
+    char* want = (char*)(long)(im->runs[i].base + delta);
+    unsigned long int size = im->runs[i].pages * pagesize;
+    char* mem = mmap(want, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | flags, fd, off);
+    if(mem != want){
+      if(mem != MAP_FAILED){
+        munmap(mem, size);
+      }
+      unmap_runs(im, delta, i);
+      return 0;
+    }
+    off += size;
+  }
+  return 1;
+}
+
+/* mapped by ik_premap_heap_image, then installed by
+ * ik_adopt_heap_image, and not run yet */
+static char* premapped_file = 0;
+static image premapped;
+
+/* returns true if it mapped the image, and the heap is to follow */
+int
+ik_premap_heap_image(char* file){
+  char magic[sizeof(image_header)];
+  int fd = open(file, O_RDONLY);
+  if(fd == -1){
+    return 0;
+  }
+  int n = read(fd, magic, sizeof(magic));
+  close(fd);
+  if(! ik_heap_image_p(magic, n)){
+    return 0;
+  }
+  fd = open_image(file, &premapped);
+  if(map_runs(fd, &premapped, 0, MAP_FIXED_NOREPLACE)){
+    premapped_file = file;
+    ik_place_heap(premapped.h.hi);
+  } else {
+    free_image(&premapped);
+  }
+  close(fd);
+  return premapped_file != 0;
+}
+
+/* maps the image wherever there is room, returns the distance */
+static long int
+map_elsewhere(int fd, image* im, char* file){
+  image_header* h = &im->h;
+  if(h->bitmap_pages == 0){
+    fprintf(stderr, "ikarus: heap image \"%s\" cannot be moved from 0x%lx\n",
+            file, (long int)h->lo);
+    exit(-1);
+  }
+  unsigned long int size = h->hi - h->lo;
+  char* span = mmap(ik_mapping_hint(size), size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if(span == MAP_FAILED){
+    fprintf(stderr, "ikarus: cannot map heap image \"%s\": %s\n",
+            file, strerror(errno));
+    exit(-1);
+  }
+  long int delta = (ikptr)(long)span - h->lo;
+  if(! map_runs(fd, im, delta, MAP_FIXED)){
+    fprintf(stderr, "ikarus: cannot map heap image \"%s\": %s\n",
+            file, strerror(errno));
+    exit(-1);
+  }
+  /* the holes between the runs go back */
+  long int i;
+  for(i=1; i<h->run_count; i++){
+    ikptr end = im->runs[i-1].base + im->runs[i-1].pages * pagesize;
+    if(end < im->runs[i].base){
+      munmap((char*)(long)(end + delta), im->runs[i].base - end);
+    }
+  }
+  long int off = sizeof(image_header) +
+    h->run_count * sizeof(image_run) +
+    h->page_count * sizeof(unsigned int) +
+    h->foreign_count * sizeof(image_foreign);
+  im->bitmap = ik_malloc(h->bitmap_pages * bitmap_bytes);
+  read_bytes(fd, im->bitmap, h->bitmap_pages * bitmap_bytes, off, file);
+  return delta;
+}
+
+static ikptr
+moved(ikptr x, image* im, long int delta){
+  if(pointer_p(x) && in_image_p(x, &im->h)){
+    return x + delta;
+  }
+  return x;
+}
+
+static void
+relocate_image(image* im, long int delta){
+  unsigned char* bits = im->bitmap;
+  unsigned int* types = im->types;
+  long int i;
+  for(i=0; i<im->h.run_count; i++){
+    ikptr page = im->runs[i].base + delta;
+    ikptr end = page + im->runs[i].pages * pagesize;
+    for(; page<end; page+=pagesize){
+      long int j;
+      for(j=0; j<bitmap_bytes; j++){
+        unsigned int b = bits[j];
+        while(b){
+          int k = __builtin_ctz(b);
+          b &= b - 1;
+          ref(page, (8*j+k) * wordsize) += delta;
+        }
+      }
+      bits += bitmap_bytes;
+    }
+  }
+  /* the reloc vectors are right now */
+  for(i=0; i<im->h.run_count; i++){
+    ikptr page = im->runs[i].base + delta;
+    ikptr end = page + im->runs[i].pages * pagesize;
+    for(; page<end; page+=pagesize){
+      if((*types++ & type_mask) == code_type){
+        ikptr p = page;
+        while((p < page+pagesize) && (ref(p, 0) == code_tag)){
+          ik_relocate_code(p);
+          p += align(disp_code_data + unfix(ref(p, disp_code_code_size)));
+        }
+      }
+    }
+  }
+}
+
+/* only the pages with a changed name are written to */
+static void
+resolve_foreign(image* im){
+  image_foreign* f = im->foreign;
+  image_foreign* e = f + im->h.foreign_count;
+  for(; f<e; f++){
+    char* name = (char*)(long)f->name + off_bytevector_data;
+    dlerror();
+    void* sym = dlsym(RTLD_DEFAULT, name);
+    char* err = dlerror();
+    if(err){
+      fprintf(stderr, "failed to find foreign name %s: %s\n", name, err);
+      exit(-1);
+    }
+    if(ref(f->loc, 0) != (ikptr)sym){
+      ref(f->loc, 0) = (ikptr)sym;
+    }
+  }
+}
+
+static void
+install_image(ikpcb* pcb, image* im, long int delta){
+  image_header* h = &im->h;
+  unsigned int* types = im->types;
+  long int i;
+  for(i=0; i<h->run_count; i++){
+    ik_adopt_pages(im->runs[i].base + delta, im->runs[i].pages * pagesize,
+                   types, pcb);
+    types += im->runs[i].pages;
+  }
+  pcb->gen_pages[oldest_gen] += h->page_count;
+  pcb->oldest_base_pages += h->page_count;
+  if(delta){
+    relocate_image(im, delta);
+  } else {
+    resolve_foreign(im);
+  }
+  pcb->symbol_table = moved(h->symbol_table, im, delta);
+  pcb->gensym_table = moved(h->gensym_table, im, delta);
+  pcb->symbol_count = h->symbol_count;
+  pcb->gensym_count = h->gensym_count;
+  pcb->base_rtd = moved(h->base_rtd, im, delta);
+  pcb->boot_codes = moved(h->entry, im, delta);
+}
+
+/* the premapped image, before the pcb has a reserved region, so that
+ * the tables are not copied over the whole region to reach it */
+void
+ik_adopt_heap_image(ikpcb* pcb){
+  install_image(pcb, &premapped, 0);
+  free_image(&premapped);
+}
+
+/* maps the image unless it was premapped, then runs its code objects
+ * as ik_fasl_load runs those of a boot file, or calls its thunk */
+void
+ik_load_heap_image(ikpcb* pcb, char* file){
+  if(premapped_file && (strcmp(file, premapped_file) == 0)){
+    premapped_file = 0;
+  } else {
+    image im;
+    int fd = open_image(file, &im);
+    long int delta = map_elsewhere(fd, &im, file);
+    close(fd);
+    install_image(pcb, &im, delta);
+    free_image(&im);
+  }
+  while(pcb->boot_codes != null_object){
+    ikptr v = ref(pcb->boot_codes, off_car);
+    pcb->boot_codes = ref(pcb->boot_codes, off_cdr);
+    ikptr val;
+    if(tagof(v) == closure_tag){
+      ikptr code = ref(v, off_closure_code) - off_code_data;
+      val = ik_exec_code(pcb, code, 0, v);
+    } else {
+      val = ik_exec_code(pcb, v, 0, 0);
+    }
+    if(val != void_object){
+      ik_print(val);
+    }
+  }
+}
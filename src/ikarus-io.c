@@ -17,6 +17,7 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -93,18 +94,38 @@ ikrt_open_output_fd(ikptr fn, ikptr ikopts /*, ikpcb* pcb */){
 }
 
 
+/* Blocking calls:
+ * a call that may block leaves the running threads while it waits
+ * (ik_enter_native), so that the other threads can collect meanwhile.
+ * Such a collection may move the objects the call was given, so the
+ * call keeps them in pcb->root0, works on buffers of its own, and
+ * copies into the objects only after ik_leave_native.  Without threads
+ * there is no one to collect, and the calls work in place.
+ */
+
 ikptr
-ikrt_read_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt /*, ikpcb* pcb */){
-#if 0
-  fprintf(stderr, "READ: %d\n", unfix(fd));
-#endif
-  ssize_t bytes = 
-   read(unfix(fd),
-        (char*)(long)(bv+off_bytevector_data+unfix(off)), 
-        unfix(cnt));
-#if 0
-  fprintf(stderr, "BYTES: %d\n", bytes);
-#endif
+ikrt_read_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt, ikpcb* pcb){
+  ssize_t bytes;
+  if(pcb->threads){
+    int n = unfix(cnt);
+    char* buf = ik_malloc(n+1);
+    pcb->root0 = &bv;
+    ik_enter_native(pcb);
+    bytes = read(unfix(fd), buf, n);
+    int err = errno;
+    ik_leave_native(pcb);
+    pcb->root0 = 0;
+    if(bytes > 0){
+      memcpy((char*)(long)(bv+off_bytevector_data+unfix(off)), buf, bytes);
+    }
+    ik_free(buf, n+1);
+    errno = err;
+  } else {
+    bytes = 
+     read(unfix(fd),
+          (char*)(long)(bv+off_bytevector_data+unfix(off)), 
+          unfix(cnt));
+  }
   if(bytes >= 0){
     return fix(bytes);
   } else {
@@ -113,7 +134,7 @@ ikrt_read_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt /*, ikpcb* pcb */){
 }
 
 ikptr
-ikrt_write_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt /*, ikpcb* pcb */){
+ikrt_write_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt, ikpcb* pcb){
 #if 0
   if (0) {
     fprintf(stderr, "WRITE %d, %p %d %d %d\n", 
@@ -130,10 +151,23 @@ ikrt_write_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt /*, ikpcb* pcb */){
     fprintf(stderr, "\n");
   }
 #endif
-  ssize_t bytes = 
-   write(unfix(fd),
-         (char*)(long)(bv+off_bytevector_data+unfix(off)), 
-         unfix(cnt));
+  ssize_t bytes;
+  if(pcb->threads){
+    int n = unfix(cnt);
+    char* buf = ik_malloc(n+1);
+    memcpy(buf, (char*)(long)(bv+off_bytevector_data+unfix(off)), n);
+    ik_enter_native(pcb);
+    bytes = write(unfix(fd), buf, n);
+    int err = errno;
+    ik_leave_native(pcb);
+    ik_free(buf, n+1);
+    errno = err;
+  } else {
+    bytes = 
+     write(unfix(fd),
+           (char*)(long)(bv+off_bytevector_data+unfix(off)), 
+           unfix(cnt));
+  }
   if(bytes >= 0){
     return fix(bytes);
   } else {
@@ -144,52 +178,63 @@ ikrt_write_fd(ikptr fd, ikptr bv, ikptr off, ikptr cnt /*, ikpcb* pcb */){
 
 
 static ikptr
-do_connect(ikptr host, ikptr srvc, int socket_type){
+do_connect(ikptr host, ikptr srvc, int socket_type, ikpcb* pcb){
+  char* hostname = strdup((char*)(long)(host+off_bytevector_data));
+  char* service = strdup((char*)(long)(srvc+off_bytevector_data));
+  ik_enter_native(pcb);
   struct addrinfo* info;
-  int err = getaddrinfo((char*)(long)(host+off_bytevector_data),
-                        (char*)(long)(srvc+off_bytevector_data),
-                        0,
-                        &info);
-  if(err){
-    switch(err){
-      case EAI_SYSTEM: return ik_errno_to_code();
-      default: return false_object;
-    }
-  }
-  struct addrinfo* i = info;
-  ikptr sock = false_object;
-  while(i){
-    if(i->ai_socktype != socket_type){
-      i = i->ai_next;
-    } else {
-      int s = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
-      if(s < 0){
-        sock = ik_errno_to_code();
+  int err = getaddrinfo(hostname, service, 0, &info);
+  int errnum = (err == EAI_SYSTEM) ? errno : 0;
+  free(hostname);
+  free(service);
+  int s = -1;
+  if(err == 0){
+    struct addrinfo* i = info;
+    while(i){
+      if(i->ai_socktype != socket_type){
         i = i->ai_next;
       } else {
-        int err = connect(s, i->ai_addr, i->ai_addrlen);
-        if(err < 0){
-          sock = ik_errno_to_code();
+        s = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+        if(s < 0){
+          errnum = errno;
+          i = i->ai_next;
+        } else if(connect(s, i->ai_addr, i->ai_addrlen) < 0){
+          errnum = errno;
+          close(s);
+          s = -1;
           i = i->ai_next;
         } else {
-          sock = fix(s);
           i = 0;
         }
       }
     }
+    freeaddrinfo(info);
+  }
+  ik_leave_native(pcb);
+  errno = errnum;
+  if(err){
+    switch(err){
+      case EAI_SYSTEM: return ik_errno_to_code();
+      default: return false_object;
+    }
+  }
+  if(s >= 0){
+    return fix(s);
+  } else if(errnum){
+    return ik_errno_to_code();
+  } else {
+    return false_object;
   }
-  freeaddrinfo(info);
-  return sock;
 }
 
 ikptr
-ikrt_tcp_connect(ikptr host, ikptr srvc /*, ikpcb* pcb */){
-  return do_connect(host, srvc, SOCK_STREAM);
+ikrt_tcp_connect(ikptr host, ikptr srvc, ikpcb* pcb){
+  return do_connect(host, srvc, SOCK_STREAM, pcb);
 }
 
 ikptr
-ikrt_udp_connect(ikptr host, ikptr srvc /*, ikpcb* pcb */){
-  return do_connect(host, srvc, SOCK_DGRAM);
+ikrt_udp_connect(ikptr host, ikptr srvc, ikpcb* pcb){
+  return do_connect(host, srvc, SOCK_DGRAM, pcb);
 }
 
 ikptr 
@@ -203,15 +248,32 @@ ikrt_make_fd_nonblocking(ikptr fdptr /*, ikpcb* pcb */){
 }
 
 ikptr 
-ikrt_select(ikptr fds, ikptr rfds, ikptr wfds, ikptr xfds /*, ikpcb* pcb */){
-  int rv = select(unfix(fds),
-                  (fd_set*)(rfds + off_bytevector_data),
-                  (fd_set*)(wfds + off_bytevector_data),
-                  (fd_set*)(xfds + off_bytevector_data),
-                  NULL);
+ikrt_select(ikptr fds, ikptr bv, ikpcb* pcb){
+  /* bv holds the read, write, and exception sets, a third each */
+  int n = unfix(ref(bv, off_bytevector_length)) / 3;
+  if(n > sizeof(fd_set)){
+    errno = EINVAL;
+    return ik_errno_to_code();
+  }
+  fd_set sets[3];
+  int i;
+  for(i=0; i<3; i++){
+    FD_ZERO(&sets[i]);
+    memcpy(&sets[i], (char*)(long)(bv+off_bytevector_data) + i*n, n);
+  }
+  pcb->root0 = &bv;
+  ik_enter_native(pcb);
+  int rv = select(unfix(fds), &sets[0], &sets[1], &sets[2], NULL);
+  int err = errno;
+  ik_leave_native(pcb);
+  pcb->root0 = 0;
   if(rv < 0){
+    errno = err;
     return ik_errno_to_code();
   } 
+  for(i=0; i<3; i++){
+    memcpy((char*)(long)(bv+off_bytevector_data) + i*n, &sets[i], n);
+  }
   return fix(rv);
 }
 
@@ -272,14 +334,24 @@ ikrt_getsockname(ikptr s, ikpcb* pcb){
 
 
 ikptr
-ikrt_accept(ikptr s, ikptr bv /*, ikpcb* pcb */){
-  socklen_t addrlen = unfix(ref(bv, off_bytevector_length));
-  int sock = accept(unfix(s),
-                    (struct sockaddr*) (bv+off_bytevector_data),
-                    &addrlen);
+ikrt_accept(ikptr s, ikptr bv, ikpcb* pcb){
+  struct sockaddr_storage addr;
+  socklen_t size = unfix(ref(bv, off_bytevector_length));
+  socklen_t addrlen = sizeof(addr);
+  pcb->root0 = &bv;
+  ik_enter_native(pcb);
+  int sock = accept(unfix(s), (struct sockaddr*) &addr, &addrlen);
+  int err = errno;
+  ik_leave_native(pcb);
+  pcb->root0 = 0;
   if(sock < 0){
+    errno = err;
     return ik_errno_to_code();
   } 
+  if(addrlen > size){
+    addrlen = size;
+  }
+  memcpy((char*)(long)(bv+off_bytevector_data), &addr, addrlen);
   ref(bv, off_bytevector_length) = fix(addrlen);
   return fix(sock);
 }
@@ -36,6 +36,9 @@ void register_alt_stack();
 
 
 ikpcb* the_pcb;
+char* ik_boot_file;
+/* the pcb running on this OS thread, for callbacks */
+__thread ikpcb* ik_current_pcb;
 
 int
 file_exists(char* filename){
@@ -44,7 +47,99 @@ file_exists(char* filename){
   return (s == 0);
 }
 
+/* address space reserved for the heap of runs that map or write a
+ * heap image, after the image, unless --reserve says otherwise: 64MB
+ * or 64GB.  Past it the heap is mapped wherever the kernel puts it.
+ * Other runs map their heap where the kernel puts it from the start,
+ * unless they are given --reserve. */
+#define IK_IMAGE_RESERVE \
+  ((unsigned long int)1 << ((wordsize==4)?26:36))
+
+/* --reserve 0 was given */
+static int no_reserve = 0;
+
 extern int cpu_has_sse2();
+extern void ikarus_usage_short();
+
+static long int
+parse_size(char* option, char* arg){
+  char* end;
+  long int n = strtol(arg, &end, 10);
+  switch(*end){
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+  }
+  if((*end != 0) || (n <= 0) || (unfix(fix(n)) != n)){
+    fprintf(stderr, "ikarus: invalid argument %s for %s\n", arg, option);
+    ikarus_usage_short();
+    exit(-1);
+  }
+  return n;
+}
+
+/* the heap options come before the file arguments:
+ *   --nursery-size <bytes>   --heap-growth <percent>   --max-heap <bytes>
+ *   --reserve <bytes>   --huge-pages   --lazy-code
+ * where <bytes> may end in k, m, or g, and is 0 for no reserve. */
+/* whether --reserve is among the heap options, which are parsed
+ * only once there is a pcb, after its first mappings are placed */
+static int
+reserve_given(int argc, char** argv){
+  int i = 1;
+  while(i < argc){
+    char* option = argv[i];
+    if(strcmp(option, "--reserve") == 0){
+      return (i+1 < argc) && (strcmp(argv[i+1], "0") != 0);
+    } else if((strcmp(option, "--huge-pages") == 0) ||
+              (strcmp(option, "--lazy-code") == 0)){
+      i += 1;
+    } else if((strcmp(option, "--nursery-size") == 0) ||
+              (strcmp(option, "--heap-growth") == 0) ||
+              (strcmp(option, "--max-heap") == 0)){
+      i += 2;
+    } else {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static int
+parse_heap_options(int argc, char** argv, ikpcb* pcb){
+  while(argc >= 2){
+    char* option = argv[1];
+    char* arg = (argc >= 3) ? argv[2] : "";
+    int n = 2;
+    if(strcmp(option, "--nursery-size") == 0){
+      pcb->nursery_size = parse_size(option, arg);
+    } else if(strcmp(option, "--heap-growth") == 0){
+      pcb->heap_growth = (int) parse_size(option, arg);
+    } else if(strcmp(option, "--max-heap") == 0){
+      pcb->max_heap = parse_size(option, arg);
+    } else if(strcmp(option, "--reserve") == 0){
+      if(strcmp(arg, "0") == 0){
+        no_reserve = 1;
+      } else {
+        ik_reserve_heap(pcb, parse_size(option, arg));
+      }
+    } else if(strcmp(option, "--huge-pages") == 0){
+      pcb->huge_pages = 1;
+      n = 1;
+    } else if(strcmp(option, "--lazy-code") == 0){
+      pcb->lazy_code = 1;
+      n = 1;
+    } else {
+      break;
+    }
+    int i;
+    for(i=n+1; i<=argc; i++){
+      argv[i-n] = argv[i];
+    }
+    argc -= n;
+  }
+  return argc;
+}
 
 int ikarus_main(int argc, char** argv, char* boot_file){
   if(! cpu_has_sse2()){
@@ -62,8 +157,60 @@ int ikarus_main(int argc, char** argv, char* boot_file){
     fprintf(stderr, "ERROR: invalid bits_per_limb=%d\n", mp_bits_per_limb);
     exit(-1);
   }
+  char* image_file = 0;
+  char* start_file = boot_file;
+  int resuming = 0;
+  int premapped = 0;
+  if((argc >= 3) && (strcmp(argv[1], "--write-boot-image") == 0)){
+    image_file = argv[2];
+    int i;
+    for(i=3; i<=argc; i++){
+      argv[i-2] = argv[i];
+    }
+    argc -= 2;
+  } else {
+    if((argc >= 3) && (strcmp(argv[1], "--resume") == 0)){
+      /* a saved heap image, also the first argument; places still
+       * start from the boot file */
+      start_file = argv[2];
+      resuming = 1;
+      int i;
+      for(i=2; i<=argc; i++){
+        argv[i-1] = argv[i];
+      }
+      argc -= 1;
+    }
+    /* before anything else takes its addresses */
+    premapped = ik_premap_heap_image(start_file);
+  }
+  if((! premapped) && (image_file || resuming || reserve_given(argc, argv))){
+    /* where a heap image saved from this run can be mapped again */
+    ik_place_heap(IK_IMAGE_BASE);
+  }
   ikpcb* pcb = ik_make_pcb();
   the_pcb = pcb;
+  ik_current_pcb = pcb;
+  ik_boot_file = boot_file;
+  if(premapped){
+    ik_adopt_heap_image(pcb);
+  }
+  if(resuming){
+    /* the heap options follow the image file */
+    argc = parse_heap_options(argc-1, argv+1, pcb) + 1;
+  } else {
+    argc = parse_heap_options(argc, argv, pcb);
+  }
+  if((image_file || premapped || resuming) && (! no_reserve)){
+    /* the heap stays next to the image, in pages that are reused, and
+     * where a heap image saved from this run can be mapped again */
+    ik_reserve_heap(pcb, IK_IMAGE_RESERVE);
+  }
+  ik_place_heap(0);
+  if(image_file){
+    ik_write_boot_image(pcb, boot_file, image_file);
+    ik_delete_pcb(pcb);
+    return 0;
+  }
   { /* set up arg_list */
     ikptr arg_list = null_object;
     int i = argc-1;
@@ -84,7 +231,7 @@ int ikarus_main(int argc, char** argv, char* boot_file){
   }
   register_handlers();
   register_alt_stack();
-  ik_fasl_load(pcb, boot_file);
+  ik_fasl_load(pcb, start_file);
   /*
   fprintf(stderr, "collect time: %d.%03d utime, %d.%03d stime (%d collections)\n", 
                   pcb->collect_utime.tv_sec, 
@@ -173,7 +320,9 @@ SYNOPSIS
 void
 register_alt_stack(){
 #if HAVE_SIGALTSTACK
-  char* stk = mmap(0, SIGSTKSZ, PROT_READ|PROT_WRITE|PROT_EXEC, 
+  /* the handler of lazy code copies code in and relocates it on it */
+  long int size = (SIGSTKSZ < 65536) ? 65536 : SIGSTKSZ;
+  char* stk = mmap(0, size, PROT_READ|PROT_WRITE|PROT_EXEC, 
                    MAP_PRIVATE|MAP_ANON, -1, 0);
 //  char* stk = ik_mmap(SIGSTKSZ);
   if(stk == (char*)-1){
@@ -183,7 +332,7 @@ register_alt_stack(){
 
   stack_t sa;
   sa.ss_sp = stk;
-  sa.ss_size = SIGSTKSZ;
+  sa.ss_size = size;
   sa.ss_flags = 0;
   int err = sigaltstack(&sa, 0);
   if(err){
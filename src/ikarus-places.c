@@ -0,0 +1,270 @@
+/*
+ *  Ikarus Scheme -- A compiler for R6RS Scheme.
+ *  Copyright (C) 2006,2007,2008  Abdulaziz Ghuloum
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "ikarus-data.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+/* Places:
+ * a place is an ikarus of its own running a script in an OS thread of
+ * its own.  It has a pcb of its own from ik_make_pcb, and with it a
+ * heap, a collector and a symbol table that nothing else touches, so
+ * the collector runs in it as in a single ikarus.
+ *
+ * The place and its creator share nothing but the channel: two queues
+ * of messages in malloced memory.  A message is a bytevector (scheme
+ * puts fasl-written data in it) that ikrt_place_put copies out of the
+ * sender's heap and ikrt_place_get copies into the receiver's.
+ */
+
+typedef struct ikmessage {
+  struct ikmessage* next;
+  long int size;
+  char data[];
+} ikmessage;
+
+typedef struct {
+  ikmessage* head;
+  ikmessage** tail;
+} ikqueue;
+
+typedef struct ikplace {
+  pthread_mutex_t lock;
+  pthread_cond_t cv;
+  ikqueue in;               /* to the place */
+  ikqueue out;              /* from the place */
+  int done;
+  int status;               /* what the place exited with */
+  pthread_t thread;
+  int argc;
+  char** argv;              /* the script and its arguments */
+  long int nursery_size;    /* the heap options of the creator */
+  int heap_growth;
+  long int max_heap;
+  int huge_pages;
+} ikplace;
+
+/* the places not done yet */
+int ik_live_places = 0;
+
+extern char* ik_boot_file;
+
+static void
+enqueue(ikqueue* q, ikmessage* m){
+  m->next = 0;
+  *q->tail = m;
+  q->tail = &m->next;
+}
+
+static ikmessage*
+dequeue(ikqueue* q){
+  ikmessage* m = q->head;
+  q->head = m->next;
+  if(q->head == 0){
+    q->tail = &q->head;
+  }
+  return m;
+}
+
+static void
+free_queue(ikqueue* q){
+  while(q->head){
+    ikmessage* m = dequeue(q);
+    ik_free(m, sizeof(ikmessage) + m->size);
+  }
+}
+
+static void
+free_place(ikplace* pl){
+  free_queue(&pl->in);
+  free_queue(&pl->out);
+  int i;
+  for(i=0; i<pl->argc; i++){
+    ik_free(pl->argv[i], strlen(pl->argv[i])+1);
+  }
+  ik_free(pl->argv, pl->argc * sizeof(char*));
+  pthread_mutex_destroy(&pl->lock);
+  pthread_cond_destroy(&pl->cv);
+  ik_free(pl, sizeof(ikplace));
+}
+
+/* called when the script of the place is done, or when it exits */
+void
+ik_place_exit(ikpcb* pcb, ikptr status){
+  ikplace* pl = pcb->place;
+  ik_delete_pcb(pcb);
+  pthread_mutex_lock(&pl->lock);
+  pl->status = is_fixnum(status) ? unfix(status) : EXIT_FAILURE;
+  pl->done = 1;
+  pthread_cond_broadcast(&pl->cv);
+  pthread_mutex_unlock(&pl->lock);
+  __sync_fetch_and_sub(&ik_live_places, 1);
+  pthread_exit(0);
+}
+
+static void*
+place_main(void* arg){
+  ikplace* pl = arg;
+  /* interrupts go to the main ikarus */
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, 0);
+  ikpcb* pcb = ik_make_pcb();
+  pcb->place = pl;
+  pcb->nursery_size = pl->nursery_size;
+  pcb->heap_growth = pl->heap_growth;
+  pcb->max_heap = pl->max_heap;
+  pcb->huge_pages = pl->huge_pages;
+  ik_current_pcb = pcb;
+  { /* what ikarus_main makes of "--r6rs-script script args ..." */
+    ikptr arg_list = null_object;
+    int i = pl->argc;
+    while(i >= 0){
+      char* s = (i == 0) ? "--r6rs-script" : pl->argv[i-1];
+      int n = strlen(s);
+      ikptr bv = ik_unsafe_alloc(pcb, align(disp_bytevector_data+n+1))
+                 + bytevector_tag;
+      ref(bv, off_bytevector_length) = fix(n);
+      memcpy((char*)(bv+off_bytevector_data), s, n+1);
+      ikptr p = ik_unsafe_alloc(pcb, pair_size);
+      ref(p, disp_car) = bv;
+      ref(p, disp_cdr) = arg_list;
+      arg_list = p+pair_tag;
+      i--;
+    }
+    pcb->arg_list = arg_list;
+  }
+  ik_fasl_load(pcb, ik_boot_file);
+  ik_place_exit(pcb, fix(0));
+  return 0;
+}
+
+/* args is a list of bytevectors, the script and its arguments */
+ikptr
+ikrt_make_place(ikptr args, ikpcb* pcb){
+  ikplace* pl = ik_malloc(sizeof(ikplace));
+  bzero(pl, sizeof(ikplace));
+  pthread_mutex_init(&pl->lock, 0);
+  pthread_cond_init(&pl->cv, 0);
+  pl->in.tail = &pl->in.head;
+  pl->out.tail = &pl->out.head;
+  ikptr p;
+  for(p=args; p!=null_object; p=ref(p, off_cdr)){
+    pl->argc++;
+  }
+  pl->argv = ik_malloc(pl->argc * sizeof(char*));
+  int i = 0;
+  for(p=args; p!=null_object; p=ref(p, off_cdr)){
+    ikptr bv = ref(p, off_car);
+    long int n = unfix(ref(bv, off_bytevector_length));
+    pl->argv[i] = ik_malloc(n+1);
+    memcpy(pl->argv[i], (char*)(bv+off_bytevector_data), n);
+    pl->argv[i][n] = 0;
+    i++;
+  }
+  ikpcb* main = pcb->main_pcb;
+  pl->nursery_size = main->nursery_size;
+  pl->heap_growth = main->heap_growth;
+  pl->max_heap = main->max_heap;
+  pl->huge_pages = main->huge_pages;
+  __sync_fetch_and_add(&ik_live_places, 1);
+  int err = pthread_create(&pl->thread, 0, place_main, pl);
+  if(err){
+    fprintf(stderr, "ikarus: cannot create place: %s\n", strerror(err));
+    __sync_fetch_and_sub(&ik_live_places, 1);
+    free_place(pl);
+    return false_object;
+  }
+  return make_pointer((long int)pl, pcb);
+}
+
+/* the channel to the creator, or #f outside of a place */
+ikptr
+ikrt_place_channel(ikpcb* pcb){
+  ikplace* pl = pcb->main_pcb->place;
+  if(pl == 0){
+    return false_object;
+  }
+  return make_pointer((long int)pl, pcb);
+}
+
+static ikplace*
+place_of(ikptr x){
+  return (ikplace*) ref(x, off_pointer_data);
+}
+
+/* side is #t for the place itself, #f for its creator */
+ikptr
+ikrt_place_put(ikptr x, ikptr side, ikptr bv, ikpcb* pcb){
+  ikplace* pl = place_of(x);
+  long int n = unfix(ref(bv, off_bytevector_length));
+  ikmessage* m = ik_malloc(sizeof(ikmessage) + n);
+  m->size = n;
+  memcpy(m->data, (char*)(bv+off_bytevector_data), n);
+  pthread_mutex_lock(&pl->lock);
+  enqueue((side == false_object) ? &pl->in : &pl->out, m);
+  pthread_cond_broadcast(&pl->cv);
+  pthread_mutex_unlock(&pl->lock);
+  pcb = pcb; /* no warning */
+  return void_object;
+}
+
+/* waits for the next message, returns #f if the place is done and
+ * there is none */
+ikptr
+ikrt_place_get(ikptr x, ikptr side, ikpcb* pcb){
+  ikplace* pl = place_of(x);
+  ikqueue* q = (side == false_object) ? &pl->out : &pl->in;
+  ik_enter_native(pcb);
+  pthread_mutex_lock(&pl->lock);
+  while((q->head == 0) && !((side == false_object) && pl->done)){
+    pthread_cond_wait(&pl->cv, &pl->lock);
+  }
+  ikmessage* m = q->head ? dequeue(q) : 0;
+  pthread_mutex_unlock(&pl->lock);
+  ik_leave_native(pcb);
+  if(m == 0){
+    return false_object;
+  }
+  ikptr bv = ik_safe_alloc(pcb, align(disp_bytevector_data+m->size+1))
+             + bytevector_tag;
+  ref(bv, off_bytevector_length) = fix(m->size);
+  memcpy((char*)(bv+off_bytevector_data), m->data, m->size);
+  ((char*)(bv+off_bytevector_data))[m->size] = 0;
+  ik_free(m, sizeof(ikmessage) + m->size);
+  return bv;
+}
+
+/* waits for the place to be done, returns its exit status, and frees
+ * the place */
+ikptr
+ikrt_place_wait(ikptr x, ikpcb* pcb){
+  ikplace* pl = place_of(x);
+  ik_enter_native(pcb);
+  pthread_join(pl->thread, 0);
+  ik_leave_native(pcb);
+  int status = pl->status;
+  free_place(pl);
+  return fix(status);
+}
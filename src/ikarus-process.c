@@ -271,13 +271,19 @@ ikrt_kill(ikptr pid, ikptr sigcode /*, ikpcb* pcb */){
 }
 
 ikptr 
-ikrt_waitpid(ikptr rvec, ikptr pid, ikptr block /*, ikpcb* pcb */){
+ikrt_waitpid(ikptr rvec, ikptr pid, ikptr block, ikpcb* pcb){
   /* rvec is assumed to come in as #(#f #f #f) */
   int status, options = 0;
   if(block == false_object){
     options = WNOHANG;
   }
+  /* other threads may collect, and move rvec, meanwhile */
+  pcb->root0 = &rvec;
+  ik_enter_native(pcb);
   pid_t r = waitpid(unfix(pid), &status, options);
+  int err = errno;
+  ik_leave_native(pcb);
+  pcb->root0 = 0;
   if(r > 0){
     ref(rvec, off_record_data+0*wordsize) = fix(r);
     if(WIFEXITED(status)) {
@@ -291,6 +297,7 @@ ikrt_waitpid(ikptr rvec, ikptr pid, ikptr block /*, ikpcb* pcb */){
   } else if(r == 0){  /* would have blocked */
     return fix(0);
   } else {
+    errno = err;
     return ik_errno_to_code();
   }
 }
@@ -54,37 +54,338 @@ extern char **environ;
 ikptr ik_mmap(unsigned long int size);
 void ik_munmap(ikptr mem, unsigned long int size);
 
+/* Fresh mappings are not filled: the kernel hands out zero pages that
+ * cost nothing until touched.  Build with -DIK_POISON_PAGES to fill
+ * pages with 0xFF when they are mapped and when they are cached for
+ * reuse, so that reads of uninitialized memory stand out. */
+#ifdef IK_POISON_PAGES
+#define poison_pages(base, size) memset((char*)(long)(base), -1, (size))
+#else
+#define poison_pages(base, size)
+#endif
+
+/* fresh mappings are zero-filled already, unless poisoned */
+#ifdef IK_POISON_PAGES
+#define zero_fresh_pages(base, size) bzero((char*)(long)(base), (size))
+#else
+#define zero_fresh_pages(base, size)
+#endif
+
+/* most pages held in pcb->cached_runs */
+#define RUN_CACHE_PAGES (1024 * 4)
+
+#define huge_page_size (1024 * 1024 * 2)
+
+/* first fit from a list of runs, splitting a bigger one */
+static ikptr
+take_run(ikpages** list, unsigned long int size){
+  ikpages** prev = list;
+  ikpages* run = *prev;
+  while(run){
+    if(run->size >= size){
+      ikptr p = run->base;
+      if(run->size == size){
+        *prev = run->next;
+        ik_free(run, sizeof(ikpages));
+      } else {
+        run->base += size;
+        run->size -= size;
+      }
+      return p;
+    }
+    prev = &run->next;
+    run = *prev;
+  }
+  return 0;
+}
+
 static void
-extend_table_maybe(ikptr p, unsigned long int size, ikpcb* pcb){
+push_run(ikpages** list, ikptr base, unsigned long int size){
+  ikpages* run = ik_malloc(sizeof(ikpages));
+  run->base = base;
+  run->size = size;
+  run->next = *list;
+  *list = run;
+}
+
+static void
+free_runs(ikpages** list){
+  ikpages* run = *list;
+  *list = 0;
+  while(run){
+    ikpages* next = run->next;
+    ik_free(run, sizeof(ikpages));
+    run = next;
+  }
+}
+
+/* Reserved region:
+ * ik_reserve_heap maps one big PROT_NONE range and extends the segment
+ * and dirty vectors over all of it, once.  Heap pages are committed
+ * from it with mprotect and decommitted when released.  Released
+ * pages are reused from two lists, single pages and longer runs, and
+ * the rest of the region is handed out in address order.  Mappings
+ * go back to plain mmap (and growing the tables) only once the region
+ * is full.
+ */
+
+#define in_reserve(p, pcb) \
+  (((p) >= (pcb)->reserve_base) && ((p) < (pcb)->reserve_end))
+
+static void extend_tables(ikptr p, unsigned long int size, ikpcb* pcb);
+
+/* Placement:
+ * mappings go wherever the kernel puts them, unless ik_place_heap was
+ * given an address: then they are asked for from there upwards, so
+ * that the heap stays next to a heap image mapped below it and the
+ * range the collector walks stays small.  The kernel may still put a
+ * mapping elsewhere if the address is taken.  Addresses handed out
+ * are not handed out again, so this is for the first mappings of the
+ * pcb and its reserved region only; see ikarus_main.
+ */
+static ikptr mmap_hint = 0;
+
+void
+ik_place_heap(ikptr p){
+  mmap_hint = p;
+}
+
+char*
+ik_mapping_hint(unsigned long int size){
+  if(mmap_hint == 0){
+    return 0;
+  }
+  return (char*)(long)__sync_fetch_and_add(&mmap_hint, size);
+}
+
+void
+ik_reserve_heap(ikpcb* pcb, unsigned long int size){
+#ifndef __CYGWIN__
+  if(pcb->reserve_base){
+    return;
+  }
+  /* huge page aligned, for when pcb->huge_pages is set */
+  size = align_to_next_page(size);
+  unsigned long int mapsize = size + huge_page_size;
+  char* mem = mmap(ik_mapping_hint(mapsize), mapsize, PROT_NONE, 
+                   MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if(mem == MAP_FAILED){
+    fprintf(stderr, "ikarus: cannot reserve 0x%lx bytes: %s\n", 
+        size, strerror(errno));
+    exit(-1);
+  }
+  ikptr base = ((ikptr)(long)mem + huge_page_size - 1) & ~(huge_page_size - 1);
+  ikptr end = (ikptr)(long)mem + mapsize;
+  if(base > (ikptr)(long)mem){
+    munmap(mem, base - (ikptr)(long)mem);
+  }
+  if(end > base + size){
+    munmap((char*)(long)(base + size), end - (base + size));
+  }
+  pcb->reserve_base = base;
+  pcb->reserve_end = base + size;
+  /* handed out from the end nearest the rest of the heap, so that the
+   * range the collector walks stays small */
+  pcb->reserve_down = (pcb->reserve_base < pcb->memory_base);
+  pcb->reserve_ap = pcb->reserve_down ? pcb->reserve_end : pcb->reserve_base;
+  extend_tables(pcb->reserve_base, size, pcb);
+#else
+  fprintf(stderr, "ikarus: cannot reserve the heap on this platform\n");
+#endif
+}
+
+static ikptr
+reserve_take(unsigned long int size, ikpcb* pcb){
+  ikptr p = 0;
+  if(size == pagesize){
+    p = take_run(&pcb->reserve_pages, size);
+  }
+  if(p == 0){
+    p = take_run(&pcb->reserve_runs, size);
+  }
+  if(p == 0){
+    if(pcb->reserve_down){
+      if(size > (unsigned long int)(pcb->reserve_ap - pcb->reserve_base)){
+        return 0;
+      }
+      pcb->reserve_ap -= size;
+      p = pcb->reserve_ap;
+    } else {
+      if(size > (unsigned long int)(pcb->reserve_end - pcb->reserve_ap)){
+        return 0;
+      }
+      p = pcb->reserve_ap;
+      pcb->reserve_ap += size;
+    }
+  }
+  if(mprotect((char*)(long)p, size, PROT_READ|PROT_WRITE|PROT_EXEC) != 0){
+    fprintf(stderr, "ikarus: cannot commit reserved pages: %s\n",
+        strerror(errno));
+    exit(-1);
+  }
+#ifdef MADV_HUGEPAGE
+  if(pcb->huge_pages){
+    madvise((char*)(long)p, size, MADV_HUGEPAGE);
+  }
+#endif
+  poison_pages(p, size);
+  __sync_fetch_and_add(&total_allocated_pages, page_index(size));
+  return p;
+}
+
+static void
+reserve_release(ikptr base, unsigned long int size, ikpcb* pcb){
+  /* a fresh PROT_NONE mapping over it gives the memory back */
+  char* mem = mmap((char*)(long)base, size, PROT_NONE, 
+             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  if(mem == MAP_FAILED){
+    fprintf(stderr, "ikarus: cannot decommit reserved pages: %s\n",
+        strerror(errno));
+    exit(-1);
+  }
+  __sync_fetch_and_sub(&total_allocated_pages, page_index(size));
+  push_run((size == pagesize) ? &pcb->reserve_pages : &pcb->reserve_runs,
+           base, size);
+}
+
+static void
+free_reserve(ikpcb* pcb){
+  if(pcb->reserve_base){
+    free_runs(&pcb->reserve_pages);
+    free_runs(&pcb->reserve_runs);
+    munmap((char*)(long)pcb->reserve_base, 
+           pcb->reserve_end - pcb->reserve_base);
+    pcb->reserve_base = 0;
+    pcb->reserve_end = 0;
+    pcb->reserve_ap = 0;
+  }
+}
+
+/* releases heap pages, in or out of the reserved region */
+static void
+munmap_heap(ikptr base, unsigned long int size, ikpcb* pcb){
+  if(in_reserve(base, pcb)){
+    reserve_release(base, size, pcb);
+  } else {
+    ik_munmap(base, size);
+  }
+}
+
+/* a table replaced while other threads run: they may still store into
+ * the old dirty vector until they stop for the next collection, which
+ * merges it into the current one (ik_merge_retired_tables) */
+typedef struct ikretired{
+  ikptr base;
+  unsigned long int size;
+  ikptr dirty_vector;   /* biased like pcb->dirty_vector, or 0 */
+  ikptr table_base;
+  ikptr table_end;
+  struct ikretired* next;
+} ikretired;
+
+static void
+release_table(ikptr base, unsigned long int size, ikpcb* pcb){
+  if(pcb->threads){
+    ikretired* r = ik_malloc(sizeof(ikretired));
+    r->base = base;
+    r->size = size;
+    r->dirty_vector = 
+      (base == (ikptr)(long)pcb->dirty_vector_base) ? pcb->dirty_vector : 0;
+    r->table_base = pcb->table_base;
+    r->table_end = pcb->table_end;
+    r->next = pcb->threads->retired;
+    pcb->threads->retired = r;
+  }
+  else if(pcb->retain_tables){
+    /* parallel gc workers may hold on to the old table until the
+       end of the collection; see ik_free_retired_tables */
+    ikpages* p = ik_malloc(sizeof(ikpages));
+    p->base = base;
+    p->size = size;
+    p->next = pcb->retired_tables;
+    pcb->retired_tables = p;
+  } else {
+    ik_munmap(base, size);
+  }
+}
+
+void
+ik_free_retired_tables(ikpcb* pcb){
+  ikpages* p = pcb->retired_tables;
+  pcb->retired_tables = 0;
+  while(p){
+    ikpages* next = p->next;
+    ik_munmap(p->base, p->size);
+    ik_free(p, sizeof(ikpages));
+    p = next;
+  }
+}
+
+void
+ik_merge_retired_tables(ikpcb* pcb){
+  ikretired* r = pcb->threads->retired;
+  pcb->threads->retired = 0;
+  unsigned int* dirty_vec = (unsigned int*)(long)pcb->dirty_vector;
+  while(r){
+    ikretired* next = r->next;
+    if(r->dirty_vector){
+      unsigned int* old_vec = (unsigned int*)(long)r->dirty_vector;
+      long int i = page_index(r->table_base);
+      long int j = page_index(r->table_end);
+      for(; i<j; i++){
+        dirty_vec[i] |= old_vec[i];
+      }
+    }
+    ik_munmap(r->base, r->size);
+    ik_free(r, sizeof(ikretired));
+    r = next;
+  }
+}
+
+/* the threads keep copies of the table pointers for compiled code */
+static void
+update_thread_tables(ikpcb* pcb){
+  if(pcb->threads){
+    ikpcb* t;
+    for(t=pcb->threads->list; t; t=t->next_thread){
+      t->dirty_vector = pcb->dirty_vector;
+      t->segment_vector = pcb->segment_vector;
+    }
+  }
+}
+
+/* grows the segment and dirty vectors to cover p .. p+size */
+static void
+extend_tables(ikptr p, unsigned long int size, ikpcb* pcb){
   assert(size == align_to_next_page(size));
   ikptr q = p + size;
-  if(p < pcb->memory_base){
+  if(p < pcb->table_base){
     unsigned long int new_lo = segment_index(p);
-    unsigned long int old_lo = segment_index(pcb->memory_base);
-    unsigned long int hi = segment_index(pcb->memory_end);
+    unsigned long int old_lo = segment_index(pcb->table_base);
+    unsigned long int hi = segment_index(pcb->table_end);
     unsigned long int new_vec_size = (hi - new_lo) * pagesize;
     unsigned long int old_vec_size = (hi - old_lo) * pagesize;
     ikptr v = ik_mmap(new_vec_size);
-    bzero((char*)(long)v, new_vec_size - old_vec_size);
+    zero_fresh_pages(v, new_vec_size - old_vec_size);
     memcpy((char*)(long)(v+new_vec_size-old_vec_size),
            (char*)(long)pcb->dirty_vector_base, 
            old_vec_size);
-    ik_munmap((ikptr)(long)pcb->dirty_vector_base, old_vec_size);
+    release_table((ikptr)(long)pcb->dirty_vector_base, old_vec_size, pcb);
     pcb->dirty_vector_base = (unsigned int*)(long)v;
     pcb->dirty_vector = (v - new_lo * pagesize);
     ikptr s = ik_mmap(new_vec_size);
-    bzero((char*)(long)s, new_vec_size - old_vec_size);
+    zero_fresh_pages(s, new_vec_size - old_vec_size);
     memcpy((char*)(long)(s+new_vec_size-old_vec_size),
            (char*)(long)(pcb->segment_vector_base), 
            old_vec_size);
-    ik_munmap((ikptr)(long)pcb->segment_vector_base, old_vec_size);
+    release_table((ikptr)(long)pcb->segment_vector_base, old_vec_size, pcb);
     pcb->segment_vector_base = (unsigned int*)(long)s;
     pcb->segment_vector = (unsigned int*)(long)(s - new_lo * pagesize);
-    pcb->memory_base = (new_lo * segment_size);
+    pcb->table_base = (new_lo * segment_size);
   } 
-  else if (q >= pcb->memory_end){
-    unsigned long int lo = segment_index(pcb->memory_base);
-    unsigned long int old_hi = segment_index(pcb->memory_end);
+  else if (q >= pcb->table_end){
+    unsigned long int lo = segment_index(pcb->table_base);
+    unsigned long int old_hi = segment_index(pcb->table_end);
     unsigned long int new_hi = segment_index(q+segment_size-1);
     unsigned long int new_vec_size = (new_hi - lo) * pagesize;
     unsigned long int old_vec_size = (old_hi - lo) * pagesize;
@@ -92,17 +393,31 @@ extend_table_maybe(ikptr p, unsigned long int size, ikpcb* pcb){
     memcpy((char*)(long)v, 
            (char*)(long)pcb->dirty_vector_base,
            old_vec_size);
-    bzero((char*)(long)(v+old_vec_size), new_vec_size - old_vec_size);
-    ik_munmap((ikptr)(long)pcb->dirty_vector_base, old_vec_size);
+    zero_fresh_pages(v+old_vec_size, new_vec_size - old_vec_size);
+    release_table((ikptr)(long)pcb->dirty_vector_base, old_vec_size, pcb);
     pcb->dirty_vector_base = (unsigned int*)(long)v;
     pcb->dirty_vector = (v - lo * pagesize);
     ikptr s = ik_mmap(new_vec_size);
     memcpy((char*)(long)s, pcb->segment_vector_base, old_vec_size);
-    bzero((char*)(long)(s+old_vec_size), new_vec_size - old_vec_size);
-    ik_munmap((ikptr)(long)pcb->segment_vector_base, old_vec_size);
+    zero_fresh_pages(s+old_vec_size, new_vec_size - old_vec_size);
+    release_table((ikptr)(long)pcb->segment_vector_base, old_vec_size, pcb);
     pcb->segment_vector_base = (unsigned int*)(long) s;
     pcb->segment_vector = (unsigned int*)(s - lo * pagesize);
-    pcb->memory_end = (new_hi * segment_size);
+    pcb->table_end = (new_hi * segment_size);
+  }
+  update_thread_tables(pcb);
+}
+
+/* also extends the range of memory that the collector walks */
+static void
+extend_table_maybe(ikptr p, unsigned long int size, ikpcb* pcb){
+  extend_tables(p, size, pcb);
+  ikptr q = p + size;
+  if(p < pcb->memory_base){
+    pcb->memory_base = segment_index(p) * segment_size;
+  }
+  if(q > pcb->memory_end){
+    pcb->memory_end = segment_index(q+segment_size-1) * segment_size;
   }
 }
 
@@ -120,8 +435,8 @@ set_segment_type(ikptr base, unsigned long int size, unsigned int type, ikpcb* p
   }
 }
 
-void
-ik_munmap_from_segment(ikptr base, unsigned long int size, ikpcb* pcb){
+static void
+munmap_from_segment(ikptr base, unsigned long int size, ikpcb* pcb){
   assert(base >= pcb->memory_base);
   assert((base+size) <= pcb->memory_end);
   assert(size == align_to_next_page(size));
@@ -136,10 +451,19 @@ ik_munmap_from_segment(ikptr base, unsigned long int size, ikpcb* pcb){
     *s = 0;  
     p++; s++;
   }
+  if((size > pagesize) && 
+     (pcb->cached_run_pages + pcb->released_run_pages + page_index(size)
+        <= RUN_CACHE_PAGES)){
+    poison_pages(base, size);
+    push_run(&pcb->cached_runs, base, size);
+    pcb->cached_run_pages += page_index(size);
+    return;
+  }
   ikpage* r = pcb->uncached_pages;
   if (r){
     ikpage* cache = pcb->cached_pages;
     do{
+      poison_pages(base, pagesize);
       r->base = base;
       ikpage* next = r->next;
       r->next = cache;
@@ -152,35 +476,302 @@ ik_munmap_from_segment(ikptr base, unsigned long int size, ikpcb* pcb){
     pcb->uncached_pages = r;
   }
   if(size){
-    ik_munmap(base, size);
+    munmap_heap(base, size, pcb);
+  }
+}
+
+void
+ik_munmap_from_segment(ikptr base, unsigned long int size, ikpcb* pcb){
+  pcb = pcb->main_pcb;
+  ik_heap_lock(pcb);
+  munmap_from_segment(base, size, pcb);
+  ik_heap_unlock(pcb);
+}
+
+
+static ikptr
+take_cached_run(unsigned long int size, ikpcb* pcb){
+  ikptr p = take_run(&pcb->cached_runs, size);
+  if(p){
+    pcb->cached_run_pages -= page_index(size);
+    return p;
+  }
+  p = take_run(&pcb->released_runs, size);
+  if(p){
+    pcb->released_run_pages -= page_index(size);
+    poison_pages(p, size);
+  }
+  return p;
+}
+
+static ikptr
+take_cached_page(ikpcb* pcb){
+  ikpage* s = pcb->cached_pages;
+  int released = 0;
+  if(s == 0){
+    s = pcb->released_pages;
+    released = 1;
+    if(s == 0){
+      return 0;
+    }
+  }
+  ikptr p = s->base;
+  if(released){
+    pcb->released_pages = s->next;
+    poison_pages(p, pagesize);
+  } else {
+    pcb->cached_pages = s->next;
+  }
+  s->next = pcb->uncached_pages;
+  pcb->uncached_pages = s; 
+  return p;
+}
+
+static void
+free_cached_runs(ikpages** list, ikpcb* pcb){
+  ikpages* run = *list;
+  *list = 0;
+  while(run){
+    ikpages* next = run->next;
+    munmap_heap(run->base, run->size, pcb);
+    ik_free(run, sizeof(ikpages));
+    run = next;
+  }
+}
+
+/* Retained pages:
+ * The page cache and the cached runs keep freed pages mapped for
+ * reuse.  After a collection, ik_release_cached_pages keeps the most
+ * recently freed retain_pages of them resident and gives the memory
+ * of the rest back to the kernel with madvise, one call per run of
+ * adjacent pages.  Released pages keep their addresses and are reused
+ * after the resident ones.
+ */
+
+/* MADV_FREE is cheaper, but the pages stay in the resident set until
+ * the system runs short, which is the number we want to bring down */
+static void
+release_memory(ikptr base, unsigned long int size){
+  madvise((char*)(long)base, size, MADV_DONTNEED);
+}
+
+void
+ik_release_cached_pages(ikpcb* pcb){
+  long int keep = pcb->retain_pages;
+  ikpage** pp = &pcb->cached_pages;
+  while(*pp && (keep > 0)){
+    keep--;
+    pp = &(*pp)->next;
+  }
+  ikpage* p = *pp;
+  *pp = 0;
+  ikptr lo = 0;
+  ikptr hi = 0;
+  while(p){
+    ikpage* next = p->next;
+    if(p->base == lo - pagesize){
+      lo = p->base;
+    } else if(p->base == hi){
+      hi += pagesize;
+    } else {
+      if(lo < hi){
+        release_memory(lo, hi - lo);
+      }
+      lo = p->base;
+      hi = lo + pagesize;
+    }
+    p->next = pcb->released_pages;
+    pcb->released_pages = p;
+    p = next;
+  }
+  if(lo < hi){
+    release_memory(lo, hi - lo);
+  }
+  ikpages** rp = &pcb->cached_runs;
+  while(*rp && (keep >= (long int)page_index((*rp)->size))){
+    keep -= page_index((*rp)->size);
+    rp = &(*rp)->next;
+  }
+  ikpages* r = *rp;
+  *rp = 0;
+  while(r){
+    ikpages* next = r->next;
+    release_memory(r->base, r->size);
+    pcb->cached_run_pages -= page_index(r->size);
+    pcb->released_run_pages += page_index(r->size);
+    r->next = pcb->released_runs;
+    pcb->released_runs = r;
+    r = next;
+  }
+}
+
+/* resident set size, recorded by every collection.  statm is kept
+ * open, since it is read that often */
+static int statm_fd = -2;
+
+long int
+ik_resident_bytes(void){
+  long int pages = -1;
+  if(statm_fd == -2){
+    statm_fd = open("/proc/self/statm", O_RDONLY);
+  }
+  if(statm_fd >= 0){
+    char buf[128];
+    ssize_t n = pread(statm_fd, buf, sizeof(buf)-1, 0);
+    long int size;
+    buf[(n > 0) ? n : 0] = 0;
+    if(sscanf(buf, "%ld %ld", &size, &pages) != 2){
+      pages = -1;
+    }
+  }
+  if(pages >= 0){
+    return pages * sysconf(_SC_PAGESIZE);
+  }
+  /* no /proc: the peak will have to do */
+  struct rusage r;
+  getrusage(RUSAGE_SELF, &r);
+#ifdef __APPLE__
+  return r.ru_maxrss;
+#else
+  return r.ru_maxrss * 1024;
+#endif
+}
+
+ikptr
+ikrt_resident_bytes(){
+  return fix(ik_resident_bytes());
+}
+
+/* Huge pages:
+ * With pcb->huge_pages set, heap pages are carved out of 2MB aligned
+ * chunks that are advised as transparent huge pages, which cuts the
+ * TLB misses of tracing a big heap.  The segment and dirty vectors
+ * still describe every 4KB page, and pages are still released one
+ * by one (the kernel splits a huge page that is partly unmapped).
+ * hugetlbfs mappings are not used since they cannot be partly
+ * unmapped.
+ */
+
+static ikptr
+mmap_aligned(unsigned long int size, unsigned long int alignment){
+  ikptr mem = ik_mmap(size + alignment);
+  ikptr base = (mem + alignment - 1) & ~(alignment - 1);
+  ikptr end = mem + size + alignment;
+  if(base > mem){
+    ik_munmap(mem, base - mem);
+  }
+  if(end > base + size){
+    ik_munmap(base + size, end - (base + size));
+  }
+#ifdef MADV_HUGEPAGE
+  madvise((char*)(long)base, size, MADV_HUGEPAGE);
+#endif
+  return base;
+}
+
+static void
+free_huge_chunk(ikpcb* pcb){
+  if(pcb->huge_ap < pcb->huge_ep){
+    ik_munmap(pcb->huge_ap, pcb->huge_ep - pcb->huge_ap);
+  }
+  pcb->huge_ap = 0;
+  pcb->huge_ep = 0;
+}
+
+static ikptr
+mmap_huge(unsigned long int size, ikpcb* pcb){
+  if(size >= huge_page_size){
+    return mmap_aligned(size, huge_page_size);
+  }
+  if(pcb->huge_ap + size > pcb->huge_ep){
+    free_huge_chunk(pcb);
+    pcb->huge_ap = mmap_aligned(huge_page_size, huge_page_size);
+    pcb->huge_ep = pcb->huge_ap + huge_page_size;
+  }
+  ikptr p = pcb->huge_ap;
+  pcb->huge_ap += size;
+  return p;
+}
+
+static ikptr
+mmap_heap(unsigned long int size, ikpcb* pcb){
+  if(pcb->reserve_base){
+    ikptr p = reserve_take(size, pcb);
+    if(p){
+      return p;
+    }
+  }
+  if(pcb->huge_pages){
+    return mmap_huge(size, pcb);
   }
+  if(pcb->huge_ap){
+    free_huge_chunk(pcb);
+  }
+  return ik_mmap(size);
 }
 
+/* Threads:
+ * the pages and the tables are those of the main pcb, whichever
+ * pcb is passed in, and once a thread was forked they are used under
+ * the heap lock.  Nothing done under it can cause a collection.
+ */
+void
+ik_heap_lock(ikpcb* pcb){
+  if(pcb->threads){
+    pthread_mutex_lock(&pcb->threads->heap_lock);
+  }
+}
 
+void
+ik_heap_unlock(ikpcb* pcb){
+  if(pcb->threads){
+    pthread_mutex_unlock(&pcb->threads->heap_lock);
+  }
+}
 
 ikptr
 ik_mmap_typed(unsigned long int size, unsigned int type, ikpcb* pcb){
   ikptr p;
+  pcb = pcb->main_pcb;
+  ik_heap_lock(pcb);
   if(size == pagesize) {
-    ikpage* s = pcb->cached_pages;
-    if(s){
-      p = s->base;
-      pcb->cached_pages = s->next;
-      s->next = pcb->uncached_pages;
-      pcb->uncached_pages = s; 
-    } 
-    else {
-      p = ik_mmap(size);
+    p = take_cached_page(pcb);
+    if(p == 0){
+      p = mmap_heap(size, pcb);
     }
   } 
   else {
-    p = ik_mmap(size);
+    p = take_cached_run(size, pcb);
+    if(p == 0){
+      p = mmap_heap(size, pcb);
+    }
   }
   extend_table_maybe(p, size, pcb);
   set_segment_type(p, size, type, pcb);
+  ik_heap_unlock(pcb);
   return p;
 }
 
+/* pages mapped by the caller, with a type for each of them, and
+ * clean; see ikarus-heap-image.c */
+void
+ik_adopt_pages(ikptr base, unsigned long int size, unsigned int* types,
+               ikpcb* pcb){
+  pcb = pcb->main_pcb;
+  ik_heap_lock(pcb);
+  extend_table_maybe(base, size, pcb);
+  unsigned int* segment_vec = pcb->segment_vector;
+  unsigned int* dirty_vec = (unsigned int*)(long)pcb->dirty_vector;
+  long int i = page_index(base);
+  long int j = page_index(base + size);
+  for(; i<j; i++){
+    segment_vec[i] = *types++;
+    dirty_vec[i] = 0;
+  }
+  __sync_fetch_and_add(&total_allocated_pages, page_index(size));
+  ik_heap_unlock(pcb);
+}
+
 ikptr
 ik_mmap_ptr(unsigned long int size, int gen, ikpcb* pcb){
   return ik_mmap_typed(size, pointers_mt | gen, pcb);
@@ -193,10 +784,13 @@ ik_mmap_data(unsigned long int size, int gen, ikpcb* pcb){
 
 ikptr
 ik_mmap_code(unsigned long int size, int gen, ikpcb* pcb){
+  pcb = pcb->main_pcb;
+  ik_heap_lock(pcb);
   ikptr p = ik_mmap_typed(size, code_mt | gen, pcb);
   if(size > pagesize){
     set_segment_type(p+pagesize, size-pagesize, data_mt|gen, pcb);
   }
+  ik_heap_unlock(pcb);
   return p;
 }
 
@@ -212,12 +806,12 @@ ik_mmap_mixed(unsigned long int size, ikpcb* pcb){
 ikptr
 ik_mmap(unsigned long int size){
   unsigned long int pages = (size + pagesize - 1) / pagesize;
-  total_allocated_pages += pages;
+  __sync_fetch_and_add(&total_allocated_pages, pages);
   unsigned long int mapsize = pages * pagesize;
   assert(size == mapsize);
 #ifndef __CYGWIN__
   char* mem = mmap(
-      0,
+      ik_mapping_hint(mapsize),
       mapsize,
       PROT_READ | PROT_WRITE | PROT_EXEC,
       MAP_PRIVATE | MAP_ANON,
@@ -231,7 +825,7 @@ ik_mmap(unsigned long int size){
 #else
   char* mem = win_mmap(mapsize);
 #endif
-  memset(mem, -1, mapsize);
+  poison_pages(mem, mapsize);
 #ifndef NDEBUG
   fprintf(stderr, "MMAP 0x%016lx .. 0x%016lx\n", (long int)mem,
       ((long int)(mem))+mapsize-1);
@@ -245,7 +839,7 @@ ik_munmap(ikptr mem, unsigned long int size){
   unsigned long int mapsize = pages * pagesize;
   assert(size == mapsize);
   assert(((-pagesize) & (int)mem) == (int)mem);
-  total_allocated_pages -= pages;
+  __sync_fetch_and_sub(&total_allocated_pages, pages);
 #ifndef __CYGWIN__
   int err = munmap((char*)mem, mapsize);
   if(err != 0){
@@ -270,12 +864,12 @@ ik_malloc(int size){
     fprintf(stderr, "malloc failed: %s\n", strerror(errno));
     exit(-1);
   }
-  total_malloced += size;
+  __sync_fetch_and_add(&total_malloced, size);
   return x;
 }
 
 void ik_free(void* x, int size){
-  total_malloced -= size;
+  __sync_fetch_and_sub(&total_malloced, size);
   free(x);
 }
 
@@ -286,6 +880,25 @@ ikpcb* ik_make_pcb(){
   ikpcb* pcb = ik_malloc(sizeof(ikpcb));
   bzero(pcb, sizeof(ikpcb));
   pcb->collect_key = false_object;
+  pcb->collect_threads = 1;
+  pcb->mark_slice_words = 65536;
+  pcb->compact_threshold = 50;
+  pcb->collect_radix = 4;
+  pcb->collect_growth = 100;
+  pcb->nursery_size = IK_HEAPSIZE;
+  pcb->retain_pages = RUN_CACHE_PAGES;
+  pcb->large_object_size = 4 * pagesize;
+  pcb->main_pcb = pcb;
+  pcb->tlab_size = IK_TLAB_SIZE;
+  pcb->alloc_samples = null_object;
+  pcb->boot_codes = null_object;
+  pcb->dynamic_state = null_object;
+  {
+    int i;
+    for(i=0; i<generation_count; i++){
+      pcb->gen_scale[i] = 1;
+    }
+  }
   #define STAKSIZE (1024 * 4096)
   //#define STAKSIZE (256 * 4096)
   pcb->heap_base = ik_mmap(IK_HEAPSIZE);
@@ -339,6 +952,8 @@ ikpcb* ik_make_pcb(){
     pcb->segment_vector = (unsigned int*)(long)(svec - lo_seg * pagesize);
     pcb->memory_base = (ikptr)(lo_seg * segment_size);
     pcb->memory_end = (ikptr)(hi_seg * segment_size);
+    pcb->table_base = pcb->memory_base;
+    pcb->table_end = pcb->memory_end;
     set_segment_type(pcb->heap_base, 
         pcb->heap_size,
         mainheap_mt,
@@ -362,15 +977,92 @@ ikpcb* ik_make_pcb(){
   return pcb;
 }
 
+/* A forked thread gets a pcb of its own for its stack and its
+ * allocation buffer (tlab), taken from the heap of the main pcb.
+ * It starts out parked, see ik_leave_native. */
+ikpcb*
+ik_make_thread_pcb(ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  if(main->threads == 0){
+    ik_init_threads(main);
+  }
+  ikthreads* th = main->threads;
+  ikpcb* t = ik_malloc(sizeof(ikpcb));
+  bzero(t, sizeof(ikpcb));
+  t->main_pcb = main;
+  t->threads = th;
+  t->collect_key = false_object;
+  t->tlab_size = main->tlab_size;
+  t->stack_base = ik_mmap_typed(STAKSIZE, mainstack_mt, main);
+  t->stack_size = STAKSIZE;
+  t->frame_pointer = t->stack_base + t->stack_size;
+  t->frame_base = t->frame_pointer;
+  t->frame_redline = t->stack_base + 2 * 4096;
+  t->heap_size = t->tlab_size;
+  t->heap_base = ik_mmap_mixed(t->heap_size, main);
+  t->allocation_pointer = t->heap_base;
+  t->allocation_redline = t->heap_base + t->heap_size - 2 * 4096;
+  t->thread_state = thread_running;
+  ik_heap_lock(main);
+  pthread_mutex_lock(&th->lock);
+  t->dirty_vector = main->dirty_vector;
+  t->segment_vector = main->segment_vector;
+  t->base_rtd = main->base_rtd;
+  t->thread_id = th->next_id++;
+  t->next_thread = th->list;
+  th->list = t;
+  th->tlab_bytes += t->heap_size;
+  pthread_mutex_unlock(&th->lock);
+  ik_heap_unlock(main);
+  return t;
+}
+
+/* a joined thread, off the list, whose tlab was collected */
+void
+ik_delete_thread_pcb(ikpcb* t){
+  ikpcb* main = t->main_pcb;
+  ik_munmap_from_segment(t->stack_base, t->stack_size, main);
+  ik_free(t, sizeof(ikpcb));
+}
+
 void ik_delete_pcb(ikpcb* pcb){
+  if(pcb->threads){
+    /* their pages go with the rest of the heap below */
+    ikthreads* th = pcb->threads;
+    ikpcb* t = th->list;
+    while(t){
+      ikpcb* next = t->next_thread;
+      ik_free(t, sizeof(ikpcb));
+      t = next;
+    }
+    ik_merge_retired_tables(pcb);
+    pthread_mutex_destroy(&th->heap_lock);
+    pthread_mutex_destroy(&th->lock);
+    pthread_cond_destroy(&th->parked_cv);
+    pthread_cond_destroy(&th->resume_cv);
+    ik_free(th, sizeof(ikthreads));
+    pcb->threads = 0;
+  }
   ikpage* p = pcb->cached_pages;
   pcb->cached_pages = 0;
   pcb->uncached_pages = 0;
   while(p){
-    ik_munmap(p->base, pagesize);
+    munmap_heap(p->base, pagesize, pcb);
+    p = p->next;
+  }
+  p = pcb->released_pages;
+  pcb->released_pages = 0;
+  while(p){
+    munmap_heap(p->base, pagesize, pcb);
     p = p->next;
   }
   ik_munmap(pcb->cached_pages_base, pcb->cached_pages_size);
+  free_cached_runs(&pcb->cached_runs, pcb);
+  free_cached_runs(&pcb->released_runs, pcb);
+  pcb->cached_run_pages = 0;
+  pcb->released_run_pages = 0;
+  free_huge_chunk(pcb);
+  ik_free_collect_state(pcb);
   {
     int i;
     for(i=0; i<generation_count; i++){
@@ -390,11 +1082,13 @@ void ik_delete_pcb(ikpcb* pcb){
   while(i < j){
     unsigned int t = segment_vec[i];
     if(t != hole_mt){
-      ik_munmap((ikptr)(i<<pageshift), pagesize);
+      munmap_heap((ikptr)(i<<pageshift), pagesize, pcb);
     }
     i++;
   }
-  long int vecsize = (segment_index(end) - segment_index(base)) * pagesize;
+  free_reserve(pcb);
+  long int vecsize = 
+    (segment_index(pcb->table_end) - segment_index(pcb->table_base)) * pagesize;
   ik_munmap((ikptr)(long)pcb->dirty_vector_base, vecsize);
   ik_munmap((ikptr)(long)pcb->segment_vector_base, vecsize);
   ik_free(pcb, sizeof(ikpcb));
@@ -411,7 +1105,7 @@ ik_safe_alloc(ikpcb* pcb, int size){
     return ap;
   } 
   else {
-    ik_collect(size, pcb);
+    ik_make_room(size, pcb);
     ikptr ap = pcb->allocation_pointer;
     ikptr ep = pcb->heap_base + pcb->heap_size;
     ikptr nap = ap + size;
@@ -474,6 +1168,63 @@ ik_unsafe_alloc(ikpcb* pcb, int size){
   }
 }
 
+/* The remembered set:
+ * stores done by the runtime into old objects are noted here.  With
+ * card marking they dirty the whole page of the slot, which the next
+ * minor collection rescans in full.  With pcb->remembered_set, the
+ * address of the slot is pushed on a sequential store buffer instead
+ * and the next collection updates just that slot (scan_remembered_set).
+ * A buffer that grows past ssb_max_pages is turned back into dirty
+ * cards, one card per slot.
+ */
+#define ssb_max_pages 64
+
+static void
+flush_ssb(ikpcb* pcb){
+  unsigned int* dirty_vec = (unsigned int*)(long)pcb->dirty_vector;
+  ik_ptr_page* ls = pcb->ssb;
+  while(ls){
+    int i;
+    for(i=0; i<ls->count; i++){
+      ikptr slot = ls->ptr[i];
+      long int card = (slot & (pagesize - 1)) / cardsize;
+      dirty_vec[page_index(slot)] |= 0xF << (card * meta_dirty_shift);
+    }
+    ik_ptr_page* next = ls->next;
+    ik_munmap((ikptr)ls, pagesize);
+    ls = next;
+  }
+  pcb->ssb = 0;
+  pcb->ssb_pages = 0;
+}
+
+void
+ik_remember(ikpcb* pcb, ikptr slot){
+  pcb = pcb->main_pcb;
+  if(! pcb->remembered_set){
+    ((unsigned int*)(long)pcb->dirty_vector)[page_index(slot)] = -1;
+    return;
+  }
+  if((pcb->segment_vector[page_index(slot)] & gen_mask) == 0){
+    /* young objects are always collected */
+    return;
+  }
+  ik_heap_lock(pcb);
+  ik_ptr_page* ls = pcb->ssb;
+  if((ls == NULL) || (ls->count == (long int)ik_ptr_page_size)){
+    if(pcb->ssb_pages == ssb_max_pages){
+      flush_ssb(pcb);
+    }
+    ls = (ik_ptr_page*)ik_mmap(pagesize);
+    ls->count = 0;
+    ls->next = pcb->ssb;
+    pcb->ssb = ls;
+    pcb->ssb_pages++;
+  }
+  ls->ptr[ls->count++] = slot;
+  ik_heap_unlock(pcb);
+}
+
 
 
 void ik_error(ikptr args){
@@ -488,7 +1239,9 @@ void ik_stack_overflow(ikpcb* pcb){
 #ifndef NDEBUG
   fprintf(stderr, "entered ik_stack_overflow pcb=0x%016lx\n", (long int)pcb);
 #endif
-  set_segment_type(pcb->stack_base, pcb->stack_size, data_mt, pcb);
+  ik_heap_lock(pcb);
+  set_segment_type(pcb->stack_base, pcb->stack_size, data_mt, pcb->main_pcb);
+  ik_heap_unlock(pcb);
   
   ikptr frame_base = pcb->frame_base;
   ikptr underflow_handler = ref(frame_base, -wordsize);
@@ -704,12 +1457,19 @@ ikrt_realpath(ikptr bv, ikpcb* pcb){
 }
 
 ikptr 
-ik_system(ikptr str){
+ik_system(ikptr str, ikpcb* pcb){
   if(tagof(str) == bytevector_tag){
-    int r = system((char*)(long)(str+off_bytevector_data));
+    char* command = strdup((char*)(long)(str+off_bytevector_data));
+    /* other threads may collect meanwhile */
+    ik_enter_native(pcb);
+    int r = system(command);
+    int err = errno;
+    ik_leave_native(pcb);
+    free(command);
     if(r >= 0) {  
       return fix(r);
     } else {
+      errno = err;
       return ik_errno_to_code();
     }
   } else {
@@ -828,6 +1588,8 @@ ikrt_bvftime(ikptr outbv, ikptr fmtbv){
 
 ikptr
 ikrt_register_guardian_pair(ikptr p0, ikpcb* pcb){
+  pcb = pcb->main_pcb;
+  ik_heap_lock(pcb);
   ik_ptr_page* x = pcb->protected_list[0];
   if((x == NULL) || (x->count == ik_ptr_page_size)){
     assert(sizeof(ik_ptr_page) == pagesize);
@@ -838,6 +1600,7 @@ ikrt_register_guardian_pair(ikptr p0, ikpcb* pcb){
     x = y;
   }
   x->ptr[x->count++] = p0;
+  ik_heap_unlock(pcb);
   return void_object;
 }
 
@@ -862,13 +1625,14 @@ ikrt_stats_now(ikptr t, ikpcb* pcb){
   ref(t, off_record_data + 3 * wordsize) = fix(r.ru_stime.tv_usec);
   ref(t, off_record_data + 4 * wordsize) = fix(s.tv_sec);
   ref(t, off_record_data + 5 * wordsize) = fix(s.tv_usec);
-  ref(t, off_record_data + 6 * wordsize) = fix(pcb->collection_id);
-  ref(t, off_record_data + 7 * wordsize) = fix(pcb->collect_utime.tv_sec);
-  ref(t, off_record_data + 8 * wordsize) = fix(pcb->collect_utime.tv_usec);
-  ref(t, off_record_data + 9 * wordsize) = fix(pcb->collect_stime.tv_sec);
-  ref(t, off_record_data + 10 * wordsize) = fix(pcb->collect_stime.tv_usec);
-  ref(t, off_record_data + 11 * wordsize) = fix(pcb->collect_rtime.tv_sec);
-  ref(t, off_record_data + 12 * wordsize) = fix(pcb->collect_rtime.tv_usec);
+  ikpcb* main = pcb->main_pcb; /* the collections are counted there */
+  ref(t, off_record_data + 6 * wordsize) = fix(main->collection_id);
+  ref(t, off_record_data + 7 * wordsize) = fix(main->collect_utime.tv_sec);
+  ref(t, off_record_data + 8 * wordsize) = fix(main->collect_utime.tv_usec);
+  ref(t, off_record_data + 9 * wordsize) = fix(main->collect_stime.tv_sec);
+  ref(t, off_record_data + 10 * wordsize) = fix(main->collect_stime.tv_usec);
+  ref(t, off_record_data + 11 * wordsize) = fix(main->collect_rtime.tv_sec);
+  ref(t, off_record_data + 12 * wordsize) = fix(main->collect_rtime.tv_usec);
   {
     /* minor bytes */
     long int bytes_in_heap = ((long int) pcb->allocation_pointer) -
@@ -878,6 +1642,11 @@ ikrt_stats_now(ikptr t, ikpcb* pcb){
   }
   /* major bytes */
   ref(t, off_record_data + 14 * wordsize) = fix(pcb->allocation_count_major);
+  /* as of the last collection, or #f before the first one */
+  ref(t, off_record_data + 15 * wordsize) =
+    main->gc_event_total
+      ? fix(main->gc_events[(main->gc_event_total-1) % gc_event_count].rss)
+      : false_object;
   return void_object;
 }
 
@@ -948,6 +1717,41 @@ ikrt_make_vector1(ikptr len, ikpcb* pcb){
   }
 }
 
+/* strings and bytevectors of large_object_size bytes or more get pages
+ * of their own that the collector retags instead of copying.  The
+ * pages count against the nursery so that they still cause collections.
+ */
+static ikptr
+alloc_large_data(long int memreq, ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  if(memreq < main->large_object_size){
+    return ik_safe_alloc(pcb, memreq);
+  }
+  if(main->large_object_bytes >= main->heap_size){
+    ik_collect(0, pcb);
+  }
+  long int size = align_to_next_page(memreq);
+  __sync_fetch_and_add(&main->large_object_bytes, size);
+  return ik_mmap_typed(size, data_mt | large_object_tag, pcb);
+}
+
+ikptr
+ikrt_make_bytevector(ikptr len, ikpcb* pcb){
+  long int n = unfix(len);
+  ikptr bv = alloc_large_data(align(n + disp_bytevector_data + 1), pcb);
+  ref(bv, disp_bytevector_length) = len;
+  ((char*)(long)(bv + disp_bytevector_data))[n] = 0;
+  return bv + bytevector_tag;
+}
+
+ikptr
+ikrt_make_string(ikptr len, ikpcb* pcb){
+  long int n = unfix(len);
+  ikptr s = alloc_large_data(align(n*string_char_size + disp_string_data), pcb);
+  ref(s, disp_string_length) = len;
+  return s + string_tag;
+}
+
 #if 0
 ikptr 
 ikrt_make_vector2(ikptr len, ikptr obj, ikpcb* pcb){
@@ -1010,8 +1814,11 @@ ikrt_environ(ikpcb* pcb){
 
 ikptr
 ikrt_exit(ikptr status, ikpcb* pcb){
+  if(pcb->place){
+    ik_place_exit(pcb, status);
+  }
   ik_delete_pcb(pcb);
-  assert(total_allocated_pages == 0);
+  assert(ik_live_places || (total_allocated_pages == 0));
   if(is_fixnum(status)){
     exit(unfix(status));
   } else {
@@ -1020,7 +1827,7 @@ ikrt_exit(ikptr status, ikpcb* pcb){
 }
 
 ikptr
-ikrt_nanosleep(ikptr secs, ikptr nsecs /*, ikpcb* pcb */){
+ikrt_nanosleep(ikptr secs, ikptr nsecs, ikpcb* pcb){
   struct timespec t;
   t.tv_sec = 
     is_fixnum(secs) 
@@ -1030,7 +1837,11 @@ ikrt_nanosleep(ikptr secs, ikptr nsecs /*, ikpcb* pcb */){
     is_fixnum(nsecs) 
       ? (unsigned long) unfix(nsecs)
       : ref(nsecs, off_bignum_data);
-  return fix(nanosleep(&t, NULL));
+  /* other threads may collect meanwhile */
+  ik_enter_native(pcb);
+  int rv = nanosleep(&t, NULL);
+  ik_leave_native(pcb);
+  return fix(rv);
 }
 
 ikptr
@@ -21,43 +21,61 @@
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+/* The tables:
+ * a table is a vector of buckets, a power of two of them.  A bucket is
+ * a list of symbols, each followed by its hash, so that a lookup only
+ * compares the strings of the symbols whose hash matches.  A table
+ * doubles once it holds more symbols than buckets; *count is kept in
+ * the main pcb.
+ *
+ * The pair of a symbol is weak: the collector drops the symbols with
+ * no value, no plist and nothing else to hold on to them, see
+ * keep_table_symbols in ikarus-collect.c.
+ */
+
+#define initial_buckets 4096 /* power of 2 */
 
 static ikptr
-make_symbol_table(ikpcb* pcb){
-  #define NUM_OF_BUCKETS 4096 /* power of 2 */
-  int size = align_to_next_page(disp_vector_data + NUM_OF_BUCKETS * wordsize);
+make_symbol_table(long int n, ikpcb* pcb){
+  int size = align_to_next_page(disp_vector_data + n * wordsize);
   ikptr st = ik_mmap_ptr(size, 0, pcb) + vector_tag;
   bzero((char*)(long)st-vector_tag, size);
-  ref(st, off_vector_length) = fix(NUM_OF_BUCKETS);
+  ref(st, off_vector_length) = fix(n);
   return st;
 }
 
+/* word at a time, two chars to a word.  the result is a non-negative
+ * fixnum value */
+#define hash_mult 0x9E3779B97F4A7C15ULL
 
-/* one-at-a-time from http://burtleburtle.net/bob/hash/doobs.html */
 static long int 
 compute_hash(ikptr str){
   long int len = unfix(ref(str, off_string_length));
-  int* data = (int*)(str + off_string_data);
-  int h = len;
-  int* last = data + len;
-
-  /* one-at-a-time */
-  while(data < last){
-    int c = (*data >> 8);
-    h = h + c;
-    h = h + (h << 10);
-    h = h ^ (h >> 6);
-    data++;
+  char* data = (char*)(long)(str + off_string_data);
+  char* last = data + len * string_char_size;
+  uint64_t h = len;
+  while(data + sizeof(uint64_t) <= last){
+    uint64_t w;
+    memcpy(&w, data, sizeof(uint64_t));
+    h = (((h << 5) | (h >> 59)) ^ w) * hash_mult;
+    data += sizeof(uint64_t);
+  }
+  if(data < last){
+    uint32_t w;
+    memcpy(&w, data, sizeof(uint32_t));
+    h = (((h << 5) | (h >> 59)) ^ w) * hash_mult;
   }
-  h = h + (h << 3);
-  h = h ^ (h >> 11);
-  h = h + (h << 15);
-  return (h >= 0) ? h : (1 - h);
+  h ^= h >> 32;
+  h *= hash_mult;
+  h ^= h >> 29;
+  return (long int)(h >> (64 - (8 * wordsize - fx_shift - 1)));
 }
 
 ikptr 
 ikrt_string_hash(ikptr str){
-  return (ikptr)(compute_hash(str) & (~ fx_mask));
+  return fix(compute_hash(str));
 }
 
 static int strings_eqp(ikptr str1, ikptr str2){
@@ -84,84 +102,97 @@ ik_make_symbol(ikptr str, ikptr ustr, ikpcb* pcb){
   return sym;
 }
 
+static ikptr*
+bucket_of(ikptr st, long int h){
+  long int idx = h & (unfix(ref(st, off_vector_length)) - 1);
+  return (ikptr*)(long)(st + off_vector_data + idx*wordsize);
+}
+
+/* returns the symbol in st whose string (or unique string, with
+ * field off_symbol_record_ustring) is str, or 0 */
 static ikptr
-intern_string(ikptr str, ikptr st, ikpcb* pcb){
-  int h = compute_hash(str);
-  int idx = h & (unfix(ref(st, off_vector_length)) - 1);
-  ikptr bckt = ref(st, off_vector_data + idx*wordsize);
-  ikptr b = bckt;
+lookup(ikptr st, ikptr str, long int h, long int field){
+  ikptr b = *bucket_of(st, h);
+  ikptr fh = fix(h);
   while(b){
     ikptr sym = ref(b, off_car);
-    ikptr sym_str = ref(sym, off_symbol_record_string);
-    if(strings_eqp(sym_str, str)){
+    ikptr hb = ref(b, off_cdr);
+    if((ref(hb, off_car) == fh) && strings_eqp(ref(sym, field), str)){
       return sym;
     }
-    b = ref(b, off_cdr);
-  }
-  ikptr sym = ik_make_symbol(str, false_object,  pcb);
-  b = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
-  ref(b, off_car) = sym;
-  ref(b, off_cdr) = bckt;
-  ref(st, off_vector_data + idx*wordsize) = b;
-  ((int*)(long)pcb->dirty_vector)[page_index(st+off_vector_data+idx*wordsize)] = -1;
-  return sym;
+    b = ref(hb, off_cdr);
+  }
+  return 0;
 }
 
+/* moves the entries of st to a table of twice the buckets */
 static ikptr
-intern_unique_string(ikptr str, ikptr ustr, ikptr st, ikpcb* pcb){
-  int h = compute_hash(ustr);
-  int idx = h & (unfix(ref(st, off_vector_length)) - 1);
-  ikptr bckt = ref(st, off_vector_data + idx*wordsize);
-  ikptr b = bckt;
-  while(b){
-    ikptr sym = ref(b, off_car);
-    ikptr sym_ustr = ref(sym, off_symbol_record_ustring);
-    if(strings_eqp(sym_ustr, ustr)){
-      return sym;
+grow_table(ikptr st, ikpcb* pcb){
+  long int n = unfix(ref(st, off_vector_length));
+  ikptr new_st = make_symbol_table(2*n, pcb);
+  long int i;
+  for(i=0; i<n; i++){
+    ikptr b = ref(st, off_vector_data + i*wordsize);
+    while(b){
+      ikptr hb = ref(b, off_cdr);
+      ikptr next = ref(hb, off_cdr);
+      ikptr* loc = bucket_of(new_st, unfix(ref(hb, off_car)));
+      ref(hb, off_cdr) = *loc;
+      ik_remember(pcb, hb+off_cdr);
+      *loc = b;
+      b = next;
     }
-    b = ref(b, off_cdr);
-  }
-  ikptr sym = ik_make_symbol(str, ustr, pcb);
-  b = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
-  ref(b, off_car) = sym;
-  ref(b, off_cdr) = bckt;
-  ref(st, off_vector_data + idx*wordsize) = b;
-  ((int*)(long)pcb->dirty_vector)[page_index(st+off_vector_data+idx*wordsize)] = -1;
-  return sym;
+  }
+  return new_st;
 }
 
-ikptr
-ikrt_intern_gensym(ikptr sym, ikpcb* pcb){
-  ikptr st = pcb->gensym_table;
-  if(st == 0){
-    st = make_symbol_table(pcb);
-    pcb->gensym_table = st;
+/* adds sym with hash h to the table at *stp, and counts it in *count */
+static void
+insert(ikptr* stp, long int* count, ikptr sym, long int h, ikpcb* pcb){
+  ikptr st = *stp;
+  ikptr* loc = bucket_of(st, h);
+  ikptr hb = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
+  ref(hb, off_car) = fix(h);
+  ref(hb, off_cdr) = *loc;
+  ikptr b = ikrt_weak_cons(sym, hb, pcb);
+  *loc = b;
+  ik_remember(pcb, (ikptr)(long)loc);
+  *count += 1;
+  if(*count > unfix(ref(st, off_vector_length))){
+    *stp = grow_table(st, pcb);
+  }
+}
+
+/* the tables are those of the main pcb, used under the heap lock
+ * by forked threads; nothing below can cause a collection */
+
+static ikptr
+intern_gensym(ikptr sym, ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  if(main->gensym_table == 0){
+    main->gensym_table = make_symbol_table(initial_buckets, pcb);
   }
   ikptr ustr = ref(sym, off_symbol_record_ustring);
-  int h = compute_hash(ustr);
-  int idx = h & (unfix(ref(st, off_vector_length)) - 1);
-  ikptr bckt = ref(st, off_vector_data + idx*wordsize);
-  ikptr b = bckt;
-  while(b){
-    ikptr sym = ref(b, off_car);
-    ikptr sym_ustr = ref(sym, off_symbol_record_ustring);
-    if(strings_eqp(sym_ustr, ustr)){
-      return false_object;
-    }
-    b = ref(b, off_cdr);
+  long int h = compute_hash(ustr);
+  if(lookup(main->gensym_table, ustr, h, off_symbol_record_ustring)){
+    return false_object;
   }
-  b = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
-  ref(b, off_car) = sym;
-  ref(b, off_cdr) = bckt;
-  ref(st, off_vector_data + idx*wordsize) = b;
-  ((int*)(long)pcb->dirty_vector)[page_index(st+off_vector_data+idx*wordsize)] = -1;
+  insert(&main->gensym_table, &main->gensym_count, sym, h, pcb);
   return true_object;
 }
 
-
 ikptr
-ikrt_unintern_gensym(ikptr sym, ikpcb* pcb){
-  ikptr st = pcb->gensym_table;
+ikrt_intern_gensym(ikptr sym, ikpcb* pcb){
+  ik_heap_lock(pcb);
+  ikptr r = intern_gensym(sym, pcb);
+  ik_heap_unlock(pcb);
+  return r;
+}
+
+static ikptr
+unintern_gensym(ikptr sym, ikpcb* pcb){
+  ikpcb* main = pcb->main_pcb;
+  ikptr st = main->gensym_table;
   if(st == 0){
     /* no symbol table */
     return false_object;
@@ -170,24 +201,32 @@ ikrt_unintern_gensym(ikptr sym, ikpcb* pcb){
   if (tagof(ustr) != string_tag) {
     return false_object;
   }
-  int h = compute_hash(ustr);
-  int idx = h & (unfix(ref(st, off_vector_length)) - 1);
-  ikptr loc = (ikptr)(st+off_vector_data+idx*wordsize);
+  ikptr loc = (ikptr)(long)bucket_of(st, compute_hash(ustr));
   ikptr bckt = ref(loc, 0);
   while(bckt){
+    ikptr hb = ref(bckt, off_cdr);
     if (ref(bckt, off_car) == sym) {
       /* found it */
       ref(sym, off_symbol_record_ustring) = true_object;
-      ref(loc, 0) = ref(bckt, off_cdr);
+      ref(loc, 0) = ref(hb, off_cdr);
+      main->gensym_count--;
       return true_object;
     } else {
-      loc = (ikptr)(bckt + off_cdr);
+      loc = (ikptr)(hb + off_cdr);
       bckt = ref(loc, 0);
     }
   }
   return false_object;
 }
 
+ikptr
+ikrt_unintern_gensym(ikptr sym, ikpcb* pcb){
+  ik_heap_lock(pcb);
+  ikptr r = unintern_gensym(sym, pcb);
+  ik_heap_unlock(pcb);
+  return r;
+}
+
 ikptr
 ikrt_get_symbol_table(ikpcb* pcb){
   ikptr st = pcb->symbol_table;
@@ -202,16 +241,24 @@ ikrt_get_symbol_table(ikpcb* pcb){
 
 ikptr 
 ikrt_string_to_symbol(ikptr str, ikpcb* pcb){
-  ikptr st = pcb->symbol_table;
+  ikpcb* main = pcb->main_pcb;
+  ik_heap_lock(pcb);
+  ikptr st = main->symbol_table;
   if(st == false_object) {
     fprintf(stderr, "bug in ikarus, attempt to access dead symbol table\n");
     exit(-1);
   }
   if(st == 0){
-    st = make_symbol_table(pcb);
-    pcb->symbol_table = st;
+    main->symbol_table = make_symbol_table(initial_buckets, pcb);
+  }
+  long int h = compute_hash(str);
+  ikptr sym = lookup(main->symbol_table, str, h, off_symbol_record_string);
+  if(sym == 0){
+    sym = ik_make_symbol(str, false_object, pcb);
+    insert(&main->symbol_table, &main->symbol_count, sym, h, pcb);
   }
-  return intern_string(str, st, pcb);
+  ik_heap_unlock(pcb);
+  return sym;
 }
 
 ikptr 
@@ -221,12 +268,17 @@ ik_intern_string(ikptr str, ikpcb* pcb){
 
 ikptr 
 ikrt_strings_to_gensym(ikptr str, ikptr ustr, ikpcb* pcb){
-  ikptr st = pcb->gensym_table;
-  if(st == 0){
-    st = make_symbol_table(pcb);
-    pcb->gensym_table = st;
+  ikpcb* main = pcb->main_pcb;
+  ik_heap_lock(pcb);
+  if(main->gensym_table == 0){
+    main->gensym_table = make_symbol_table(initial_buckets, pcb);
+  }
+  long int h = compute_hash(ustr);
+  ikptr sym = lookup(main->gensym_table, ustr, h, off_symbol_record_ustring);
+  if(sym == 0){
+    sym = ik_make_symbol(str, ustr, pcb);
+    insert(&main->gensym_table, &main->gensym_count, sym, h, pcb);
   }
-  return intern_unique_string(str, ustr, st, pcb);
+  ik_heap_unlock(pcb);
+  return sym;
 }
-
-
@@ -0,0 +1,308 @@
+/*
+ *  Ikarus Scheme -- A compiler for R6RS Scheme.
+ *  Copyright (C) 2006,2007,2008  Abdulaziz Ghuloum
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "ikarus-data.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Threads:
+ * fork-thread runs a thunk in an OS thread of its own, with a pcb of
+ * its own (ik_make_thread_pcb) and the heap of the main pcb.  The
+ * threads that run scheme code are counted in threads->running.
+ *
+ * A collection needs the world stopped: the collecting thread sets
+ * threads->stopping, and sets the engine counter of every other thread
+ * so that it calls $do-event, and with it ikrt_safepoint, soon.  The
+ * threads stop there, or when they overflow, and the collection starts
+ * once the collecting thread is the only one running.  A thread that
+ * blocks outside of scheme (thread-join, nanosleep, reading, writing,
+ * accept, select, waitpid, system) counts as stopped meanwhile, see
+ * ik_enter_native and ikarus-io.c.
+ *
+ * Every thread has a dynamic state of its own in its pcb, its winders
+ * and the cells of its parameters; fork-thread gives the new thread
+ * copies of the cells of its parent.
+ */
+
+/* on the main pcb, when it forks its first thread */
+void
+ik_init_threads(ikpcb* pcb){
+  ikthreads* th = ik_malloc(sizeof(ikthreads));
+  bzero(th, sizeof(ikthreads));
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&th->heap_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_mutex_init(&th->lock, 0);
+  pthread_cond_init(&th->parked_cv, 0);
+  pthread_cond_init(&th->resume_cv, 0);
+  th->running = 1;
+  th->next_id = 1;
+  pcb->threads = th;
+}
+
+/* with th->lock held */
+static void
+park(ikthreads* th){
+  th->running--;
+  pthread_cond_broadcast(&th->parked_cv);
+  while(th->stopping){
+    pthread_cond_wait(&th->resume_cv, &th->lock);
+  }
+  th->running++;
+}
+
+void
+ik_enter_native(ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  if(th){
+    pthread_mutex_lock(&th->lock);
+    th->running--;
+    pthread_cond_broadcast(&th->parked_cv);
+    pthread_mutex_unlock(&th->lock);
+  }
+}
+
+void
+ik_leave_native(ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  if(th){
+    pthread_mutex_lock(&th->lock);
+    while(th->stopping){
+      pthread_cond_wait(&th->resume_cv, &th->lock);
+    }
+    th->running++;
+    pthread_mutex_unlock(&th->lock);
+  }
+}
+
+/* the thread's value is in pcb->thread_value */
+void
+ik_thread_finish(ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  pthread_mutex_lock(&th->lock);
+  pcb->thread_state = thread_done;
+  th->running--;
+  pthread_cond_broadcast(&th->parked_cv);
+  pthread_cond_broadcast(&th->resume_cv);
+  pthread_mutex_unlock(&th->lock);
+}
+
+/* with th->lock held */
+static void
+request_stop(ikpcb* t){
+  if(! t->stop_requested){
+    t->saved_engine_counter = t->engine_counter;
+    t->stop_requested = 1;
+  }
+  t->engine_counter = fix(-1);
+}
+
+static void
+poke_threads(ikpcb* self, ikthreads* th){
+  ikpcb* main = self->main_pcb;
+  if(main != self){
+    request_stop(main);
+  }
+  ikpcb* t;
+  for(t=th->list; t; t=t->next_thread){
+    if((t != self) && (t->thread_state == thread_running)){
+      request_stop(t);
+    }
+  }
+}
+
+#define stop_poke_usecs 1000
+
+/* returns 0 if another thread collected meanwhile instead */
+int
+ik_stop_world(ikpcb* self){
+  ikthreads* th = self->threads;
+  if(th == 0){
+    return 1;
+  }
+  pthread_mutex_lock(&th->lock);
+  if(th->stopping){
+    park(th);
+    pthread_mutex_unlock(&th->lock);
+    return 0;
+  }
+  th->stopping = 1;
+  while(th->running > 1){
+    /* a thread may lose the poke to its own update of the counter,
+       so it is poked again until it stops */
+    poke_threads(self, th);
+    struct timeval now;
+    gettimeofday(&now, 0);
+    long int usecs = now.tv_usec + stop_poke_usecs;
+    struct timespec until;
+    until.tv_sec = now.tv_sec + usecs / 1000000;
+    until.tv_nsec = (usecs % 1000000) * 1000;
+    pthread_cond_timedwait(&th->parked_cv, &th->lock, &until);
+  }
+  pthread_mutex_unlock(&th->lock);
+  return 1;
+}
+
+static void
+resume_engine(ikpcb* t){
+  if(t->stop_requested){
+    t->engine_counter = t->saved_engine_counter;
+    t->stop_requested = 0;
+  }
+}
+
+void
+ik_restart_world(ikpcb* self){
+  ikthreads* th = self->threads;
+  if(th == 0){
+    return;
+  }
+  pthread_mutex_lock(&th->lock);
+  th->stopping = 0;
+  /* those that did not get to a safepoint */
+  resume_engine(self->main_pcb);
+  ikpcb* t;
+  for(t=th->list; t; t=t->next_thread){
+    resume_engine(t);
+  }
+  pthread_cond_broadcast(&th->resume_cv);
+  pthread_mutex_unlock(&th->lock);
+}
+
+/* called by $do-event, returns true if the event was only a request
+ * to stop for a collection */
+ikptr
+ikrt_safepoint(ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  if(th == 0){
+    return false_object;
+  }
+  pthread_mutex_lock(&th->lock);
+  int poked = pcb->stop_requested;
+  resume_engine(pcb);
+  if(th->stopping){
+    park(th);
+  }
+  pthread_mutex_unlock(&th->lock);
+  return poked ? true_object : false_object;
+}
+
+static void*
+thread_main(void* arg){
+  ikpcb* t = arg;
+  ik_current_pcb = t;
+  ik_leave_native(t);
+  ikptr thunk = t->thread_value;
+  ikptr code_ptr = ref(thunk, off_closure_code) - off_code_data;
+  t->frame_pointer = t->frame_base;
+  t->thread_value = ik_exec_code(t, code_ptr, 0, thunk);
+  ik_thread_finish(t);
+  return 0;
+}
+
+ikptr
+ikrt_fork_thread(ikptr thunk, ikptr state, ikpcb* pcb){
+  /* the trap handler copies code in for one thread only */
+  ik_materialize_code(pcb->main_pcb);
+  ikpcb* t = ik_make_thread_pcb(pcb);
+  t->thread_value = thunk;
+  t->dynamic_state = state;
+  int err = pthread_create(&t->thread, 0, thread_main, t);
+  if(err){
+    fprintf(stderr, "ikarus: cannot create thread: %s\n", strerror(err));
+    /* the next collection takes it back */
+    t->thread_joining = 1;
+    t->thread_state = thread_joined;
+    return false_object;
+  }
+  return fix(t->thread_id);
+}
+
+/* returns (value) once the thread is done, or #f if there is no
+ * such thread, or it was joined already */
+ikptr
+ikrt_thread_join(ikptr id, ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  if(th == 0){
+    return false_object;
+  }
+  ik_enter_native(pcb);
+  pthread_mutex_lock(&th->lock);
+  ikpcb* t = th->list;
+  while(t && (t->thread_id != unfix(id))){
+    t = t->next_thread;
+  }
+  if((t == 0) || t->thread_joining){
+    pthread_mutex_unlock(&th->lock);
+    ik_leave_native(pcb);
+    return false_object;
+  }
+  t->thread_joining = 1;
+  while(t->thread_state != thread_done){
+    pthread_cond_wait(&th->resume_cv, &th->lock);
+  }
+  pthread_mutex_unlock(&th->lock);
+  pthread_join(t->thread, 0);
+  ik_leave_native(pcb);
+  /* no collection until the value is out */
+  ikptr p = ik_unsafe_alloc(pcb, pair_size) + pair_tag;
+  ref(p, off_car) = t->thread_value;
+  ref(p, off_cdr) = null_object;
+  pthread_mutex_lock(&th->lock);
+  t->thread_state = thread_joined;
+  pthread_mutex_unlock(&th->lock);
+  return p;
+}
+
+/* the winders and parameter cells of this thread, see
+ * ikarus.handlers.ss */
+ikptr
+ikrt_dynamic_state(ikpcb* pcb){
+  return pcb->dynamic_state;
+}
+
+ikptr
+ikrt_set_dynamic_state(ikptr state, ikpcb* pcb){
+  pcb->dynamic_state = state;
+  return void_object;
+}
+
+/* the number of forked threads not joined yet */
+ikptr
+ikrt_thread_count(ikpcb* pcb){
+  ikthreads* th = pcb->threads;
+  long int n = 0;
+  if(th){
+    pthread_mutex_lock(&th->lock);
+    ikpcb* t;
+    for(t=th->list; t; t=t->next_thread){
+      if(t->thread_state != thread_joined){
+        n++;
+      }
+    }
+    pthread_mutex_unlock(&th->lock);
+  }
+  return fix(n);
+}
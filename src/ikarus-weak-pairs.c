@@ -19,21 +19,38 @@
 
 #include "ikarus-data.h"
 
+/* the main pcb allocates weak pairs from a weak nursery that the
+ * collector leaves in place and hands back empty.  When it fills up
+ * before the next collection, a fresh one takes its place and the old
+ * pages go away with the rest of generation 0.  Threads take a page at
+ * a time.
+ */
+static ikptr
+weak_pairs_refill(ikpcb* pcb){
+  if(pcb->main_pcb != pcb){
+    ikptr mem = ik_mmap_typed(pagesize, weak_pairs_mt, pcb);
+    pcb->weak_pairs_ap = mem;
+    pcb->weak_pairs_ep = mem + pagesize;
+    return mem;
+  }
+  ikptr mem = ik_mmap_typed(IK_WEAK_NURSERY_SIZE, weak_pairs_mt, pcb);
+  pcb->weak_pairs_base = mem;
+  pcb->weak_pairs_end = mem + IK_WEAK_NURSERY_SIZE;
+  pcb->weak_pairs_ap = mem;
+  pcb->weak_pairs_ep = mem + IK_WEAK_NURSERY_SIZE;
+  return mem;
+}
+
 ikptr
 ikrt_weak_cons(ikptr a, ikptr d, ikpcb* pcb){
   ikptr ap = pcb->weak_pairs_ap;
   ikptr nap = ap + pair_size;
-  ikptr p;
   if(nap > pcb->weak_pairs_ep){
-    ikptr mem = ik_mmap_typed(pagesize, weak_pairs_mt, pcb);
-    pcb->weak_pairs_ap = mem + pair_size;
-    pcb->weak_pairs_ep = mem + pagesize;
-    p = mem + pair_tag;
-  }
-  else {
-    pcb->weak_pairs_ap = nap;
-    p = ap + pair_tag;
+    ap = weak_pairs_refill(pcb);
+    nap = ap + pair_size;
   }
+  pcb->weak_pairs_ap = nap;
+  ikptr p = ap + pair_tag;
   ref(p, off_car) = a;
   ref(p, off_cdr) = d;
   return p;
@@ -53,3 +70,38 @@ ikrt_is_weak_pair(ikptr x, ikpcb* pcb){
 }
 
 
+/* an ephemeron holds on to its value only as long as something other
+ * than the value holds on to its key.  It never changes, and the
+ * collector does the rest, see trace_ephemerons. */
+ikptr
+ikrt_make_ephemeron(ikptr key, ikptr value, ikpcb* pcb){
+  pcb->root0 = &key;
+  pcb->root1 = &value;
+  ikptr e = ik_safe_alloc(pcb, ephemeron_size) + vector_tag;
+  pcb->root0 = 0;
+  pcb->root1 = 0;
+  ref(e, -vector_tag) = ephemeron_tag;
+  ref(e, off_ephemeron_key) = key;
+  ref(e, off_ephemeron_value) = value;
+  ref(e, disp_ephemeron_unused - vector_tag) = 0;
+  return e;
+}
+
+ikptr
+ikrt_is_ephemeron(ikptr x, ikpcb* pcb){
+  if((tagof(x) == vector_tag) && (ref(x, -vector_tag) == ephemeron_tag)){
+    return true_object;
+  } else {
+    return false_object;
+  }
+}
+
+ikptr
+ikrt_ephemeron_key(ikptr x, ikpcb* pcb){
+  return ref(x, off_ephemeron_key);
+}
+
+ikptr
+ikrt_ephemeron_value(ikptr x, ikpcb* pcb){
+  return ref(x, off_ephemeron_value);
+}
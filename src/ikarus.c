@@ -49,6 +49,32 @@ Options for running ikarus scheme:\n\
   initialized.  If the -b option is not supplied, the default boot\n\
   file is used.  The current default boot file location is\n\
   \"%s\".\n\
+\n\
+  The heap options may be given after the -b option and before any\n\
+  other arguments:\n\
+    --nursery-size <bytes>  bytes allocated between collections\n\
+    --heap-growth <percent> grow the nursery to this percent of the\n\
+                            older generations (0, the default, never)\n\
+    --max-heap <bytes>      exit when the live data does not fit\n\
+    --huge-pages            map the heap in 2MB transparent huge pages\n\
+    --lazy-code             copy the code of the boot file in only when\n\
+                            it is first called\n\
+    --reserve <bytes>       reserve this much address space for the\n\
+                            heap up front, at a fixed address, which\n\
+                            save-heap-image needs (64g on 64-bit systems\n\
+                            and 64m on 32-bit ones for image files, 0\n\
+                            for none; no reserve otherwise)\n\
+  where <bytes> may be suffixed with k, m, or g.\n\
+\n  ikarus [-b <bootfile>] --write-boot-image <imagefile>\n\
+    Reads the boot file and writes the heap it makes to the image\n\
+    file, which may then be given to -b in place of the boot file.\n\
+    It is mapped in, not read, and starts up faster.\n\
+\n  ikarus [-b <bootfile>] --resume <imagefile> [heap options] opts ...\n\
+    Maps in the heap that save-heap-image wrote to the image file and\n\
+    calls the thunk given to it, with the image file and the options\n\
+    opts ... as the command line.  The heap is mapped at the addresses\n\
+    it was saved from, so the image is for the ikarus executable that\n\
+    saved it and cannot be resumed where they are taken.\n\
   Consult the Ikarus Scheme User's Guide for more details.\n\n";
   fprintf(stderr, helpstring, BOOTFILE);
 }